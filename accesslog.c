@@ -0,0 +1,427 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <poll.h>
+#include    <pthread.h>
+#include    <signal.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/eventfd.h>
+#include    <sys/uio.h>
+#include    <time.h>
+#include    <unistd.h>
+#include    "accesslog.h"
+#include    "stats.h"
+
+/*
+ * accesslog.c - the access log, written off the request path
+ *
+ * each thread that logs gets a ring of RING_SIZE bytes.  the thread
+ * is the only writer of the ring's head and the flusher the only
+ * writer of its tail, so neither takes a lock: a line is copied in
+ * and then the head is moved past it with a release store, and the
+ * flusher, having seen the head with an acquire load, writes out
+ * everything up to it (in at most two pieces per ring, all rings in
+ * one writev) and moves the tail.  a line that does not fit is
+ * dropped and counted in the stats at once, since the flusher may be
+ * the thing that is stuck.
+ *
+ * the flusher wakes every FLUSH_MS, or sooner when a ring passes
+ * half full.  it is started by the first line a process logs, so a
+ * prefork worker has its own; pthread_atfork forgets the parent's
+ * rings and flusher in a new child.  a thread that finds all
+ * MAX_RINGS taken remembers that, and its lines are dropped and
+ * counted like those that do not fit.
+ *
+ * a fork mode child serves one connection and exits, so a ring and
+ * a flusher thread would cost more than they save; without queued
+ * each line is written to the file as it is made.
+ *
+ * rotation: rename the file, then send SIGUSR1.  the handler opens
+ * the path again and puts the new file on the old descriptor with
+ * dup3, which is safe in a signal handler and leaves the flusher
+ * writing to whichever file it was given.
+ *
+ * a line is Common Log Format, or Combined with the Referer and
+ * User-Agent, followed by two timings in microseconds: rt, first
+ * byte of the request in to reply ready, and pt, first byte in to
+ * parsed.  time to the last byte sent is in the "total" histograms
+ * of /server-status, and time from accept in "accept-parse".
+ */
+
+#define RING_SIZE   (256 * 1024)
+#define LINE_LEN    2048
+#define MAX_RINGS   64
+#define FLUSH_MS    100
+
+typedef struct ring {
+    char            buf[RING_SIZE];
+    unsigned long   head;           /* bytes ever put in            */
+    unsigned long   tail;           /* bytes ever written out       */
+} ring;
+
+static int      logfd = -1;         /* -1: not logging              */
+static char     logpath[PATH_MAX];  /* empty for stdout             */
+static int      logformat;
+static int      queued;             /* 0: write each line at once    */
+
+static ring*    rings[MAX_RINGS];
+static int      nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ring* mine;
+static __thread int ringless;       /* my_ring failed in this thread */
+
+static pthread_t flusher;
+static int      running;            /* flusher started, this process */
+static int      stopping;
+static int      wakefd = -1;        /* eventfd the flusher polls    */
+
+static void     after_fork(void);
+static void*    flush_loop(void* arg);
+
+
+/*
+ * accesslog_open -- start logging to path; a relative path is taken
+ *                   from the current directory, now and at rotation
+ *    args: queue 0 writes each line in accesslog_write, for fork mode
+ */
+void accesslog_open(char* path, int format, int queue)
+{
+    char    cwd[PATH_MAX];
+
+    logformat = format;
+    queued = queue;
+    if (strcmp(path, "-") == 0)
+        logfd = 1;
+    else {
+        if (path[0] == '/')
+            cwd[0] = '\0';
+        else if (getcwd(cwd, sizeof(cwd)) == NULL)
+            strcpy(cwd, ".");
+        if (snprintf(logpath, sizeof(logpath), "%s%s%s", cwd,
+                     cwd[0] ? "/" : "", path) >= (int) sizeof(logpath)) {
+            fprintf(stderr, "access_log: path too long\n");
+            return;
+        }
+        logfd = open(logpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                     0644);
+        if (logfd == -1) {
+            perror(logpath);
+            return;
+        }
+    }
+    pthread_atfork(NULL, NULL, after_fork);
+    signal(SIGUSR1, accesslog_rotate);
+}
+
+
+void accesslog_rotate(int signum)
+{
+    int fd, saved = errno;
+
+    if (logpath[0] != '\0' && logfd != -1) {
+        fd = open(logpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            dup3(fd, logfd, O_CLOEXEC);
+            close(fd);
+        }
+    }
+    errno = saved;
+}
+
+
+/*
+ * a new process starts with no rings and no flusher; the parent's
+ * were copied, but the thread that emptied them was not
+ */
+static void after_fork(void)
+{
+    int i;
+
+    for (i = 0; i < nrings; i++)
+        free(rings[i]);
+    nrings = 0;
+    mine = NULL;
+    ringless = 0;
+    running = stopping = 0;
+    if (wakefd != -1)
+        close(wakefd);
+    wakefd = -1;
+    pthread_mutex_init(&rings_lock, NULL);
+}
+
+
+/*
+ * start the flusher, with every signal blocked so they go to the
+ * threads that serve requests
+ */
+static void start_flusher(void)
+{
+    sigset_t all, old;
+
+    if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        perror("eventfd");
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0)
+        running = 1;
+    else
+        perror("access log flusher");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/*
+ * this thread's ring, made and handed to the flusher the first time
+ *    rets: NULL if there is no room for another ring, then and from
+ *          then on without asking again
+ */
+static ring* my_ring(void)
+{
+    ring* r = NULL;
+
+    if (ringless)
+        return NULL;
+    pthread_mutex_lock(&rings_lock);
+    if (!running)
+        start_flusher();
+    if (nrings < MAX_RINGS && (r = calloc(1, sizeof(ring))) != NULL) {
+        rings[nrings] = r;
+        __atomic_store_n(&nrings, nrings + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    ringless = (r == NULL);
+    return mine = r;
+}
+
+
+/*
+ * [day/month/year:hour:minute:second zone], made once a second
+ */
+static char* log_time(void)
+{
+    static __thread char stamp[40];
+    static __thread time_t made = -1;
+    time_t  now = time(NULL);
+    struct tm tm;
+
+    if (now != made) {
+        localtime_r(&now, &tm);
+        strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        made = now;
+    }
+    return stamp;
+}
+
+
+/*
+ * put_esc -- copy len bytes of s to out, with quotes, backslashes
+ *            and unprintable bytes escaped
+ *    rets: bytes put, never more than room
+ */
+static int put_esc(char* out, int room, char* s, int len)
+{
+    static char hex[] = "0123456789abcdef";
+    unsigned char ch;
+    int n = 0;
+
+    if (s == NULL || len <= 0) {
+        if (room > 0)
+            out[n++] = '-';
+        return n;
+    }
+    for (; len > 0 && n + 4 <= room; s++, len--) {
+        ch = *s;
+        if (ch == '"' || ch == '\\') {
+            out[n++] = '\\';
+            out[n++] = ch;
+        } else if (ch < 0x20 || ch >= 0x7f) {
+            out[n++] = '\\';
+            out[n++] = 'x';
+            out[n++] = hex[ch >> 4];
+            out[n++] = hex[ch & 15];
+        } else
+            out[n++] = ch;
+    }
+    return n;
+}
+
+
+/*
+ * format_line -- the log line for one reply
+ *    rets: its length
+ */
+static int format_line(char* line, char* peer, request* rq, slice* target,
+                       int status, long long bytes, long long begin,
+                       long long parsed)
+{
+    char    *p = line, *end = line + LINE_LEN - 128;  /* room for numbers */
+    slice   *ref, *agent;
+
+    p += snprintf(p, end - p, "%s - - [%s] \"", peer, log_time());
+    p += put_esc(p, end - p, rq->method.ptr, rq->method.len);
+    *p++ = ' ';
+    p += put_esc(p, end - p, target->ptr, target->len);
+    if (rq->version.len > 0) {
+        *p++ = ' ';
+        p += put_esc(p, end - p, rq->version.ptr, rq->version.len);
+    }
+    p += sprintf(p, "\" %d ", status);
+    if (bytes > 0)
+        p += sprintf(p, "%lld", bytes);
+    else
+        *p++ = '-';
+    if (logformat == LOG_COMBINED) {
+        ref = rq_header(rq, "Referer");
+        agent = rq_header(rq, "User-Agent");
+        p += sprintf(p, " \"");
+        p += put_esc(p, (end - p) / 2, ref ? ref->ptr : NULL,
+                     ref ? ref->len : 0);
+        p += sprintf(p, "\" \"");
+        p += put_esc(p, end - p, agent ? agent->ptr : NULL,
+                     agent ? agent->len : 0);
+        *p++ = '"';
+    }
+    p += sprintf(p, " rt=%lld pt=%lld\n", stats_now() - begin,
+                 parsed > begin ? parsed - begin : 0);
+    return p - line;
+}
+
+
+/*
+ * accesslog_write -- queue the line for one reply
+ *    args: peer is the client's address, target the target as sent
+ *          (rq's may have been rewritten), bytes the length of the
+ *          body, begin and parsed stats_now() times
+ */
+void accesslog_write(char* peer, request* rq, slice* target, int status,
+                     long long bytes, long long begin, long long parsed)
+{
+    char    line[LINE_LEN];
+    unsigned long head, used;
+    size_t  len, off, first;
+    uint64_t one = 1;
+
+    if (logfd == -1)
+        return;
+    if (queued && mine == NULL && my_ring() == NULL) {
+        stats_log_dropped(1);
+        return;
+    }
+    len = format_line(line, peer, rq, target, status, bytes, begin, parsed);
+    if (!queued) {
+        if (write(logfd, line, len) == -1)
+            stats_log_dropped(1);
+        return;
+    }
+
+    head = mine->head;
+    used = head - __atomic_load_n(&mine->tail, __ATOMIC_ACQUIRE);
+    if (RING_SIZE - used < len) {
+        stats_log_dropped(1);
+        return;
+    }
+    off = head % RING_SIZE;
+    first = (off + len > RING_SIZE) ? RING_SIZE - off : len;
+    memcpy(mine->buf + off, line, first);
+    memcpy(mine->buf, line + first, len - first);
+    __atomic_store_n(&mine->head, head + len, __ATOMIC_RELEASE);
+
+    if (used < RING_SIZE / 2 && used + len >= RING_SIZE / 2 && wakefd != -1)
+        if (write(wakefd, &one, sizeof(one)) == -1) {}
+}
+
+
+/*
+ * write all of iov, picking up after short writes
+ */
+static void write_all(struct iovec* iov, int n)
+{
+    ssize_t done;
+
+    while (n > 0) {
+        if ((done = writev(logfd, iov, n)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return;                 /* nowhere to put it; lose it */
+        }
+        for (; n > 0 && (size_t) done >= iov->iov_len; iov++, n--)
+            done -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+
+/*
+ * everything in every ring, in one writev
+ */
+static void flush_rings(void)
+{
+    struct iovec iov[2 * MAX_RINGS];
+    unsigned long heads[MAX_RINGS], tail;
+    int     i, n = 0, count = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+    size_t  off, len;
+    ring    *r;
+
+    for (i = 0; i < count; i++) {
+        r = rings[i];
+        heads[i] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+        if ((len = heads[i] - tail) == 0)
+            continue;
+        off = tail % RING_SIZE;
+        iov[n].iov_base = r->buf + off;
+        if (off + len > RING_SIZE) {
+            iov[n++].iov_len = RING_SIZE - off;
+            iov[n].iov_base = r->buf;
+            len -= RING_SIZE - off;
+        }
+        iov[n++].iov_len = len;
+    }
+    if (n > 0)
+        write_all(iov, n);
+    for (i = 0; i < count; i++)
+        __atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+}
+
+
+static void* flush_loop(void* arg)
+{
+    struct pollfd pfd;
+    uint64_t n;
+
+    pfd.fd = wakefd;
+    pfd.events = POLLIN;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, FLUSH_MS) > 0)
+            if (read(wakefd, &n, sizeof(n)) == -1) {}
+        flush_rings();
+    }
+    flush_rings();
+    return NULL;
+}
+
+
+/*
+ * accesslog_close -- a process that is about to exit writes out its
+ *                    queued lines first
+ */
+void accesslog_close(void)
+{
+    uint64_t one = 1;
+
+    if (!running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    if (wakefd != -1)
+        if (write(wakefd, &one, sizeof(one)) == -1) {}
+    pthread_join(flusher, NULL);
+    running = 0;
+}
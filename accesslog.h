@@ -0,0 +1,33 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include    "request.h"
+
+/*
+ * accesslog.h - one line per reply, in Common or Combined Log Format
+ *
+ *  accesslog_open(p, fmt, q)   log to path p ("-" is stdout), format
+ *                              LOG_COMMON or LOG_COMBINED; q 0 to
+ *                              write each line at once
+ *  accesslog_write(...)        queue the line for a reply; never waits
+ *  accesslog_rotate(signum)    SIGUSR1 handler: open path again
+ *  accesslog_close()           write out what is queued, stop the flusher
+ *
+ * accesslog_write formats the line into a ring buffer that belongs
+ * to the calling thread; a flusher thread empties every ring into
+ * the file a few times a second.  when a ring is full the line is
+ * dropped and counted, so a slow log never holds up a request.
+ * a fork mode child, which logs a request or two and exits, opens
+ * with q 0 and writes its lines itself.
+ */
+
+#define LOG_COMMON      0
+#define LOG_COMBINED    1
+
+void    accesslog_open(char* path, int format, int queue);
+void    accesslog_write(char* peer, request* rq, slice* target, int status,
+                        long long bytes, long long begin, long long parsed);
+void    accesslog_rotate(int signum);
+void    accesslog_close(void);
+
+#endif
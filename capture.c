@@ -0,0 +1,69 @@
+#include    <fcntl.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <sys/stat.h>
+#include    <sys/uio.h>
+#include    <unistd.h>
+#include    "capture.h"
+
+/*
+ * capture.c - the requests that come in, for replaying later
+ *
+ * as with trace.c, each record goes out in one call, a writev of its
+ * header and the request to a file opened O_APPEND, so every thread
+ * and process can share the file and no record is split.  capturing
+ * costs a copy of the request and a system call per request; it is
+ * meant to be turned on for a while to get a sample of real traffic,
+ * not left on.
+ */
+
+static int capfd = -1;
+
+
+/*
+ * capture_open -- append requests to path; a new file gets CAP_MAGIC
+ */
+void capture_open(char* path)
+{
+    struct stat st;
+
+    capfd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (capfd == -1) {
+        perror(path);
+        return;
+    }
+    if (fstat(capfd, &st) == 0 && st.st_size == 0)
+        if (write(capfd, CAP_MAGIC, CAP_MAGICLEN) == -1) {}
+}
+
+
+int capturing(void)
+{
+    return capfd != -1;
+}
+
+
+/*
+ * capture_write -- the request in rq, len bytes, whose first byte
+ *                  came in at at (stats_now()), was answered by
+ *                  handler
+ */
+void capture_write(long long at, char* rq, int len, int handler)
+{
+    char    head[CAP_HDRLEN];
+    struct iovec iov[2];
+    int64_t when = at;
+    uint16_t n = len, h = handler;
+
+    if (capfd == -1 || len <= 0 || len > UINT16_MAX)
+        return;
+    memcpy(head, &when, 8);
+    memcpy(head + 8, &n, 2);
+    memcpy(head + 10, &h, 2);
+    iov[0].iov_base = head;
+    iov[0].iov_len = CAP_HDRLEN;
+    iov[1].iov_base = rq;
+    iov[1].iov_len = len;
+    if (writev(capfd, iov, 2) == -1) {}
+}
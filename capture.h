@@ -0,0 +1,31 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+/*
+ * capture.h - record the requests that come in, for wsbench -R
+ *
+ *  capture_open(path)          append every request to path
+ *  capturing()                 is a capture file open?
+ *  capture_write(...)          one request, as it arrived
+ *
+ * the file is CAP_MAGIC, then a record per request: a header of
+ * CAP_HDRLEN bytes in the byte order of the machine that wrote it,
+ *
+ *      8   when its first byte arrived, microseconds on the
+ *          monotonic clock (not when the connection was accepted)
+ *      2   length of the request
+ *      2   the handler that answered it, an ST_ value from stats.h
+ *
+ * followed by the request line and headers as the client sent them.
+ * a request that did not parse is not recorded.
+ */
+
+#define CAP_MAGIC   "WSNGCAP1"
+#define CAP_MAGICLEN 8
+#define CAP_HDRLEN  12
+
+void    capture_open(char* path);
+int     capturing(void);
+void    capture_write(long long at, char* rq, int len, int handler);
+
+#endif
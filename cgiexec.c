@@ -0,0 +1,178 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/pidfd.h>
+#include    <sys/signalfd.h>
+#include    <sys/wait.h>
+#include    <unistd.h>
+#include    "cgiexec.h"
+#include    "wheel.h"
+
+/*
+ * cgiexec.c - running a cgi program for one request
+ *
+ * the program's stdout is a pipe, not the client socket, so the
+ * server sees everything it prints: it can frame the output (see
+ * cgi_relay in wsng.c), keep the connection for another request
+ * afterwards, and stop a program that runs or sits quiet too long.
+ * stdin is /dev/null, since GET requests have no body, and stderr
+ * is left as the server's.  the request's variables go straight
+ * into the program's environment through execve; setenv would
+ * change the one environment every thread of the server shares.
+ *
+ * each child is also held by a pidfd, so killing it cannot hit some
+ * other process that was given its pid after it was reaped.
+ *
+ * reaping: SIGCHLD is blocked and read from a signalfd, which the
+ * fork mode accept loop and the event loop poll next to their other
+ * descriptors.  one reading may stand for several exits, so each is
+ * followed by waitpid(-1, ..., WNOHANG) until nobody is left.
+ */
+
+
+/*
+ * make_env -- our environment with env's NAME=value strings added
+ *    rets: a malloc'd array; the strings are not copied
+ */
+static char** make_env(char** env)
+{
+    char** all;
+    int n = 0, m = 0, i;
+
+    while (environ[n] != NULL)
+        n++;
+    while (env[m] != NULL)
+        m++;
+    if ((all = malloc((n + m + 1) * sizeof(char*))) == NULL)
+        return NULL;
+    memcpy(all, env, m * sizeof(char*));
+    for (i = 0; i < n; i++)
+        all[m + i] = environ[i];    /* getenv takes the first match */
+    all[n + m] = NULL;
+    return all;
+}
+
+
+/*
+ * cgiexec_start -- run prog with its output on a fresh pipe
+ *    args: env is a NULL-terminated list of NAME=value strings
+ *    rets: the running program, or NULL if it could not be started
+ */
+cgi_proc* cgiexec_start(char* prog, char** env)
+{
+    cgi_proc* p = calloc(1, sizeof(cgi_proc));
+    char* argv[2] = { prog, NULL };
+    char** envp = make_env(env);
+    int fds[2], null;
+
+    if (p == NULL || envp == NULL || pipe2(fds, O_CLOEXEC) == -1) {
+        free(p);
+        free(envp);
+        return NULL;
+    }
+    if ((p->pid = fork()) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        free(p);
+        free(envp);
+        return NULL;
+    }
+    if (p->pid == 0) {
+        cgiexec_child_signals();
+        if ((null = open("/dev/null", O_RDONLY)) != -1)
+            dup2(null, 0);
+        dup2(fds[1], 1);            /* dup2 clears close-on-exec */
+        execve(prog, argv, envp);
+        perror(prog);
+        _exit(1);
+    }
+    free(envp);
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    p->fd = fds[0];
+    p->pidfd = pidfd_open(p->pid, 0);
+    p->started = p->active = wheel_now();
+    return p;
+}
+
+
+ssize_t cgiexec_read(cgi_proc* p, char* buf, size_t len)
+{
+    ssize_t n;
+
+    while ((n = read(p->fd, buf, len)) == -1 && errno == EINTR) {}
+    if (n > 0)
+        p->active = wheel_now();
+    else if (n == 0)
+        p->eof = 1;
+    return n;
+}
+
+
+/*
+ * cgiexec_end -- forget p; a program that has not closed its output
+ * yet is being given up on, so it is killed
+ */
+void cgiexec_end(cgi_proc* p)
+{
+    if (!p->eof) {
+        if (p->pidfd != -1)
+            pidfd_send_signal(p->pidfd, SIGKILL, NULL, 0);
+        else
+            kill(p->pid, SIGKILL);
+    }
+    close(p->fd);
+    if (p->pidfd != -1)
+        close(p->pidfd);
+    free(p->head);
+    free(p);
+}
+
+
+/*
+ * cgiexec_sigfd -- block SIGCHLD and read it from a descriptor
+ *    rets: the signalfd, or -1; without one the caller must
+ *          cgiexec_reap(-1) every so often instead
+ */
+int cgiexec_sigfd(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        return -1;
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+
+void cgiexec_reap(int fd)
+{
+    struct signalfd_siginfo info;
+
+    if (fd != -1)
+        while (read(fd, &info, sizeof(info)) == sizeof(info)) {}
+    while (waitpid(-1, NULL, WNOHANG) > 0) {}
+}
+
+
+/*
+ * cgiexec_child_signals -- a cgi program starts with the signal
+ * setup a program expects, not the server's: SIGCHLD unblocked and
+ * SIGPIPE fatal again
+ */
+void cgiexec_child_signals(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+}
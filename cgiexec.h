@@ -0,0 +1,45 @@
+#ifndef CGIEXEC_H
+#define CGIEXEC_H
+
+#include    <sys/types.h>
+#include    <time.h>
+
+/*
+ * cgiexec.h - cgi programs run once per request, their output read
+ *             back through a pipe
+ *
+ *  cgiexec_start(prog, env)    fork and exec prog, stdout on a pipe,
+ *                              with env added to our environment
+ *  cgiexec_read(p, buf, len)   what it has printed since last time
+ *  cgiexec_end(p)              done with it; kills it if still talking
+ *
+ *  cgiexec_sigfd()             a signalfd that says when children exit
+ *  cgiexec_reap(fd)            wait for every child that has exited
+ *  cgiexec_child_signals()     undo the above in a child about to exec
+ *
+ * the read end of the pipe is non-blocking, so p->fd can be polled
+ * or handed to evloop_watch(); cgiexec_read then returns -1 with
+ * errno EAGAIN when there is nothing to read yet, and 0 at EOF.
+ */
+
+typedef struct cgi_proc {
+    pid_t   pid;
+    int     pidfd;              /* for a race-free kill, or -1     */
+    int     fd;                 /* read end of its stdout          */
+    int     eof;                /* it has closed its stdout        */
+    time_t  started;            /* for cgi_timeout                 */
+    time_t  active;             /* last output, for cgi_idle_timeout */
+    char*   head;               /* output up to the blank line ... */
+    size_t  headlen;
+    int     streaming;          /* ... passed on; now the body     */
+    long long sent;             /* bytes of the body passed on     */
+} cgi_proc;
+
+cgi_proc*   cgiexec_start(char* prog, char** env);
+ssize_t     cgiexec_read(cgi_proc* p, char* buf, size_t len);
+void        cgiexec_end(cgi_proc* p);
+int         cgiexec_sigfd(void);
+void        cgiexec_reap(int fd);
+void        cgiexec_child_signals(void);
+
+#endif
@@ -0,0 +1,412 @@
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+#include    "cgiexec.h"
+#include    "cgipool.h"
+#include    "evloop.h"
+#include    "wheel.h"
+
+/*
+ * cgipool.c - persistent cgi workers
+ *
+ * a script named in a "cgi_pool script n" config line is not run
+ * once per request.  instead up to n copies are started as they are
+ * needed and kept running, each with one end of a unix socket pair
+ * as its standard input and standard output, and requests are
+ * handed to whichever copy is idle.  a worker reads requests on fd 0
+ * and answers on fd 1; anything else it prints there breaks the
+ * framing and fails the request, so stray output belongs on stderr.
+ * a worker is retired after cgi_max_requests requests, and one that
+ * dies is started again for the next request.
+ *
+ * both directions carry records, much like FastCGI's:
+ *
+ *      byte 0      version, 1
+ *      byte 1      type
+ *      bytes 2-3   zero
+ *      bytes 4-7   length of the content, big-endian
+ *      content
+ *
+ * the server sends a PARAMS record holding NAME=value strings, each
+ * ending in a NUL (QUERY_STRING, REQUEST_METHOD and the rest of the
+ * usual cgi variables), an empty PARAMS record, and an empty STDIN
+ * record, as GET requests have no body.  the worker answers with
+ * STDOUT records carrying what a cgi program would have printed,
+ * headers and all, and then an END record.  then it reads the next
+ * request.  EOF on its input means it should exit.
+ *
+ * a worker that died while idle is only noticed when the next
+ * request to it fails before any answer; that request is sent once
+ * more, to a fresh worker.
+ *
+ * scripts that do not speak this are run the old way by do_exec.
+ * pooled.cgi is a small worker to start from, and to try a pool
+ * with.
+ */
+
+#define REC_PARAMS  1
+#define REC_STDIN   2
+#define REC_STDOUT  3
+#define REC_END     4
+
+#define HDRLEN      8
+#define MAXREC      (16 << 20)      /* longer records are a broken worker */
+
+typedef struct cgi_worker {
+    pid_t       pid;
+    int         fd;                 /* our end, or -1 if not running */
+    int         served;             /* requests since it started     */
+    cgi_job*    job;                /* the one it is working on      */
+} cgi_worker;
+
+typedef struct cgi_pool {
+    char*       script;             /* as process_rq names it */
+    int         size;
+    cgi_worker* workers;
+    cgi_job*    waiting;            /* queue, oldest first */
+    cgi_job*    lastwait;
+    struct cgi_pool* next;
+} cgi_pool;
+
+int cgi_max_requests = 1000;
+
+static cgi_pool*    pools;
+
+
+/*
+ * config names may start with / or ./; request paths do not
+ */
+static char* plain(char* script)
+{
+    while (*script == '/' || (script[0] == '.' && script[1] == '/'))
+        script += (*script == '/') ? 1 : 2;
+    return script;
+}
+
+
+void cgipool_add(char* script, int n)
+{
+    cgi_pool* p = calloc(1, sizeof(cgi_pool));
+
+    if (n < 1)
+        n = 1;
+    if (p == NULL || (p->script = strdup(plain(script))) == NULL
+            || (p->workers = calloc(n, sizeof(cgi_worker))) == NULL) {
+        perror("cgipool_add");
+        exit(1);
+    }
+    p->size = n;
+    while (n-- > 0)
+        p->workers[n].fd = -1;
+    p->next = pools;
+    pools = p;
+}
+
+
+static cgi_pool* find_pool(char* script)
+{
+    cgi_pool* p;
+
+    for (p = pools; p != NULL; p = p->next)
+        if (strcmp(p->script, script) == 0)
+            return p;
+    return NULL;
+}
+
+
+int cgipool_has(char* script)
+{
+    return find_pool(script) != NULL;
+}
+
+
+/*
+ * start a copy of the script on a fresh socket pair
+ *    rets: 0, or -1 if it could not be started
+ */
+static int spawn(cgi_pool* p, cgi_worker* w)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+    if ((w->pid = fork()) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (w->pid == 0) {
+        cgiexec_child_signals();
+        dup2(sv[1], 0);             /* dup2 clears close-on-exec */
+        dup2(sv[1], 1);
+        execl(p->script, p->script, NULL);
+        perror(p->script);
+        _exit(1);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);  /* the worker's end blocks */
+    w->fd = sv[0];
+    w->served = 0;
+    w->job = NULL;
+    return 0;
+}
+
+
+static void retire(cgi_worker* w)
+{
+    if (w->fd == -1)
+        return;
+    close(w->fd);                   /* EOF tells it to go ...   */
+    kill(w->pid, SIGTERM);          /* ... in case it is stuck  */
+    w->fd = -1;                     /* the event loop reaps it  */
+}
+
+
+/*
+ * give job to worker w and have the event loop watch for replies
+ */
+static void assign(cgi_job* j, cgi_worker* w)
+{
+    j->worker = w;
+    w->job = j;
+    evloop_watch(w->fd, j->owner);
+}
+
+
+/*
+ * an idle worker for p, starting one if there is room
+ */
+static cgi_worker* idle_worker(cgi_pool* p)
+{
+    cgi_worker* spare = NULL;
+    int i;
+
+    for (i = 0; i < p->size; i++) {
+        if (p->workers[i].fd != -1 && p->workers[i].job == NULL)
+            return &p->workers[i];
+        if (p->workers[i].fd == -1 && spare == NULL)
+            spare = &p->workers[i];
+    }
+    if (spare != NULL && spawn(p, spare) == 0)
+        return spare;
+    return NULL;
+}
+
+
+/*
+ * w is free again: retire it if it has done its share, then start
+ * the oldest waiting job on it or on its replacement
+ */
+static void worker_free(cgi_pool* p, cgi_worker* w)
+{
+    cgi_job* j;
+
+    if (w->fd != -1) {
+        evloop_unwatch(w->fd);
+        if (cgi_max_requests > 0 && w->served >= cgi_max_requests)
+            retire(w);
+    }
+    w->job = NULL;
+    if ((j = p->waiting) == NULL || (w = idle_worker(p)) == NULL)
+        return;
+    if ((p->waiting = j->next) == NULL)
+        p->lastwait = NULL;
+    j->next = NULL;
+    assign(j, w);
+}
+
+
+static void put_header(char* h, int type, size_t len)
+{
+    h[0] = 1;
+    h[1] = type;
+    h[2] = h[3] = 0;
+    h[4] = (len >> 24) & 0xff;
+    h[5] = (len >> 16) & 0xff;
+    h[6] = (len >> 8) & 0xff;
+    h[7] = len & 0xff;
+}
+
+
+/*
+ * cgipool_submit -- start a request to script's pool
+ *    args: params is plen bytes of NAME=value\0 strings; owner is
+ *          what the event loop should serve when the worker answers
+ *    rets: the job, to be stepped with cgipool_step
+ */
+cgi_job* cgipool_submit(char* script, char* params, size_t plen, void* owner)
+{
+    cgi_pool* p = find_pool(script);
+    cgi_job* j = calloc(1, sizeof(cgi_job));
+    cgi_worker* w;
+
+    if (j == NULL || (j->req = malloc(plen + 3 * HDRLEN)) == NULL) {
+        perror("cgipool_submit");
+        exit(1);
+    }
+    put_header(j->req, REC_PARAMS, plen);
+    memcpy(j->req + HDRLEN, params, plen);
+    put_header(j->req + HDRLEN + plen, REC_PARAMS, 0);
+    put_header(j->req + 2 * HDRLEN + plen, REC_STDIN, 0);
+    j->reqlen = plen + 3 * HDRLEN;
+    j->pool = p;
+    j->owner = owner;
+    j->result = CGI_AGAIN;
+    j->started = j->active = wheel_now();
+
+    if (p->waiting == NULL && (w = idle_worker(p)) != NULL)
+        assign(j, w);
+    else {
+        if (p->lastwait != NULL)
+            p->lastwait->next = j;
+        else
+            p->waiting = j;
+        p->lastwait = j;
+    }
+    return j;
+}
+
+
+static size_t rec_len(unsigned char* h)
+{
+    return ((size_t) h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+}
+
+
+/*
+ * look at the records that have come in whole since last time
+ *    rets: CGI_DONE at the END record, CGI_FAILED for nonsense,
+ *          else CGI_AGAIN
+ *    note: STDOUT contents are moved down to the front of in as
+ *          they are found, so at the end in holds just the output
+ */
+static int parse_records(cgi_job* j)
+{
+    unsigned char* h;
+    size_t len;
+
+    while (j->inlen - j->parsed >= HDRLEN) {
+        h = (unsigned char*) j->in + j->parsed;
+        len = rec_len(h);
+        if (h[0] != 1 || len > MAXREC)
+            return CGI_FAILED;
+        if (j->inlen - j->parsed < HDRLEN + len)
+            break;
+        if (h[1] == REC_STDOUT) {
+            memmove(j->in + j->outlen, h + HDRLEN, len);
+            j->outlen += len;
+        }
+        j->parsed += HDRLEN + len;
+        if (h[1] == REC_END) {
+            j->out = j->in;
+            return CGI_DONE;
+        }
+    }
+    return CGI_AGAIN;
+}
+
+
+/*
+ * cgipool_step -- send what the socket takes, read what is there
+ *    rets: CGI_AGAIN until the worker has answered, then CGI_DONE
+ *          or CGI_FAILED
+ */
+int cgipool_step(cgi_job* j)
+{
+    cgi_worker* w = j->worker;
+    cgi_worker* fresh;
+    ssize_t n;
+
+    if (j->result != CGI_AGAIN || w == NULL)
+        return j->result;
+
+    while (j->reqpos < j->reqlen) {
+        n = write(w->fd, j->req + j->reqpos, j->reqlen - j->reqpos);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return CGI_AGAIN;
+        if (n == -1)
+            goto failed;
+        j->reqpos += n;
+    }
+
+    while (1) {
+        if (j->inmax - j->inlen < 4096) {
+            j->inmax = j->inmax ? 2 * j->inmax : 8192;
+            if ((j->in = realloc(j->in, j->inmax)) == NULL) {
+                perror("cgipool_step");
+                exit(1);
+            }
+        }
+        n = read(w->fd, j->in + j->inlen, j->inmax - j->inlen);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return CGI_AGAIN;
+        if (n <= 0)
+            goto failed;
+        j->inlen += n;
+        j->active = wheel_now();
+        j->result = parse_records(j);
+        if (j->result == CGI_FAILED)
+            goto failed;
+        if (j->result == CGI_DONE) {
+            w->served++;
+            j->worker = NULL;
+            worker_free(j->pool, w);
+            return CGI_DONE;
+        }
+    }
+
+failed:
+    evloop_unwatch(w->fd);
+    retire(w);
+    w->job = NULL;
+    j->worker = NULL;
+    if (j->inlen == 0 && !j->retried && (fresh = idle_worker(j->pool)) != NULL) {
+        j->retried = 1;
+        j->reqpos = 0;
+        assign(j, fresh);
+        return cgipool_step(j);
+    }
+    j->result = CGI_FAILED;
+    worker_free(j->pool, w);
+    return CGI_FAILED;
+}
+
+
+/*
+ * cgipool_release -- forget job; a worker still busy with it is
+ * retired, since what it has not said yet cannot be told apart
+ * from the answer to the next request
+ */
+void cgipool_release(cgi_job* j)
+{
+    cgi_pool* p = j->pool;
+    cgi_job** jp;
+    cgi_worker* w = j->worker;
+
+    if (w != NULL) {
+        evloop_unwatch(w->fd);
+        retire(w);
+        worker_free(p, w);
+    } else if (j->result == CGI_AGAIN) {
+        for (jp = &p->waiting; *jp != NULL; jp = &(*jp)->next)
+            if (*jp == j) {
+                *jp = j->next;
+                break;
+            }
+        p->lastwait = NULL;
+        for (jp = &p->waiting; *jp != NULL; jp = &(*jp)->next)
+            p->lastwait = *jp;
+    }
+    free(j->req);
+    free(j->in);
+    free(j);
+}
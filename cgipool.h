@@ -0,0 +1,56 @@
+#ifndef CGIPOOL_H
+#define CGIPOOL_H
+
+#include    <sys/types.h>
+#include    <time.h>
+
+/*
+ * cgipool.h - long-lived cgi programs answering one request after
+ *             another over a socket (see cgipool.c for the protocol)
+ *
+ *  cgipool_add(script, n)      keep up to n workers running script
+ *  cgipool_has(script)         is script served by a pool?
+ *  cgipool_submit(...)         start a request, or queue it
+ *  cgipool_step(job)           move it along; CGI_ value
+ *  cgipool_release(job)        done with it, finished or not
+ *
+ * a job's worker socket is watched through evloop_watch() on behalf
+ * of the job's owner, so the event loop comes back to the owner
+ * when the worker has something to say.
+ */
+
+/* cgipool_step results */
+#define CGI_AGAIN   0           /* still running, or waiting for a worker */
+#define CGI_DONE    1           /* out, outlen hold what it wrote */
+#define CGI_FAILED  2           /* the worker died or broke protocol */
+
+typedef struct cgi_job {
+    struct cgi_pool*    pool;
+    struct cgi_worker*  worker; /* NULL while queued                */
+    void*       owner;          /* passed to evloop_watch           */
+    char*       req;            /* the framed request ...           */
+    size_t      reqlen;
+    size_t      reqpos;         /* ... and how much of it is sent   */
+    char*       in;             /* records read back                */
+    size_t      inlen;
+    size_t      inmax;
+    size_t      parsed;         /* whole records before this        */
+    size_t      outlen;         /* stdout bytes, moved to in[0..]   */
+    char*       out;            /* set when CGI_DONE                */
+    int         result;
+    int         retried;        /* sent again after a dead worker   */
+    time_t      started;        /* submitted, for cgi_timeout       */
+    time_t      active;         /* last read, for cgi_idle_timeout  */
+    struct cgi_job* next;       /* queue of jobs waiting for a worker */
+} cgi_job;
+
+extern int cgi_max_requests;    /* a worker retires after this many */
+
+void        cgipool_add(char* script, int workers);
+int         cgipool_has(char* script);
+cgi_job*    cgipool_submit(char* script, char* params, size_t plen,
+                           void* owner);
+int         cgipool_step(cgi_job* job);
+void        cgipool_release(cgi_job* job);
+
+#endif
@@ -0,0 +1,791 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <stdarg.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/sendfile.h>
+#include    <sys/uio.h>
+#include    <unistd.h>
+#include    "conn.h"
+
+/*
+ * conn.c - connection objects shared by the fork and epoll modes
+ *
+ *  conn_init(maxhead)      the most a request's line and headers
+ *                          may take, in bytes
+ *  conn_new(fd)            wrap an accepted socket
+ *  conn_read(c)            read until a request's headers are complete
+ *                          and parsed into c->rq (see request.c)
+ *  conn_room(c)            how much more of them inbuf may take
+ *  conn_take(c, n)         the same, for n bytes someone else read
+ *  conn_next_request(c)    done building a reply, move to the next
+ *                          pipelined request if one is waiting
+ *  conn_add_header(c,...)  an extra header line for the current reply
+ *  conn_add_part(c,...)    add a part to a multipart file body
+ *  conn_send(c)            send finished replies, then the file body
+ *  conn_out(c, iov)        the part of that which is in memory ...
+ *  conn_wrote(c, n)        ... and n bytes of it went out elsewhere
+ *  conn_push(c)            send c->out so far, more to come after it
+ *  conn_count(c)           note the reply just built, for the stats
+ *  conn_reset(c)           everything sent, get ready for more
+ *  conn_drop_body(c)       release the file body
+ *  conn_free(c)            close everything the connection holds
+ *
+ * inbuf starts at CONN_BUFLEN bytes and doubles, when a request's
+ * head fills it, up to maxhead; a head that does not end by then is
+ * RQ_TOOBIG.  once the big request is answered inbuf goes back to
+ * CONN_BUFLEN, so an idle connection holds no more than that.
+ */
+
+static int maxhead = CONN_MAXHEAD;
+
+
+static int open_streams(connection* c)
+{
+    c->text = NULL;
+    c->textlen = 0;
+    if ((c->fp = open_memstream(&c->text, &c->textlen)) == NULL)
+        return -1;
+    c->outbuf = NULL;
+    c->outlen = 0;
+    c->outpos = 0;
+    if ((c->out = open_memstream(&c->outbuf, &c->outlen)) == NULL) {
+        fclose(c->fp);
+        free(c->text);
+        return -1;
+    }
+    return 0;
+}
+
+
+void conn_init(int max)
+{
+    if (max > 0)
+        maxhead = max;
+}
+
+
+static void new_reply(connection* c)
+{
+    c->status = 0;
+    c->msg = NULL;
+    c->ctype = NULL;
+    c->head_only = 0;
+    c->streamed = 0;
+    c->handler = ST_CAT;
+    c->hdrslen = 0;
+}
+
+
+connection* conn_new(int fd)
+{
+    connection* c = malloc(sizeof(connection));
+
+    if (c == NULL)
+        return NULL;
+    if ((c->inbuf = malloc(CONN_BUFLEN)) == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->state = CS_READ;
+    c->inlen = 0;
+    c->insize = CONN_BUFLEN;
+    c->inbuf[0] = '\0';
+    rq_init(&c->rq);
+    c->nrequests = 0;
+    c->keepalive = 0;
+    c->last_active = c->mark = wheel_now();
+    c->mark_sent = c->sent = 0;
+    timer_init(&c->timer, c);
+    c->peer[0] = '\0';
+    c->t_accept = c->t_begin = stats_now();
+    c->t_parsed = c->t_first = 0;
+    c->ndone = 0;
+    trace_begin(&c->tr, c->t_begin);
+    c->traced.sampled = 0;
+    c->bodyfd = -1;
+    c->bodyent = NULL;
+    c->bodyfc = NULL;
+    c->cgi = NULL;
+    c->proc = NULL;
+    c->bodypos = 0;
+    c->bodyend = 0;
+    c->sendmode = SEND_SENDFILE;
+    c->pipefd[0] = c->pipefd[1] = -1;
+    c->piped = 0;
+    c->parts = NULL;
+    c->nparts = c->maxparts = 0;
+    c->partno = 0;
+    c->headpos = 0;
+    c->partbuf = NULL;
+    c->partlen = 0;
+    c->next = NULL;
+    c->loop = NULL;
+    new_reply(c);
+    if (open_streams(c) == -1) {
+        free(c->inbuf);
+        free(c);
+        return NULL;
+    }
+    stats_conn(1);
+    TRACE1(accept, fd);
+    return c;
+}
+
+
+static void close_streams(connection* c)
+{
+    fclose(c->fp);
+    free(c->text);
+    fclose(c->out);
+    free(c->outbuf);
+}
+
+
+void conn_free(connection* c)
+{
+    close_streams(c);
+    conn_drop_body(c);
+    if (c->pipefd[0] != -1) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    close(c->fd);
+    free(c->inbuf);
+    free(c);
+    stats_conn(-1);
+}
+
+
+int conn_set_blocking(connection* c, int blocking)
+{
+    int flags = fcntl(c->fd, F_GETFL);
+
+    if (flags == -1)
+        return -1;
+    if (blocking)
+        flags &= ~O_NONBLOCK;
+    else
+        flags |= O_NONBLOCK;
+    return fcntl(c->fd, F_SETFL, flags);
+}
+
+
+/*
+ * resize -- move inbuf, and the request lying in it, to size bytes
+ *    rets: 0, or -1 if there is no memory for that
+ */
+static int resize(connection* c, int size)
+{
+    char* to = malloc(size);
+
+    if (to == NULL)
+        return -1;
+    memcpy(to, c->inbuf, c->inlen + 1);
+    rq_move(&c->rq, c->inbuf, to);
+    free(c->inbuf);
+    c->inbuf = to;
+    c->insize = size;
+    return 0;
+}
+
+
+/*
+ * conn_room -- bytes that may be read in at inbuf + inlen, making
+ *              inbuf bigger first if it is full and below maxhead
+ *    note: inbuf may move, so take its address after calling this
+ */
+int conn_room(connection* c)
+{
+    int cap;
+
+    if (c->inlen == c->insize - 1 && c->insize - 1 < maxhead)
+        resize(c, (c->insize * 2 < maxhead ? c->insize * 2 : maxhead) + 1);
+    cap = (c->insize - 1 < maxhead) ? c->insize - 1 : maxhead;
+    return cap > c->inlen ? cap - c->inlen : 0;
+}
+
+
+/*
+ * parse what has come in of the first request in inbuf
+ */
+static int parse(connection* c)
+{
+    int had_line = c->rq.line > 0;
+    int room = maxhead > c->inlen ? maxhead - c->inlen : 0;
+    int rv = rq_parse(&c->rq, c->inbuf, c->inlen, room);
+
+    if (!had_line && c->rq.line > 0) {
+        TRACE1(request__line, c->fd);
+        TRACE_AT(&c->tr, line);
+    }
+    return rv;
+}
+
+
+/*
+ * n more bytes are in inbuf
+ */
+static void got(connection* c, int n)
+{
+    c->last_active = wheel_now();
+    if (c->inlen == 0) {
+        c->t_begin = stats_now();   /* the first of its bytes */
+        trace_begin(&c->tr, c->t_begin);
+        if (c->nrequests > 0)       /* the first is timed from accept */
+            c->mark = c->last_active;
+    }
+    c->inlen += n;
+    c->inbuf[c->inlen] = '\0';
+}
+
+
+static int parsed(connection* c)
+{
+    c->t_parsed = stats_now();
+    c->tr.parsed = c->t_parsed;
+    c->state = CS_PARSE;
+    TRACE2(headers, c->fd, c->rq.length);
+    c->mark = wheel_now();          /* now the reply must move */
+    c->mark_sent = c->sent;
+    return CONN_OK;
+}
+
+
+/*
+ * conn_read -- read from the socket until the headers are in
+ *    rets: CONN_OK with state CS_PARSE when a request is ready,
+ *          CONN_AGAIN if the socket ran dry first,
+ *          CONN_ERR at EOF or on error
+ *    note: a request whose head is over maxhead is passed on as
+ *          RQ_TOOBIG, one that does not parse as RQ_BAD, for
+ *          process_rq to answer
+ */
+int conn_read(connection* c)
+{
+    int n, room;
+
+    while (parse(c) == RQ_MORE) {
+        room = conn_room(c);
+        n = read(c->fd, c->inbuf + c->inlen, room);
+        if (n == 0)
+            return CONN_ERR;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK)
+                   ? CONN_AGAIN : CONN_ERR;
+        }
+        got(c, n);
+    }
+    return parsed(c);
+}
+
+
+/*
+ * conn_take -- n bytes were read into inbuf at inlen by the caller
+ *              (the io_uring loop's recv); is a request complete?
+ *    rets: CONN_OK with state CS_PARSE, or CONN_AGAIN for more
+ */
+int conn_take(connection* c, int n)
+{
+    got(c, n);
+    return (parse(c) == RQ_MORE) ? CONN_AGAIN : parsed(c);
+}
+
+
+/*
+ * conn_next_request -- the reply to the current request is on c->out;
+ * drop that request from inbuf and clear the per-request state
+ *    rets: 1 if the next request is already complete in inbuf
+ *    note: a bad request has no end we can trust; throw it all
+ *          away and don't keep the connection open
+ */
+int conn_next_request(connection* c)
+{
+    int len = c->rq.length;
+
+    if (c->rq.result != RQ_DONE) {
+        len = c->inlen;
+        c->keepalive = 0;
+    }
+    memmove(c->inbuf, c->inbuf + len, c->inlen - len + 1);
+    c->inlen -= len;
+    c->nrequests++;
+
+    new_reply(c);
+    fclose(c->fp);
+    free(c->text);
+    c->text = NULL;
+    c->textlen = 0;
+    if ((c->fp = open_memstream(&c->text, &c->textlen)) == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+    rq_init(&c->rq);
+    if (c->insize > CONN_BUFLEN && c->inlen < CONN_BUFLEN)
+        resize(c, CONN_BUFLEN);
+    c->t_begin = c->t_parsed = stats_now();
+    trace_begin(&c->tr, c->t_begin);
+    if (parse(c) == RQ_MORE)
+        return 0;
+    c->tr.parsed = c->t_parsed;
+    return 1;
+}
+
+
+/*
+ * conn_count -- the reply to the current request is on c->out; it
+ *               is counted once conn_send has written all of it
+ */
+void conn_count(connection* c)
+{
+    stats_rec* r;
+
+    if (c->ndone == CONN_MAXDONE) {
+        stats_done(c->done, c->ndone, c->t_first);
+        c->ndone = 0;
+    }
+    r = &c->done[c->ndone++];
+    r->handler = c->handler;
+    r->accepted = c->nrequests == 0 ? c->t_accept : 0;
+    r->begin = c->t_begin;
+    r->parsed = c->t_parsed;
+    if (c->tr.sampled) {
+        trace_count(&c->tr, c->handler, c->status, c->rq.method.ptr,
+                    c->rq.method.len, c->target, c->targetlen);
+        c->traced = c->tr;
+    }
+}
+
+
+/*
+ * every reply noted so far has left
+ */
+static void all_sent(connection* c)
+{
+    TRACE2(last__byte, c->fd, c->sent);
+    if (c->traced.sampled) {
+        trace_span(&c->traced, c->fd, c->t_first, stats_now());
+        c->traced.sampled = 0;
+    }
+    stats_done(c->done, c->ndone, c->t_first);
+    c->ndone = 0;
+    c->t_first = 0;
+    c->state = CS_DONE;
+}
+
+
+/*
+ * a write of n bytes went out
+ */
+static void sent(connection* c, ssize_t n)
+{
+    if (c->t_first == 0) {
+        c->t_first = stats_now();
+        TRACE1(first__byte, c->fd);
+    }
+    c->sent += n;
+    stats_sent(n);
+}
+
+
+/*
+ * conn_drop_body -- let go of the file body, sent or not
+ */
+void conn_drop_body(connection* c)
+{
+    if (c->bodyent != NULL)
+        statcache_put(c->bodyent);  /* the descriptor is the entry's */
+    else if (c->bodyfd != -1)
+        close(c->bodyfd);
+    c->bodyent = NULL;
+    c->bodyfd = -1;
+    if (c->bodyfc != NULL)
+        filecache_put(c->bodyfc);
+    c->bodyfc = NULL;
+    free(c->parts);
+    free(c->partbuf);
+    c->parts = NULL;
+    c->nparts = c->maxparts = 0;
+    c->partno = 0;
+    c->headpos = 0;
+    c->partbuf = NULL;
+    c->partlen = 0;
+}
+
+
+/*
+ * conn_add_header -- add a header line (printf style, no line end)
+ *    note: lines that do not fit in hdrs are dropped
+ */
+void conn_add_header(connection* c, char* fmt, ...)
+{
+    va_list ap;
+    int room = CONN_HDRLEN - c->hdrslen;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->hdrs + c->hdrslen, room, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && n + 2 < room) {
+        memcpy(c->hdrs + c->hdrslen + n, "\r\n", 2);
+        c->hdrslen += n + 2;
+    }
+}
+
+
+/*
+ * conn_add_part -- the body goes on with len bytes of head, then
+ *                  bytes start..end of bodyfd
+ */
+void conn_add_part(connection* c, char* head, size_t len,
+                   off_t start, off_t end)
+{
+    body_part* p;
+
+    if (c->nparts == c->maxparts) {
+        c->maxparts = c->maxparts ? c->maxparts * 2 : 8;
+        c->parts = realloc(c->parts, c->maxparts * sizeof(body_part));
+    }
+    if (c->parts == NULL
+            || (c->partbuf = realloc(c->partbuf, c->partlen + len)) == NULL) {
+        perror("conn_add_part");
+        exit(1);
+    }
+    memcpy(c->partbuf + c->partlen, head, len);
+    p = &c->parts[c->nparts++];
+    p->head = c->partlen;
+    p->headlen = len;
+    p->start = start;
+    p->end = end;
+    c->partlen += len;
+    if (c->nparts == 1) {
+        c->bodypos = start;
+        c->bodyend = end;
+    }
+}
+
+
+/*
+ * conn_body_length -- bytes of file body still to send
+ */
+off_t conn_body_length(connection* c)
+{
+    off_t len = 0;
+    int i;
+
+    if (c->nparts == 0)
+        return c->bodyend - c->bodypos;
+    for (i = 0; i < c->nparts; i++)
+        len += c->parts[i].headlen + c->parts[i].end - c->parts[i].start;
+    return len;
+}
+
+
+static void empty_out(connection* c)
+{
+    fclose(c->out);
+    free(c->outbuf);
+    c->outbuf = NULL;
+    c->outlen = 0;
+    c->outpos = 0;
+    if ((c->out = open_memstream(&c->outbuf, &c->outlen)) == NULL) {
+        perror("open_memstream");
+        exit(1);
+    }
+}
+
+
+/*
+ * conn_reset -- the replies are all sent; start over with empty
+ *               buffers, keeping whatever the client sent ahead
+ */
+void conn_reset(connection* c)
+{
+    empty_out(c);
+    conn_drop_body(c);
+    c->bodypos = 0;
+    c->bodyend = 0;
+    c->sendmode = SEND_SENDFILE;
+    c->state = (c->rq.result != RQ_MORE) ? CS_PARSE : CS_READ;
+    c->last_active = c->mark = wheel_now();
+}
+
+
+#define UNSUPPORTED 2      /* body_* result: try the next SEND_ mode */
+
+static int would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+
+/*
+ * body_sendfile -- the kernel copies the file straight to the socket
+ *    note: sendfile advances bodypos itself, so a short write leaves
+ *          it pointing at the first unsent byte
+ */
+static int body_sendfile(connection* c)
+{
+    ssize_t n;
+
+    while (c->bodypos < c->bodyend) {
+        n = sendfile(c->fd, c->bodyfd, &c->bodypos, c->bodyend - c->bodypos);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (would_block())
+                return CONN_AGAIN;
+            if (errno == EINVAL || errno == ENOSYS)
+                return UNSUPPORTED;
+            return CONN_ERR;
+        }
+        if (n == 0)                 /* file got shorter */
+            return CONN_ERR;
+        sent(c, n);
+    }
+    return CONN_OK;
+}
+
+
+/*
+ * body_splice -- file to pipe, pipe to socket, no user space copy
+ *    note: data already moved into the pipe is counted in piped and
+ *          must drain to the socket before more is read from the file
+ */
+static int body_splice(connection* c)
+{
+    ssize_t n;
+
+    if (c->pipefd[0] == -1 && pipe2(c->pipefd, O_NONBLOCK|O_CLOEXEC) == -1)
+        return UNSUPPORTED;
+    while (c->bodypos < c->bodyend || c->piped > 0) {
+        if (c->piped == 0) {
+            n = splice(c->bodyfd, &c->bodypos, c->pipefd[1], NULL,
+                       c->bodyend - c->bodypos, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EINVAL) ? UNSUPPORTED : CONN_ERR;
+            }
+            if (n == 0)
+                return CONN_ERR;
+            c->piped = n;
+        }
+        n = splice(c->pipefd[0], NULL, c->fd, NULL, c->piped,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block() ? CONN_AGAIN : CONN_ERR;
+        }
+        sent(c, n);
+        c->piped -= n;
+    }
+    return CONN_OK;
+}
+
+
+/*
+ * body_copy -- read and write, for files neither of the above takes
+ *    note: a short write just advances bodypos; the unsent tail of
+ *          the chunk is read again from the page cache next time
+ */
+static int body_copy(connection* c)
+{
+    char buf[CONN_BUFLEN * 4];
+    size_t want;
+    ssize_t n, w;
+
+    while (c->bodypos < c->bodyend) {
+        want = c->bodyend - c->bodypos;
+        if (want > sizeof(buf))
+            want = sizeof(buf);
+        n = pread(c->bodyfd, buf, want, c->bodypos);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return CONN_ERR;
+        w = write(c->fd, buf, n);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block() ? CONN_AGAIN : CONN_ERR;
+        }
+        sent(c, w);
+        c->bodypos += w;
+    }
+    return CONN_OK;
+}
+
+
+/*
+ * send_body -- send bodyfd from bodypos to bodyend, falling back to
+ *              the next method when one does not work for this file
+ */
+static int send_body(connection* c)
+{
+    int rv;
+
+    while (1) {
+        if (c->sendmode == SEND_SENDFILE)
+            rv = body_sendfile(c);
+        else if (c->sendmode == SEND_SPLICE)
+            rv = body_splice(c);
+        else
+            rv = body_copy(c);
+        if (rv != UNSUPPORTED)
+            return rv;
+        c->sendmode++;
+    }
+}
+
+
+/*
+ * send_parts -- send a multipart body, each part's text and then
+ *               its bytes of the file
+ */
+static int send_parts(connection* c)
+{
+    body_part* p;
+    ssize_t w;
+    int rv;
+
+    while (c->partno < c->nparts) {
+        p = &c->parts[c->partno];
+        while (c->headpos < p->headlen) {
+            w = write(c->fd, c->partbuf + p->head + c->headpos,
+                      p->headlen - c->headpos);
+            if (w == -1) {
+                if (errno == EINTR)
+                    continue;
+                return would_block() ? CONN_AGAIN : CONN_ERR;
+            }
+            sent(c, w);
+            c->headpos += w;
+        }
+        if ((rv = send_body(c)) != CONN_OK)
+            return rv;
+        if (++c->partno < c->nparts) {
+            c->headpos = 0;
+            c->bodypos = c->parts[c->partno].start;
+            c->bodyend = c->parts[c->partno].end;
+        }
+    }
+    return CONN_OK;
+}
+
+
+/*
+ * conn_out -- what conn_send writes first: the rest of outbuf, then
+ *             the rest of a body from the hot-file cache
+ *    rets: the number of iov entries filled in, 0 when all of that
+ *          is out (a file body may still follow)
+ */
+int conn_out(connection* c, struct iovec* iov)
+{
+    int niov = 0;
+
+    if (c->state < CS_HEADER) {
+        fflush(c->out);             /* make outbuf/outlen current */
+        c->state = CS_HEADER;
+    }
+    if (c->state != CS_HEADER)
+        return 0;
+    if (c->outpos < c->outlen) {
+        iov[niov].iov_base = c->outbuf + c->outpos;
+        iov[niov++].iov_len = c->outlen - c->outpos;
+    }
+    if (c->bodyfc != NULL && c->bodypos < c->bodyend) {
+        iov[niov].iov_base = c->bodyfc->body + c->bodypos;
+        iov[niov++].iov_len = c->bodyend - c->bodypos;
+    }
+    return niov;
+}
+
+
+/*
+ * conn_wrote -- w bytes of what conn_out offered were written
+ */
+void conn_wrote(connection* c, ssize_t w)
+{
+    ssize_t n = c->outlen - c->outpos;
+
+    sent(c, w);
+    if (n > w)
+        n = w;
+    c->outpos += n;
+    c->bodypos += w - n;
+}
+
+
+/*
+ * conn_send -- push the replies out, picking up where the last call
+ *              stopped
+ *    rets: CONN_OK with state CS_DONE once everything is sent,
+ *          CONN_AGAIN if the socket is full, CONN_ERR on error
+ */
+int conn_send(connection* c)
+{
+    struct iovec iov[2];
+    ssize_t w;
+    int rv, niov;
+
+    while ((niov = conn_out(c, iov)) > 0) {
+        w = writev(c->fd, iov, niov);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block() ? CONN_AGAIN : CONN_ERR;
+        }
+        conn_wrote(c, w);
+    }
+    if (c->state == CS_HEADER) {
+        if (c->bodyfd != -1)
+            c->state = CS_BODY;
+        else
+            all_sent(c);
+    }
+
+    if (c->state == CS_BODY) {
+        rv = (c->nparts > 0) ? send_parts(c) : send_body(c);
+        if (rv != CONN_OK)
+            return rv;
+        all_sent(c);
+    }
+    return CONN_OK;
+}
+
+
+/*
+ * conn_push -- send what is on c->out, which is not finished yet:
+ *              a cgi program is still printing the rest
+ *    rets: CONN_OK once all of it is out and c->out is empty again,
+ *          CONN_AGAIN if the socket is full, CONN_ERR on error
+ */
+int conn_push(connection* c)
+{
+    ssize_t w;
+
+    fflush(c->out);
+    if (c->outlen == 0)
+        return CONN_OK;
+    while (c->outpos < c->outlen) {
+        w = write(c->fd, c->outbuf + c->outpos, c->outlen - c->outpos);
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return would_block() ? CONN_AGAIN : CONN_ERR;
+        }
+        sent(c, w);
+        c->outpos += w;
+    }
+    empty_out(c);
+    c->last_active = wheel_now();
+    return CONN_OK;
+}
@@ -0,0 +1,172 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include    <stdio.h>
+#include    <sys/types.h>
+#include    <sys/uio.h>
+#include    <time.h>
+#include    "cgiexec.h"
+#include    "cgipool.h"
+#include    "filecache.h"
+#include    "request.h"
+#include    "statcache.h"
+#include    "stats.h"
+#include    "trace.h"
+#include    "wheel.h"
+
+/*
+ * conn.h - one client connection and the replies being built for it
+ *
+ * a handler calls header() to set the status and content type, and
+ * writes any generated text into c->fp, which is a memory stream.
+ * end_reply() then puts the finished header (with Content-Length)
+ * and that text on c->out.  replies to pipelined requests pile up
+ * on c->out so they leave in one write.
+ *
+ * a file body is not copied; do_cat leaves an open descriptor in
+ * c->bodyfd, borrowed from the stat cache entry c->bodyent, and
+ * conn_send() moves bytes bodypos..bodyend to the
+ * socket inside the kernel with sendfile(), or splice() through a
+ * pipe where sendfile refuses the file.  conn_send() works on
+ * blocking sockets (fork mode) and non-blocking ones (epoll mode),
+ * and resumes after a short write where it left off.
+ *
+ * a file from the hot-file cache is in memory: c->bodyfc holds the
+ * entry, and conn_send() writes its body (bodypos..bodyend of
+ * bodyfc->body) together with outbuf in one writev().
+ *
+ * a multipart body (several byte ranges) is a list of parts added
+ * with conn_add_part(): each is a bit of text, the part's headers,
+ * followed by a range of bodyfd.
+ *
+ * for /server-status each finished reply is noted in c->done, with
+ * when its request began and was parsed, and counted when conn_send
+ * has written its last byte.  a request sampled for the trace file
+ * keeps its times in c->tr, and then in c->traced until it is sent
+ * (one per batch of replies; see trace.c).
+ *
+ * the output of a cgi program is put on c->out a piece at a time as
+ * the program prints it, and conn_push() sends each piece before
+ * the next is read, so a slow client holds the program back.
+ */
+
+#define CONN_BUFLEN 4096    /* inbuf to start with and go back to    */
+#define CONN_MAXHEAD 32768  /* largest request head; see conn_init   */
+
+/* connection states, in the order a request moves through them */
+#define CS_READ     0       /* collecting request line and headers  */
+#define CS_PARSE    1       /* have a full request, not yet handled */
+#define CS_CGI      2       /* waiting for, or relaying, a cgi program */
+#define CS_HEADER   3       /* sending the buffered reply text      */
+#define CS_BODY     4       /* sending the file in bodyfd           */
+#define CS_DONE     5       /* reply complete                       */
+#define CS_CLOSED   6       /* dropped, not yet freed (event loop)  */
+
+#define CONN_HDRLEN 512     /* room for extra reply header lines    */
+#define CONN_MAXDONE 32     /* replies noted before they are sent   */
+#define CONN_TARGETLEN 512  /* of the target kept for the access log */
+
+typedef struct body_part {
+    size_t  head;                   /* offset of its text in partbuf */
+    size_t  headlen;
+    off_t   start;                  /* then these bytes of bodyfd   */
+    off_t   end;
+} body_part;
+
+typedef struct connection {
+    int     fd;                     /* socket to the client         */
+    int     state;                  /* one of the CS_ values        */
+    char*   inbuf;                  /* bytes read from the client   */
+    int     inlen;
+    int     insize;                 /* inbuf's size; see conn_room  */
+    request rq;                     /* the first request in inbuf   */
+    int     nrequests;              /* requests answered so far     */
+    int     keepalive;              /* read another after this one  */
+    time_t  last_active;            /* for the idle timeout         */
+    time_t  mark;                   /* request begun, or last send  */
+    long long mark_sent;            /*   rate check; see conn_deadline */
+    long long sent;                 /* bytes written to the client  */
+    timer   timer;                  /* the loop's deadline for it   */
+    char    peer[48];               /* client address, for the log  */
+    long long t_accept;             /* stats_now() at accept        */
+    long long t_begin;              /* stats_now() times: request   */
+    long long t_parsed;             /*   began, was parsed, and the */
+    long long t_first;              /*   first byte of replies sent */
+    stats_rec done[CONN_MAXDONE];   /* replies on c->out            */
+    int     ndone;
+    trace_rec tr;                   /* the current request's times  */
+    trace_rec traced;               /* a sampled reply on c->out    */
+
+    /* the reply to the current request */
+    int     status;                 /* set by header()              */
+    char*   msg;
+    char*   ctype;                  /* for the Content-type line    */
+    int     head_only;              /* HEAD: headers, no body       */
+    int     streamed;               /* cgi body follows as it comes */
+    int     handler;                /* ST_ value, for the stats     */
+    char    target[CONN_TARGETLEN]; /* as sent; rq_path rewrites it */
+    int     targetlen;
+    char    hdrs[CONN_HDRLEN];      /* extra header lines, each     */
+    int     hdrslen;                /*   ending in \r\n             */
+    FILE*   fp;                     /* generated body text ...      */
+    char*   text;                   /* ... ends up here             */
+    size_t  textlen;
+
+    /* everything ready to go out */
+    FILE*   out;                    /* finished replies ...         */
+    char*   outbuf;                 /* ... end up here              */
+    size_t  outlen;
+    size_t  outpos;                 /* bytes of outbuf already sent */
+    int     bodyfd;                 /* file to send after outbuf    */
+    stat_entry* bodyent;            /* the entry bodyfd belongs to  */
+    file_entry* bodyfc;             /* or a body in memory          */
+    off_t   bodypos;                /* next byte of it to send      */
+    off_t   bodyend;                /* stop here                    */
+    int     sendmode;               /* SEND_ value, how to move it  */
+    int     pipefd[2];              /* for SEND_SPLICE              */
+    size_t  piped;                  /* bytes sitting in the pipe    */
+    cgi_job* cgi;                   /* CS_CGI: the pool's job, or   */
+    cgi_proc* proc;                 /*   the program run for it     */
+    body_part* parts;               /* a multipart body, or NULL    */
+    int     nparts;
+    int     maxparts;
+    int     partno;                 /* the part being sent          */
+    size_t  headpos;                /* bytes of its text sent       */
+    char*   partbuf;                /* the parts' text              */
+    size_t  partlen;
+
+    struct connection* next;        /* evloop.c's closed list       */
+    void*   loop;                   /* uring.c and threaded.c own   */
+} connection;
+
+/* ways of moving the body, tried in this order */
+#define SEND_SENDFILE   0
+#define SEND_SPLICE     1
+#define SEND_COPY       2           /* pread and write, always works */
+
+void        conn_init(int maxhead);
+connection* conn_new(int fd);
+void        conn_free(connection* c);
+int         conn_read(connection* c);
+int         conn_take(connection* c, int n);
+int         conn_room(connection* c);
+int         conn_send(connection* c);
+int         conn_out(connection* c, struct iovec* iov);
+void        conn_wrote(connection* c, ssize_t w);
+int         conn_push(connection* c);
+void        conn_count(connection* c);
+int         conn_set_blocking(connection* c, int blocking);
+void        conn_add_header(connection* c, char* fmt, ...);
+void        conn_add_part(connection* c, char* head, size_t len,
+                          off_t start, off_t end);
+off_t       conn_body_length(connection* c);
+int         conn_next_request(connection* c);
+void        conn_reset(connection* c);
+void        conn_drop_body(connection* c);
+
+/* conn_read and conn_send return one of these */
+#define CONN_OK     0               /* finished                     */
+#define CONN_AGAIN  1               /* socket would block, call again */
+#define CONN_ERR    -1              /* peer went away or error      */
+
+#endif
@@ -0,0 +1,186 @@
+#include    <limits.h>
+#include    <pthread.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/inotify.h>
+#include    <unistd.h>
+#include    "dirwatch.h"
+
+/*
+ * dirwatch.c - one inotify instance per process, watches by directory
+ *
+ * the stat cache watches the directory holding each cached path,
+ * the listing cache watches each listed directory.  both only need
+ * to hear "something named X in directory D changed", so the watch
+ * bookkeeping lives here and they subscribe to the events.
+ *
+ * in the threads mode any thread may add a watch while the acceptor
+ * reads events, so the table is locked.  subscribers are called
+ * without the lock held, since they take their own cache's lock and
+ * call dirwatch_add under it.
+ */
+
+#define NWATCHES    256             /* hash buckets, power of two */
+#define MAXSUBS     4
+#define WATCH_MASK  (IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE \
+                    | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct watch {
+    int     wd;
+    char*   dir;
+    struct watch* next;
+} watch;
+
+static int          ifd = -1;
+static watch*       watches[NWATCHES];  /* by directory name */
+static dirwatch_fn  subs[MAXSUBS];
+static int          nsubs;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned hash(char* s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ * dirwatch_init -- rets the inotify descriptor to poll, or -1
+ */
+int dirwatch_init(void)
+{
+    if (ifd == -1)
+        ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return ifd;
+}
+
+
+void dirwatch_subscribe(dirwatch_fn fn)
+{
+    int i;
+
+    for (i = 0; i < nsubs; i++)
+        if (subs[i] == fn)
+            return;
+    if (nsubs < MAXSUBS)
+        subs[nsubs++] = fn;
+}
+
+
+/*
+ * dirwatch_add -- make sure dir is watched
+ *    rets: 0 if it is, -1 if not (no inotify, or out of watches);
+ *          the caller then has only its own expiry to go on
+ */
+int dirwatch_add(char* dir)
+{
+    watch** wp;
+    watch* w;
+    int wd, rv = 0;
+
+    if (ifd == -1)
+        return -1;
+    pthread_mutex_lock(&lock);
+    wp = &watches[hash(dir) & (NWATCHES - 1)];
+    for (w = *wp; w != NULL; w = w->next)
+        if (strcmp(w->dir, dir) == 0)
+            break;
+    if (w == NULL) {
+        if ((wd = inotify_add_watch(ifd, dir, WATCH_MASK)) == -1)
+            rv = -1;
+        else if ((w = malloc(sizeof(watch))) == NULL
+                 || (w->dir = strdup(dir)) == NULL) {
+            perror("dirwatch");
+            exit(1);
+        } else {
+            w->wd = wd;
+            w->next = *wp;
+            *wp = w;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+
+static watch* find_watch(int wd)
+{
+    watch* w;
+    int i;
+
+    for (i = 0; i < NWATCHES; i++)
+        for (w = watches[i]; w != NULL; w = w->next)
+            if (w->wd == wd)
+                return w;
+    return NULL;
+}
+
+
+static void forget_watch(watch* gone)
+{
+    watch** wp = &watches[hash(gone->dir) & (NWATCHES - 1)];
+
+    while (*wp != gone)
+        wp = &(*wp)->next;
+    *wp = gone->next;
+    free(gone->dir);
+    free(gone);
+}
+
+
+static void tell(char* dir, char* name)
+{
+    int i;
+
+    for (i = 0; i < nsubs; i++)
+        subs[i](dir, name);
+}
+
+
+/*
+ * dirwatch_events -- read what inotify has queued and pass it on
+ */
+void dirwatch_events(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char dir[PATH_MAX];
+    struct inotify_event* ev;
+    watch* w;
+    ssize_t n;
+    char* p;
+
+    if (ifd == -1)
+        return;
+    while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event*) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                tell(NULL, NULL);
+                continue;
+            }
+            pthread_mutex_lock(&lock);
+            if ((w = find_watch(ev->wd)) != NULL) {
+                snprintf(dir, sizeof(dir), "%s", w->dir);
+                if (ev->mask & IN_IGNORED)          /* watch is gone */
+                    forget_watch(w);
+                else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                    inotify_rm_watch(ifd, w->wd);   /* IN_IGNORED follows */
+            }
+            pthread_mutex_unlock(&lock);
+            if (w == NULL)
+                continue;
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))
+                tell(dir, NULL);
+            else if (ev->len > 0)
+                tell(dir, ev->name);
+        }
+    }
+}
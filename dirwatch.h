@@ -0,0 +1,24 @@
+#ifndef DIRWATCH_H
+#define DIRWATCH_H
+
+/*
+ * dirwatch.h - inotify watches on directories, shared by the caches
+ *
+ *  dirwatch_init()         start an inotify instance in this process
+ *  dirwatch_subscribe(fn)  call fn(dir, name) for each change seen
+ *  dirwatch_add(dir)       watch dir (once; later calls are cheap)
+ *  dirwatch_events()       read pending events and call subscribers
+ *
+ * fn gets the directory as it was passed to dirwatch_add and the
+ * name of the entry that changed.  name is NULL if anything in dir
+ * may have changed, and dir is NULL too if events were lost.
+ */
+
+typedef void (*dirwatch_fn)(char* dir, char* name);
+
+int     dirwatch_init(void);
+void    dirwatch_subscribe(dirwatch_fn fn);
+int     dirwatch_add(char* dir);
+void    dirwatch_events(void);
+
+#endif
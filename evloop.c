@@ -0,0 +1,304 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/epoll.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+#include    "dirwatch.h"
+#include    "cgiexec.h"
+#include    "cgipool.h"
+#include    "evloop.h"
+#include    "filecache.h"
+#include    "listener.h"
+#include    "lscache.h"
+#include    "shed.h"
+#include    "statcache.h"
+#include    "uring.h"
+#include    "wsng.h"
+
+/*
+ * evloop.c - serve many connections from one process with epoll
+ *
+ * every socket is non-blocking and registered edge-triggered, so
+ * each wakeup must run a connection until it would block.  the
+ * listening socket is registered with a NULL data pointer, the
+ * caches' inotify descriptor with INOTIFY_TAG and the signalfd that
+ * reports exited children with SIGNAL_TAG; client sockets carry
+ * their connection.  a connection moves through
+ *
+ *      CS_READ -> CS_PARSE -> CS_HEADER -> CS_BODY -> CS_DONE
+ *
+ * and at CS_DONE either goes back to CS_READ for the next request
+ * on a kept-alive connection or is closed.  each time the loop
+ * leaves a connection it files conn_deadline(c) in a timer wheel
+ * (see wheel.c); a connection still there when its time comes, idle,
+ * trickling in a request or not taking its reply, is closed.
+ *
+ * a cgi request parks its connection in CS_CGI.  the pipe from an
+ * exec'd program (see cgiexec.c), or the socket of a pooled worker
+ * (see cgipool.c), is registered with the same connection, so its
+ * output brings the loop back to it.  the wheel also stops programs
+ * that pass cgi_timeout or cgi_idle_timeout.  as one connection can
+ * turn up twice in a batch of events, closed connections are freed
+ * only after the batch.
+ *
+ * with "io_uring on" the same work is done by uring.c instead, if
+ * the kernel can; evloop_watch and evloop_unwatch then go there.
+ */
+
+#define MAXEVENTS   64
+#define TICK_MS     1000        /* wake at least this often for the wheel */
+
+#define oops(m,x) {perror(m); exit(x);}
+
+#define INOTIFY_TAG ((void*) &epfd)
+#define SIGNAL_TAG  ((void*) &sigfd)
+
+static int epfd;
+static int sigfd;               /* SIGCHLD, or -1: reap every tick */
+static wheel timers;            /* every open connection's deadline */
+static connection* closed;      /* to be freed after this batch */
+static int uring;               /* run_uring_loop is the one running */
+static int accept_again;        /* accept_all stopped short; see it */
+
+
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static void drop_conn(connection* c)
+{
+    timer_cancel(&c->timer);
+
+    /* no more events for it; it is freed after this batch */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    cgi_stop(c);
+    c->state = CS_CLOSED;
+    c->next = closed;
+    closed = c;
+}
+
+
+static void free_closed()
+{
+    connection* c;
+
+    while ((c = closed) != NULL) {
+        closed = c->next;
+        conn_free(c);
+    }
+}
+
+
+void evloop_watch(int fd, void* c)
+{
+    struct epoll_event ev;
+
+    if (uring) {
+        uring_watch(fd, c);
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        perror("epoll_ctl");
+}
+
+
+void evloop_unwatch(int fd)
+{
+    if (uring) {
+        uring_unwatch(fd);
+        return;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+/*
+ * accept_all -- take every pending call; with an edge-triggered
+ * listening socket one wakeup may stand for many connections
+ *    note: if accept fails with calls still queued, such as when we
+ *          are out of memory, accept_again has the loop come back
+ *          on its next pass, as no new edge may come
+ */
+static void accept_all(int sock)
+{
+    struct epoll_event ev;
+    connection* c;
+    int fd;
+
+    shed_backlog(sock);
+    while ((fd = listener_accept(sock)) != -1) {
+        if ((c = conn_new(fd)) == NULL) {
+            close(fd);
+            continue;
+        }
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            conn_free(c);
+        } else
+            timer_set(&timers, &c->timer, conn_deadline(c));
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        accept_again = 0;
+    else {
+        if (!accept_again)
+            perror("accept");
+        accept_again = 1;
+    }
+}
+
+
+/*
+ * advance -- move one connection as far as the socket allows,
+ *            through as many kept-alive requests as are ready
+ */
+static void advance(connection* c)
+{
+    int rv;
+
+    while (1) {
+        if (c->state == CS_READ) {
+            rv = conn_read(c);
+            if (rv == CONN_AGAIN)
+                return;
+            if (rv == CONN_ERR) {
+                drop_conn(c);
+                return;
+            }
+        }
+        if (c->state == CS_PARSE)
+            serve_pending(c);
+        while (c->state == CS_CGI) {
+            rv = cgi_continue(c);
+            if (rv == CONN_AGAIN)
+                return;
+            if (rv == CONN_ERR) {
+                drop_conn(c);
+                return;
+            }
+        }
+        rv = conn_send(c);
+        if (rv == CONN_AGAIN)
+            return;
+        if (rv == CONN_ERR || !c->keepalive) {
+            drop_conn(c);
+            return;
+        }
+        conn_reset(c);
+    }
+}
+
+
+/*
+ * serve -- advance c, then note when it must next have moved
+ */
+static void serve(connection* c)
+{
+    if (c->state == CS_CLOSED)      /* earlier in this batch */
+        return;
+    advance(c);
+    if (c->state != CS_CLOSED)
+        timer_set(&timers, &c->timer, conn_deadline(c));
+}
+
+
+/*
+ * expired -- c's deadline came: close it, or stop its cgi program
+ * and send the 504
+ */
+static void expired(timer* t)
+{
+    connection* c = t->data;
+
+    if (!conn_timed_out(c, timers.now))
+        timer_set(&timers, t, conn_deadline(c));
+    else if (c->state == CS_CGI && cgi_expire(c) != CONN_ERR)
+        serve(c);
+    else
+        drop_conn(c);
+}
+
+
+void run_event_loop(int sock)
+{
+    struct epoll_event ev, events[MAXEVENTS];
+    int i, n, ifd;
+    long long start;
+
+    if (use_io_uring) {
+        uring = 1;
+        run_uring_loop(sock);       /* returns only if it cannot run */
+        uring = 0;
+        fprintf(stderr, "io_uring not available; using epoll\n");
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (set_nonblock(sock) == -1)
+        oops("fcntl", 2);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        oops("epoll_create1", 2);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1)
+        oops("epoll_ctl", 2);
+
+    wheel_init(&timers, wheel_now());
+    filecache_init(cache_size);
+    ifd = statcache_init(stat_cache_ttl);
+    if (lscache_init(ls_cache_ttl) != -1)   /* the same descriptor */
+        ifd = dirwatch_init();
+    if (ifd != -1) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = INOTIFY_TAG;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev) == -1)
+            oops("epoll_ctl", 2);
+    }
+    if ((sigfd = cgiexec_sigfd()) != -1) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = SIGNAL_TAG;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) == -1)
+            oops("epoll_ctl", 2);
+    }
+
+    while (1) {
+        n = epoll_wait(epfd, events, MAXEVENTS, TICK_MS);
+        if (n == -1 && errno != EINTR)
+            oops("epoll_wait", 2);
+        start = stats_now();
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_all(sock);
+            else if (events[i].data.ptr == INOTIFY_TAG)
+                dirwatch_events();
+            else if (events[i].data.ptr == SIGNAL_TAG)
+                cgiexec_reap(sigfd);
+            else
+                serve(events[i].data.ptr);
+        }
+        free_closed();
+        /* what became ready during this pass waited this long */
+        shed_delay(stats_now() - start);
+        if (sigfd == -1)
+            cgiexec_reap(-1);
+        wheel_expire(&timers, wheel_now(), expired);
+        free_closed();
+        if (accept_again)
+            accept_all(sock);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/*
+ * evloop.h - single process, edge-triggered epoll server loop
+ *
+ *  run_event_loop(sock)    serve every connection on the listening
+ *                          socket sock from this process; never returns
+ *  evloop_watch(fd, c)     serve connection c when fd has something
+ *                          to read or room to write (a cgi worker)
+ *  evloop_unwatch(fd)      stop that
+ */
+
+void run_event_loop(int sock);
+void evloop_watch(int fd, void* c);
+void evloop_unwatch(int fd);
+
+#endif
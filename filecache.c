@@ -0,0 +1,258 @@
+#include    <errno.h>
+#include    <pthread.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+#include    "filecache.h"
+
+/*
+ * filecache.c - file bodies and their reply headers, ready to send
+ *
+ * the stat cache keeps a descriptor open for each file, but each
+ * reply still reads the file (or has the kernel do it).  for small
+ * files that are asked for again and again it is cheaper to keep
+ * the bytes: an entry holds the body and the header lines that go
+ * with it (type, length, validators), so a hit is one writev of the
+ * reply's first lines, those lines and the body.
+ *
+ * entries are found by path and checked against the stat cache's
+ * entry for the file: a different inode, size or mtime means the
+ * file changed, and the entry is read again.  the bodies share one
+ * byte budget (cache_size in wsng.conf); when a new one does not
+ * fit, the least recently used go.  like stat entries they are
+ * reference counted, as a connection may be sending one that is
+ * being evicted.
+ *
+ * as with the stat cache, the table is locked for the threads mode
+ * and a file is read in without holding the lock.
+ */
+
+#define NBUCKETS    1024            /* power of two */
+#define MAXFILE     (1024 * 1024)   /* larger files are sent from disk */
+
+static size_t       budget;         /* 0: cache off */
+static size_t       used;
+static file_entry*  buckets[NBUCKETS];
+static file_entry*  oldest;         /* lru list */
+static file_entry*  newest;
+static filecache_info counts;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned hash(char* s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+void filecache_init(size_t bytes)
+{
+    budget = bytes;
+}
+
+
+static void release(file_entry* f)
+{
+    if (--f->refs > 0)
+        return;
+    free(f->path);
+    free(f->head);
+    free(f->body);
+    free(f);
+}
+
+
+static void unlink_entry(file_entry* f)
+{
+    file_entry** pp = &buckets[hash(f->path) & (NBUCKETS - 1)];
+
+    while (*pp != f)
+        pp = &(*pp)->hnext;
+    *pp = f->hnext;
+
+    if (f->older != NULL)
+        f->older->newer = f->newer;
+    else
+        oldest = f->newer;
+    if (f->newer != NULL)
+        f->newer->older = f->older;
+    else
+        newest = f->older;
+
+    f->cached = 0;
+    used -= f->bytes;
+    counts.entries--;
+    release(f);
+}
+
+
+static int same_file(file_entry* f, struct stat* info)
+{
+    return f->ino == info->st_ino && f->size == info->st_size
+           && f->mtime.tv_sec == info->st_mtim.tv_sec
+           && f->mtime.tv_nsec == info->st_mtim.tv_nsec;
+}
+
+
+/*
+ * read e's file and build its header lines
+ *    rets: the entry, or NULL if the file did not read back whole
+ */
+static file_entry* load(stat_entry* e, char* ctype)
+{
+    file_entry* f = calloc(1, sizeof(file_entry));
+    off_t size = e->info.st_size;
+    ssize_t n;
+    off_t got;
+    FILE* fp;
+
+    if (f == NULL || (f->path = strdup(e->path)) == NULL
+            || (f->body = malloc(size > 0 ? size : 1)) == NULL) {
+        perror("filecache");
+        exit(1);
+    }
+    for (got = 0; got < size; got += n) {
+        n = pread(e->fd, f->body + got, size - got, got);
+        if (n == -1 && errno == EINTR)
+            n = 0;
+        else if (n <= 0) {
+            f->refs = 1;
+            release(f);
+            return NULL;
+        }
+    }
+    if ((fp = open_memstream(&f->head, &f->headlen)) == NULL) {
+        perror("filecache");
+        exit(1);
+    }
+    fprintf(fp, "Content-type: %s\r\n", ctype);
+    fprintf(fp, "Content-Length: %lld\r\n", (long long) size);
+    fprintf(fp, "Accept-Ranges: bytes\r\n");
+    fprintf(fp, "ETag: %s\r\n", e->etag);
+    fprintf(fp, "Last-Modified: %s\r\n", e->lastmod);
+    fprintf(fp, "\r\n");
+    fclose(fp);
+
+    f->ino = e->info.st_ino;
+    f->size = size;
+    f->mtime = e->info.st_mtim;
+    f->bytes = size + f->headlen + strlen(f->path) + sizeof(file_entry);
+    f->refs = 1;
+    return f;
+}
+
+
+static void insert(file_entry* f)
+{
+    file_entry** bp = &buckets[hash(f->path) & (NBUCKETS - 1)];
+
+    while (oldest != NULL && used + f->bytes > budget) {
+        unlink_entry(oldest);
+        counts.evictions++;
+    }
+    f->hnext = *bp;
+    *bp = f;
+    f->older = newest;
+    f->newer = NULL;
+    if (newest != NULL)
+        newest->newer = f;
+    else
+        oldest = f;
+    newest = f;
+    f->cached = 1;
+    f->refs++;                      /* the table's reference */
+    used += f->bytes;
+    counts.entries++;
+}
+
+
+/*
+ * the cached body of e's file, if it is still the file e describes;
+ * moved to the new end of the lru
+ */
+static file_entry* find(stat_entry* e)
+{
+    file_entry* f;
+
+    for (f = buckets[hash(e->path) & (NBUCKETS - 1)]; f != NULL; f = f->hnext)
+        if (strcmp(f->path, e->path) == 0)
+            break;
+    if (f != NULL && !same_file(f, &e->info)) {
+        unlink_entry(f);
+        return NULL;
+    }
+    if (f != NULL && f != newest) {
+        if (f->older != NULL)
+            f->older->newer = f->newer;
+        else
+            oldest = f->newer;
+        f->newer->older = f->older;
+        f->older = newest;
+        f->newer = NULL;
+        newest->newer = f;
+        newest = f;
+    }
+    return f;
+}
+
+
+/*
+ * filecache_get -- the body of the regular file e, from memory
+ *    args: e is the stat cache's current entry for the file, with
+ *          its descriptor open; ctype goes into the header lines
+ *    rets: an entry to hand back with filecache_put, or NULL if the
+ *          cache is off or the file is too big for it
+ */
+file_entry* filecache_get(stat_entry* e, char* ctype)
+{
+    file_entry *f, *fresh;
+
+    if (budget == 0 || e->fd == -1 || e->info.st_size > MAXFILE
+            || (size_t) e->info.st_size > budget / 4)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    if ((f = find(e)) != NULL)
+        counts.hits++;
+    else {
+        counts.misses++;
+        pthread_mutex_unlock(&lock);
+        if ((fresh = load(e, ctype)) == NULL)
+            return NULL;
+        pthread_mutex_lock(&lock);
+        if ((f = find(e)) == NULL) {
+            insert(fresh);
+            f = fresh;
+        } else
+            release(fresh);         /* another thread was quicker */
+    }
+    f->refs++;
+    pthread_mutex_unlock(&lock);
+    return f;
+}
+
+
+void filecache_put(file_entry* f)
+{
+    pthread_mutex_lock(&lock);
+    release(f);
+    pthread_mutex_unlock(&lock);
+}
+
+
+void filecache_report(filecache_info* info)
+{
+    pthread_mutex_lock(&lock);
+    *info = counts;
+    info->bytes = used;
+    info->budget = budget;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,48 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include    <sys/types.h>
+#include    <time.h>
+#include    "statcache.h"
+
+/*
+ * filecache.h - small, often requested files kept in memory
+ *
+ *  filecache_init(budget)      turn the cache on, budget in bytes
+ *  filecache_get(e, ctype)     the cached body of e's file; holds a
+ *                              reference, or NULL if not cacheable
+ *  filecache_put(f)            drop the reference from filecache_get
+ *  filecache_report(info)      counters, for sizing the budget
+ */
+
+typedef struct file_entry {
+    char*       path;
+    ino_t       ino;            /* what the file was when read,     */
+    off_t       size;           /*   to tell a changed one          */
+    struct timespec mtime;
+    char*       head;           /* header lines from Content-type   */
+    size_t      headlen;        /*   through the blank line         */
+    char*       body;
+    size_t      bytes;          /* counted against the budget       */
+    int         refs;           /* holders, the table counts as one */
+    int         cached;         /* still in the table               */
+    struct file_entry* hnext;   /* hash chain                       */
+    struct file_entry* newer;   /* lru list, oldest at the head     */
+    struct file_entry* older;
+} file_entry;
+
+typedef struct filecache_info {
+    unsigned long   hits;
+    unsigned long   misses;     /* cacheable, but had to be read    */
+    unsigned long   evictions;  /* pushed out to stay in budget     */
+    unsigned long   entries;
+    size_t          bytes;
+    size_t          budget;
+} filecache_info;
+
+void        filecache_init(size_t budget);
+file_entry* filecache_get(stat_entry* e, char* ctype);
+void        filecache_put(file_entry* f);
+void        filecache_report(filecache_info* info);
+
+#endif
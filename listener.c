@@ -0,0 +1,166 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+#include    "listener.h"
+#include    "socklib.h"
+#include    "wsng.h"
+
+/*
+ * listener.c - make the listening sockets and watch their queues
+ *
+ * every option is set on the listening socket, between bind and
+ * listen: the receive buffer decides the window scale offered in
+ * the SYN-ACK, and calls may be queued as soon as listen returns.
+ * Linux copies a listener's TCP_NODELAY, buffer sizes and
+ * SO_BUSY_POLL to each socket it accepts, so the event loops, the
+ * threads and the fork children all get them without a system call
+ * per connection.
+ * an option the kernel refuses is reported and the server goes on
+ * without it.
+ *
+ * the listeners are edge triggered in the event loops, so a wakeup
+ * must take calls until accept says EAGAIN; stopping short leaves
+ * the rest queued until another call comes in.  listener_accept
+ * steps over calls reset while they waited, and when the process is
+ * out of descriptors it gives up a spare one, kept for this, to
+ * accept the next call and close it: the client is turned away at
+ * once instead of waiting on a queue nobody is taking from.
+ *
+ * the kernel counts the calls it drops because a queue was full in
+ * /proc/net/netstat, for the whole network namespace since boot.
+ * the counts at the first listener_open are kept, and the report is
+ * what has been added since then.
+ */
+
+#define NETSTAT     "/proc/net/netstat"
+
+static listener_info base;      /* the counters when we started */
+static int spare = -1;          /* given up to refuse a call at EMFILE */
+
+
+static void set_opt(int sock, int level, int opt, int val, char* name)
+{
+    if (setsockopt(sock, level, opt, &val, sizeof(val)) == -1)
+        fprintf(stderr, "wsng: cannot set %s: %m\n", name);
+}
+
+
+/*
+ * read_netstat -- the TcpExt counters we report
+ *    note: the file is pairs of lines, "TcpExt:" and the counter
+ *          names, then "TcpExt:" and their values in the same order
+ */
+static void read_netstat(listener_info* info)
+{
+    FILE* fp;
+    char *names = NULL, *values = NULL, *n, *v, *ns, *vs;
+    size_t nlen = 0, vlen = 0;
+
+    memset(info, 0, sizeof(*info));
+    if ((fp = fopen(NETSTAT, "r")) == NULL)
+        return;
+    while (getline(&names, &nlen, fp) != -1
+            && getline(&values, &vlen, fp) != -1) {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+        n = strtok_r(names + 7, " \n", &ns);
+        v = strtok_r(values + 7, " \n", &vs);
+        for ( ; n != NULL && v != NULL;
+                n = strtok_r(NULL, " \n", &ns), v = strtok_r(NULL, " \n", &vs)) {
+            if (strcmp(n, "ListenOverflows") == 0)
+                info->overflows = strtoul(v, NULL, 10);
+            else if (strcmp(n, "ListenDrops") == 0)
+                info->drops = strtoul(v, NULL, 10);
+            else if (strcmp(n, "TCPReqQFullDrop") == 0)
+                info->syn_drops = strtoul(v, NULL, 10);
+            else if (strcmp(n, "TCPReqQFullDoCookies") == 0)
+                info->cookies = strtoul(v, NULL, 10);
+        }
+        info->known = 1;
+    }
+    free(names);
+    free(values);
+    fclose(fp);
+}
+
+
+int listener_open(int portnum, int shared)
+{
+    int sock;
+
+    if ((sock = make_bound_socket(portnum, shared)) == -1)
+        return -1;
+    if (tcp_nodelay)
+        set_opt(sock, IPPROTO_TCP, TCP_NODELAY, 1, "tcp_nodelay");
+    if (tcp_defer_accept > 0)
+        set_opt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, tcp_defer_accept,
+                "tcp_defer_accept");
+    if (tcp_fastopen > 0)
+        set_opt(sock, IPPROTO_TCP, TCP_FASTOPEN, tcp_fastopen,
+                "tcp_fastopen");
+    if (so_rcvbuf > 0)
+        set_opt(sock, SOL_SOCKET, SO_RCVBUF, so_rcvbuf, "so_rcvbuf");
+    if (so_sndbuf > 0)
+        set_opt(sock, SOL_SOCKET, SO_SNDBUF, so_sndbuf, "so_sndbuf");
+    if (busy_poll > 0)
+        set_opt(sock, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "busy_poll");
+    if (listen(sock, listen_backlog) == -1) {
+        close(sock);
+        return -1;
+    }
+    if (!base.known)
+        read_netstat(&base);
+    if (spare == -1)
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return sock;
+}
+
+
+/*
+ * listener_accept -- the next call waiting on sock, non-blocking
+ *    rets: its socket, or -1 with errno EAGAIN when there are no
+ *          more, or with the error that stopped us; then the caller
+ *          should try again later, as no new edge may come
+ */
+int listener_accept(int sock)
+{
+    int fd;
+
+    while (1) {
+        fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd != -1)
+            return fd;
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            continue;
+        if ((errno != EMFILE && errno != ENFILE) || spare == -1)
+            return -1;
+        close(spare);
+        if ((fd = accept(sock, NULL, NULL)) != -1)
+            close(fd);
+        spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return -1;
+    }
+}
+
+
+void listener_report(listener_info* info)
+{
+    read_netstat(info);
+    if (!base.known)
+        info->known = 0;
+    if (!info->known)
+        return;
+    info->overflows -= base.overflows;
+    info->drops -= base.drops;
+    info->syn_drops -= base.syn_drops;
+    info->cookies -= base.cookies;
+}
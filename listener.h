@@ -0,0 +1,30 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+/*
+ * listener.h - the listening sockets, tuned from wsng.conf
+ *
+ *  listener_open(port, shared) a listening socket with the listen_,
+ *                              tcp_, so_ and busy_poll settings;
+ *                              shared sets SO_REUSEPORT.  -1 if the
+ *                              socket cannot be made
+ *  listener_accept(sock)       the next call on sock, or -1; errno
+ *                              EAGAIN when there are no more
+ *  listener_report(info)       listen queue overflows counted by the
+ *                              kernel since the first listener_open
+ */
+
+typedef struct listener_info {
+    int             known;      /* 0 if /proc/net/netstat is unread */
+    unsigned long   overflows;  /* accept queue full (ListenOverflows) */
+    unsigned long   drops;      /* calls dropped in all (ListenDrops) */
+    unsigned long   syn_drops;  /* SYN queue full (TCPReqQFullDrop) */
+    unsigned long   cookies;    /* SYN queue full, answered with a
+                                   syncookie (TCPReqQFullDoCookies) */
+} listener_info;
+
+int     listener_open(int portnum, int shared);
+int     listener_accept(int sock);
+void    listener_report(listener_info* info);
+
+#endif
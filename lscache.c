@@ -0,0 +1,195 @@
+#include    <pthread.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    "dirwatch.h"
+#include    "lscache.h"
+#include    "wheel.h"
+
+/*
+ * lscache.c - directory listings as ready-made reply text
+ *
+ * a listing costs a readdir of the directory and a stat, a user and
+ * group lookup and a strftime per entry; on a big directory that is
+ * a large part of a second.  do_ls renders it once and stores the
+ * text here, along with which index file, if any, stands in for it.
+ *
+ * the listed directory is watched through dirwatch, and any event
+ * in it drops the entry.  changes further down (a file written in a
+ * subdirectory, say) only show in the listing after ttl seconds.
+ *
+ * the table is locked for the threads mode, and entries are
+ * reference counted so a listing being copied into a reply is not
+ * freed under the thread copying it.
+ */
+
+#define NBUCKETS    256             /* power of two */
+#define MAXENTRIES  256             /* then the oldest goes */
+
+static int          enabled;
+static int          ttl;
+static ls_entry*    buckets[NBUCKETS];
+static ls_entry*    oldest;
+static ls_entry*    newest;
+static int          nentries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void changed(char* dir, char* name);
+
+
+static unsigned hash(char* s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ * lscache_init -- start caching listings in this process
+ *    rets: the inotify descriptor to poll for dirwatch_events, or -1
+ *    note: ttl 0 leaves the cache off
+ */
+int lscache_init(int secs)
+{
+    ttl = secs;
+    enabled = (ttl > 0);
+    if (!enabled)
+        return -1;
+    dirwatch_subscribe(changed);
+    return dirwatch_init();
+}
+
+
+static void release(ls_entry* e)
+{
+    if (--e->refs > 0)
+        return;
+    free(e->dir);
+    free(e->text);
+    free(e);
+}
+
+
+static void drop(ls_entry* e)
+{
+    ls_entry** pp = &buckets[hash(e->dir) & (NBUCKETS - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+
+    nentries--;
+    release(e);
+}
+
+
+/*
+ * lscache_get -- the listing of dir if it is cached and fresh
+ *    rets: an entry to hand back with lscache_put, or NULL
+ */
+ls_entry* lscache_get(char* dir)
+{
+    ls_entry* e;
+
+    if (!enabled)
+        return NULL;
+    pthread_mutex_lock(&lock);
+    for (e = buckets[hash(dir) & (NBUCKETS - 1)]; e != NULL; e = e->hnext)
+        if (strcmp(e->dir, dir) == 0)
+            break;
+    if (e != NULL && wheel_now() - e->loaded >= ttl) {
+        drop(e);
+        e = NULL;
+    }
+    if (e != NULL)
+        e->refs++;
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+
+void lscache_put(ls_entry* e)
+{
+    pthread_mutex_lock(&lock);
+    release(e);
+    pthread_mutex_unlock(&lock);
+}
+
+
+/*
+ * lscache_store -- keep the listing of dir
+ *    args: index is a string constant; text is malloc'd, or NULL
+ *    rets: 1 if the cache took text over, 0 if the caller still
+ *          owns it (cache off, or dir cannot be watched)
+ */
+int lscache_store(char* dir, char* index, char* text, size_t len)
+{
+    ls_entry** bp;
+    ls_entry* e;
+
+    if (!enabled || dirwatch_add(dir) == -1)
+        return 0;
+    if ((e = calloc(1, sizeof(ls_entry))) == NULL
+            || (e->dir = strdup(dir)) == NULL) {
+        perror("lscache");
+        exit(1);
+    }
+    e->index = index;
+    e->text = text;
+    e->len = len;
+    e->loaded = wheel_now();
+    e->refs = 1;                    /* the table's reference */
+
+    pthread_mutex_lock(&lock);
+    if (nentries == MAXENTRIES)
+        drop(oldest);
+    bp = &buckets[hash(dir) & (NBUCKETS - 1)];
+    e->hnext = *bp;
+    *bp = e;
+    e->older = newest;
+    if (newest != NULL)
+        newest->newer = e;
+    else
+        oldest = e;
+    newest = e;
+    nentries++;
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+
+/*
+ * anything happening in dir changes its listing
+ */
+static void changed(char* dir, char* name)
+{
+    ls_entry *e, *next;
+
+    pthread_mutex_lock(&lock);
+    if (dir == NULL) {
+        while (oldest != NULL)
+            drop(oldest);
+    } else {
+        /* two threads may have stored the same dir */
+        for (e = buckets[hash(dir) & (NBUCKETS - 1)]; e != NULL; e = next) {
+            next = e->hnext;
+            if (strcmp(e->dir, dir) == 0)
+                drop(e);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,37 @@
+#ifndef LSCACHE_H
+#define LSCACHE_H
+
+#include    <stddef.h>
+#include    <time.h>
+
+/*
+ * lscache.h - rendered directory listings, kept until the dir changes
+ *
+ *  lscache_init(ttl)       turn the cache on in this process
+ *  lscache_get(dir)        the cached listing of dir, or NULL; holds
+ *                          a reference
+ *  lscache_put(e)          drop the reference from lscache_get
+ *  lscache_store(...)      remember a listing just rendered
+ *
+ * entries go when dirwatch reports a change in dir, or after ttl
+ * seconds; one that is still held is freed when it is put.
+ */
+
+typedef struct ls_entry {
+    char*       dir;            /* as process_rq names it           */
+    char*       index;          /* "index.html", "index.cgi" or ""  */
+    char*       text;           /* the listing when index is ""     */
+    size_t      len;
+    time_t      loaded;
+    int         refs;           /* holders, the table counts as one */
+    struct ls_entry* hnext;     /* hash chain                       */
+    struct ls_entry* newer;     /* age list, oldest at the head     */
+    struct ls_entry* older;
+} ls_entry;
+
+int         lscache_init(int ttl);
+ls_entry*   lscache_get(char* dir);
+void        lscache_put(ls_entry* e);
+int         lscache_store(char* dir, char* index, char* text, size_t len);
+
+#endif
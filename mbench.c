@@ -0,0 +1,423 @@
+#define     _GNU_SOURCE
+
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/stat.h>
+#include    <time.h>
+#include    <unistd.h>
+#include    "conn.h"
+#include    "mime.h"
+#include    "request.h"
+#include    "stats.h"
+#include    "web-time.h"
+#include    "wsng_util.h"
+
+/*
+ * mbench.c - time the helpers on the request path, one at a time
+ *
+ *    usage: mbench [-r runs] [-t ms] [name ...]
+ *
+ *      -r n    timed runs of each benchmark (15)
+ *      -t n    milliseconds a run should take (20)
+ *      name    run only the benchmarks whose names start with one
+ *              of these, e.g. "rq_" or "list_dir"
+ *
+ * a benchmark is a loop of n calls.  n is doubled until a run takes
+ * the -t time, which also warms the caches and the branch predictor;
+ * one more untimed run follows, then the timed ones.  the result is
+ * the median time per call over the runs, with the median absolute
+ * deviation from it as the spread, which one preempted run does not
+ * move the way it moves a mean and standard deviation.
+ *
+ * the output is one JSON object per line, so two builds can be
+ * compared with a short script:
+ *
+ *  {"name":"rq_parse/simple","iters":262144,"runs":15,
+ *   "median_ns":101.3,"mad_ns":0.8,"min_ns":99.7}
+ *
+ * wsng.c is linked in, compiled with its main renamed, for the
+ * helpers it keeps to itself.
+ *
+ *  compile: make mbench; make microbench builds and runs it
+ */
+
+#define DEF_RUNS    15
+#define DEF_MS      20
+#define MAXRUNS     101
+#define BIGDIR      5000            /* files in the listing benchmark */
+
+/* from wsng.c */
+char*   check_if_index(char* dir);
+void    list_dir(char* dir, char** textp, size_t* lenp);
+void    header(connection* c, int code, char* msg, char* content_type);
+void    end_reply(connection* c);
+
+typedef struct bench {
+    char*   name;
+    void    (*run)(long n);
+} bench;
+
+static volatile long sink;          /* results go here, so they count */
+static char dirpath[PATH_MAX];      /* the big directory             */
+
+
+/* ------------------------------------------------------------------ *
+   the request parser
+   ------------------------------------------------------------------ */
+
+static char simple_rq[] = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static char browser_rq[] =
+    "GET /docs/guide/install.html?lang=en HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+        "Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/docs/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=4f1c2a9be0d34e7a; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static char deep_rq[] =
+    "GET /a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z/"
+    "static/images/icons/32x32/file.png HTTP/1.1\r\n\r\n";
+
+static char dotdot_rq[] =
+    "GET /../a/./b/../../c//d/./../../../etc/./x/../../passwd/"
+    "..//./../a/b/c/../../../d/e/../f/./g/.. HTTP/1.1\r\n\r\n";
+
+static char buf[CONN_BUFLEN];
+
+
+/*
+ * parse the request in s, all of it at once
+ */
+static void parse_whole(char* s, long n)
+{
+    request rq;
+    int len = strlen(s);
+
+    memcpy(buf, s, len + 1);
+    while (n-- > 0) {
+        rq_init(&rq);
+        sink += rq_parse(&rq, buf, len, sizeof(buf) - 1 - len);
+    }
+}
+
+
+static void b_parse_simple(long n)  { parse_whole(simple_rq, n); }
+static void b_parse_browser(long n) { parse_whole(browser_rq, n); }
+
+
+/*
+ * the browser request arriving a byte at a time, as a slow client
+ * sends it: rq_parse is called again after each one
+ */
+static void b_parse_bytewise(long n)
+{
+    request rq;
+    int len = strlen(browser_rq), i;
+
+    memcpy(buf, browser_rq, len + 1);
+    while (n-- > 0) {
+        rq_init(&rq);
+        for (i = 1; i <= len; i++)
+            sink += rq_parse(&rq, buf, i, sizeof(buf) - 1 - i);
+    }
+}
+
+
+/*
+ * rq_path on the request in s; it rewrites the path in place, so
+ * the path's bytes are put back each time
+ */
+static void path_of(char* s, long n)
+{
+    request rq, parsed;
+    int len = strlen(s), off;
+
+    memcpy(buf, s, len + 1);
+    rq_init(&parsed);
+    rq_parse(&parsed, buf, len, sizeof(buf) - 1 - len);
+    off = parsed.path.ptr - buf;
+    while (n-- > 0) {
+        memcpy(buf + off, s + off, parsed.path.len + 1);
+        rq = parsed;
+        sink += rq_path(&rq)[0];
+    }
+}
+
+
+static void b_path_deep(long n)     { path_of(deep_rq, n); }
+static void b_path_dotdot(long n)   { path_of(dotdot_rq, n); }
+
+
+/* ------------------------------------------------------------------ *
+   content types
+   ------------------------------------------------------------------ */
+
+static char* exts[] = { "html", "css", "js", "png", "JPG", "gif", "txt",
+                        "pdf", "svg", "json", "woff2", "ico" };
+#define NEXTS   (sizeof(exts) / sizeof(exts[0]))
+
+static void b_mime_hit(long n)
+{
+    while (n-- > 0)
+        sink += (long) mime_lookup(exts[n % NEXTS]);
+}
+
+
+static void b_mime_miss(long n)
+{
+    while (n-- > 0)
+        sink += (long) mime_lookup("nosuchtype");
+}
+
+
+/* ------------------------------------------------------------------ *
+   a reply header: header(), end_reply() and on to the next request,
+   on a connection whose socket is never written
+   ------------------------------------------------------------------ */
+
+static void b_reply_header(long n)
+{
+    connection* c;
+    int fd = open("/dev/null", O_WRONLY);
+
+    if (fd == -1 || (c = conn_new(fd)) == NULL) {
+        perror("reply/header");
+        exit(1);
+    }
+    rq_init(&c->rq);
+    c->keepalive = 1;
+    strcpy(c->peer, "-");
+    while (n-- > 0) {
+        header(c, 200, "OK", "text/html");
+        fputs("<html>hello</html>\n", c->fp);
+        end_reply(c);
+        sink += c->outlen;
+        conn_next_request(c);
+        conn_reset(c);
+    }
+    conn_free(c);
+}
+
+
+/* ------------------------------------------------------------------ *
+   times and listings
+   ------------------------------------------------------------------ */
+
+static void b_rfc822_time(long n)
+{
+    char date[RFC822_LEN];
+    time_t t = 784111777;           /* a new second every call */
+
+    while (n-- > 0)
+        sink += rfc822_time(t + n, date)[0];
+}
+
+
+static void b_fmt_time(long n)
+{
+    char date[MAXDATELEN];
+    time_t t = 784111777;
+
+    while (n-- > 0)
+        sink += fmt_time(t + n * 61, DATE_FMT, date)[0];
+}
+
+
+static void b_mode_to_letters(long n)
+{
+    static int modes[] = { S_IFREG | 0644, S_IFDIR | 0755, S_IFREG | 04755,
+                           S_IFLNK | 0777, S_IFDIR | 01777, S_IFREG | 0600 };
+    char str[11];
+
+    while (n-- > 0)
+        sink += mode_to_letters(modes[n % 6], str)[0];
+}
+
+
+static void b_check_if_index(long n)
+{
+    while (n-- > 0)
+        sink += check_if_index(dirpath)[0];
+}
+
+
+static void b_list_dir(long n)
+{
+    char* text;
+    size_t len;
+
+    while (n-- > 0) {
+        list_dir(dirpath, &text, &len);
+        sink += len;
+        free(text);
+    }
+}
+
+
+static bench benches[] = {
+    { "rq_parse/simple",        b_parse_simple },
+    { "rq_parse/browser",       b_parse_browser },
+    { "rq_parse/bytewise",      b_parse_bytewise },
+    { "rq_path/deep",           b_path_deep },
+    { "rq_path/dotdot",         b_path_dotdot },
+    { "mime_lookup/hit",        b_mime_hit },
+    { "mime_lookup/miss",       b_mime_miss },
+    { "reply/header",           b_reply_header },
+    { "rfc822_time",            b_rfc822_time },
+    { "fmt_time",               b_fmt_time },
+    { "mode_to_letters",        b_mode_to_letters },
+    { "check_if_index/5000",    b_check_if_index },
+    { "list_dir/5000",          b_list_dir },
+};
+#define NBENCHES    (sizeof(benches) / sizeof(benches[0]))
+
+
+/* ------------------------------------------------------------------ *
+   the harness
+   ------------------------------------------------------------------ */
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static double timed(bench* b, long n)
+{
+    double start = now_ns();
+
+    b->run(n);
+    return now_ns() - start;
+}
+
+
+static int by_value(const void* a, const void* b)
+{
+    double x = *(double*) a, y = *(double*) b;
+
+    return (x > y) - (x < y);
+}
+
+
+static double median(double* v, int n)
+{
+    qsort(v, n, sizeof(double), by_value);
+    return (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+/*
+ * measure -- run b and print its line
+ */
+static void measure(bench* b, int runs, double run_ns)
+{
+    double per[MAXRUNS], dev[MAXRUNS], med, mad, least;
+    long n = 1;
+    int i;
+
+    while (timed(b, n) < run_ns && n < LONG_MAX / 2)
+        n *= 2;
+    timed(b, n);                    /* warm up at the final size */
+    for (i = 0; i < runs; i++)
+        per[i] = timed(b, n) / n;
+    med = median(per, runs);        /* sorts per */
+    least = per[0];
+    for (i = 0; i < runs; i++)
+        dev[i] = per[i] > med ? per[i] - med : med - per[i];
+    mad = median(dev, runs);
+    printf("{\"name\":\"%s\",\"iters\":%ld,\"runs\":%d,"
+           "\"median_ns\":%.1f,\"mad_ns\":%.1f,\"min_ns\":%.1f}\n",
+           b->name, n, runs, med, mad, least);
+    fflush(stdout);
+}
+
+
+/*
+ * make_bigdir -- a directory of BIGDIR empty files, none an index
+ */
+static void make_bigdir(void)
+{
+    char path[PATH_MAX + 16];
+    int i, fd;
+
+    snprintf(dirpath, sizeof(dirpath), "/tmp/mbench.XXXXXX");
+    if (mkdtemp(dirpath) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    for (i = 0; i < BIGDIR; i++) {
+        snprintf(path, sizeof(path), "%s/file%05d.html", dirpath, i);
+        if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) != -1)
+            close(fd);
+    }
+}
+
+
+static void remove_bigdir(void)
+{
+    char path[PATH_MAX + 16];
+    int i;
+
+    for (i = 0; i < BIGDIR; i++) {
+        snprintf(path, sizeof(path), "%s/file%05d.html", dirpath, i);
+        unlink(path);
+    }
+    rmdir(dirpath);
+}
+
+
+static int wanted(char* name, char** only, int nonly)
+{
+    int i;
+
+    if (nonly == 0)
+        return 1;
+    for (i = 0; i < nonly; i++)
+        if (strncmp(name, only[i], strlen(only[i])) == 0)
+            return 1;
+    return 0;
+}
+
+
+int main(int ac, char* av[])
+{
+    int runs = DEF_RUNS, ms = DEF_MS, opt;
+    unsigned i;
+
+    while ((opt = getopt(ac, av, "r:t:")) != -1) {
+        switch (opt) {
+        case 'r': runs = atoi(optarg); break;
+        case 't': ms = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: mbench [-r runs] [-t ms] [name ...]\n");
+            exit(1);
+        }
+    }
+    if (runs < 1 || runs > MAXRUNS || ms < 1) {
+        fprintf(stderr, "mbench: runs is 1 to %d, ms at least 1\n", MAXRUNS);
+        exit(1);
+    }
+    mime_build();
+    make_bigdir();
+    for (i = 0; i < NBENCHES; i++)
+        if (wanted(benches[i].name, av + optind, ac - optind))
+            measure(&benches[i], runs, ms * 1e6);
+    remove_bigdir();
+    return 0;
+}
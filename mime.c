@@ -0,0 +1,155 @@
+#include    <ctype.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    "mime.h"
+
+/*
+ * mime.c - content types by file extension
+ *
+ * the table starts with the common types below; "type" lines in
+ * wsng.conf add to them or override them.  once the config file is
+ * read, mime_build() puts everything into an open addressing hash
+ * table keyed by the lowercase extension.  from then on the table
+ * is only read, so a lookup is one hash of the extension and, at a
+ * load factor of at most one half, about one key compare.
+ */
+
+typedef struct mime_entry {
+    char*   ext;                /* lowercase, no dot */
+    char*   type;
+} mime_entry;
+
+static const mime_entry builtin[] = {
+    { "html",  "text/html" },
+    { "htm",   "text/html" },
+    { "css",   "text/css" },
+    { "txt",   "text/plain" },
+    { "csv",   "text/csv" },
+    { "xml",   "text/xml" },
+    { "js",    "application/javascript" },
+    { "json",  "application/json" },
+    { "pdf",   "application/pdf" },
+    { "zip",   "application/zip" },
+    { "gz",    "application/gzip" },
+    { "tar",   "application/x-tar" },
+    { "wasm",  "application/wasm" },
+    { "gif",   "image/gif" },
+    { "jpg",   "image/jpeg" },
+    { "jpeg",  "image/jpeg" },
+    { "png",   "image/png" },
+    { "svg",   "image/svg+xml" },
+    { "ico",   "image/x-icon" },
+    { "webp",  "image/webp" },
+    { "mp3",   "audio/mpeg" },
+    { "ogg",   "audio/ogg" },
+    { "wav",   "audio/wav" },
+    { "mp4",   "video/mp4" },
+    { "webm",  "video/webm" },
+    { "woff",  "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf",   "font/ttf" },
+};
+#define NBUILTIN    (sizeof(builtin) / sizeof(builtin[0]))
+
+static mime_entry*  added;      /* from the config file, in order */
+static int          nadded;
+static int          maxadded;
+
+static mime_entry*  table;      /* the frozen hash table */
+static unsigned     mask;       /* table size - 1, size a power of 2 */
+
+
+/*
+ * FNV-1a over the lowercased extension
+ */
+static unsigned hash(char* ext)
+{
+    unsigned h = 2166136261u;
+
+    while (*ext) {
+        h ^= (unsigned char) tolower((unsigned char) *ext++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+void mime_add(char* ext, char* type)
+{
+    char* cp;
+
+    if (nadded == maxadded) {
+        maxadded = maxadded ? maxadded * 2 : 32;
+        added = realloc(added, maxadded * sizeof(mime_entry));
+        if (added == NULL) {
+            perror("mime_add");
+            exit(1);
+        }
+    }
+    if (*ext == '.')
+        ext++;
+    added[nadded].ext = strdup(ext);
+    added[nadded].type = strdup(type);
+    if (added[nadded].ext == NULL || added[nadded].type == NULL) {
+        perror("mime_add");
+        exit(1);
+    }
+    for (cp = added[nadded].ext; *cp; cp++)
+        *cp = tolower((unsigned char) *cp);
+    nadded++;
+}
+
+
+/*
+ * insert, replacing an earlier entry for the same extension
+ */
+static void insert(char* ext, char* type)
+{
+    unsigned i = hash(ext) & mask;
+
+    while (table[i].ext != NULL && strcmp(table[i].ext, ext) != 0)
+        i = (i + 1) & mask;
+    table[i].ext = ext;
+    table[i].type = type;
+}
+
+
+void mime_build(void)
+{
+    unsigned size = 16;
+    unsigned i;
+
+    while (size < 2 * (NBUILTIN + nadded))
+        size *= 2;
+    free(table);
+    if ((table = calloc(size, sizeof(mime_entry))) == NULL) {
+        perror("mime_build");
+        exit(1);
+    }
+    mask = size - 1;
+
+    for (i = 0; i < NBUILTIN; i++)
+        insert(builtin[i].ext, builtin[i].type);
+    for (i = 0; i < nadded; i++)
+        insert(added[i].ext, added[i].type);
+}
+
+
+/*
+ * mime_lookup -- content type for extension ext (no dot)
+ *    rets: the type, or NULL if neither the builtin list nor the
+ *          config file knows ext
+ */
+char* mime_lookup(char* ext)
+{
+    unsigned i;
+
+    if (table == NULL)
+        return NULL;
+    for (i = hash(ext) & mask; table[i].ext != NULL; i = (i + 1) & mask)
+        if (strcasecmp(table[i].ext, ext) == 0)
+            return table[i].type;
+    return NULL;
+}
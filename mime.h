@@ -0,0 +1,16 @@
+#ifndef MIME_H
+#define MIME_H
+
+/*
+ * mime.h - file extension to content type table
+ *
+ *  mime_add(ext, type)     add or replace an entry; config time only
+ *  mime_build()            freeze the entries into the lookup table
+ *  mime_lookup(ext)        content type for ext, any case, or NULL
+ */
+
+void    mime_add(char* ext, char* type);
+void    mime_build(void);
+char*   mime_lookup(char* ext);
+
+#endif
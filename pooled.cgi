@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+#
+# pooled.cgi - a cgi worker for "cgi_pool pooled.cgi n" in wsng.conf
+#
+# requests come in on fd 0 and answers go out on fd 1, as the
+# records described in cgipool.c.  print debugging to stderr; a
+# stray line on stdout would break the framing.
+
+import os, struct, sys
+
+PARAMS, STDIN, STDOUT, END = 1, 2, 3, 4
+
+def readn(n):
+    data = b""
+    while len(data) < n:
+        more = os.read(0, n - len(data))
+        if not more:
+            sys.exit(0)                 # the server closed: exit
+        data += more
+    return data
+
+def record():
+    head = readn(8)
+    return head[1], readn(struct.unpack(">I", head[4:])[0])
+
+def send(kind, data):
+    os.write(1, bytes([1, kind, 0, 0]) + struct.pack(">I", len(data)) + data)
+
+served = 0
+while True:
+    params = b""
+    while True:                         # PARAMS, up to an empty one
+        kind, data = record()
+        if kind == PARAMS and not data:
+            break
+        params += data
+    while True:                         # STDIN, empty for a GET
+        kind, data = record()
+        if kind == STDIN and not data:
+            break
+    env = dict(p.split(b"=", 1) for p in params.split(b"\0") if b"=" in p)
+    served += 1
+    send(STDOUT, b"Content-type: text/plain\r\n\r\n")
+    send(STDOUT, b"pid %d, request %d, query %s\n"
+         % (os.getpid(), served, env.get(b"QUERY_STRING", b"")))
+    send(END, b"")
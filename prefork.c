@@ -0,0 +1,140 @@
+#include    <errno.h>
+#include    <signal.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <sys/types.h>
+#include    <sys/wait.h>
+#include    <time.h>
+#include    <unistd.h>
+#include    "accesslog.h"
+#include    "evloop.h"
+#include    "listener.h"
+#include    "prefork.h"
+#include    "stats.h"
+#include    "wheel.h"
+
+/*
+ * prefork.c - a master process supervising long-lived workers
+ *
+ * the master opens one SO_REUSEPORT socket per worker, so the
+ * kernel spreads incoming calls over the workers, and forks the
+ * workers.  each worker closes the other sockets and runs the epoll
+ * loop on its own.  the master keeps every socket open and just
+ * waits; when a worker dies a new one is started on the same
+ * socket, so calls already queued on it are not lost.
+ *
+ * SIGUSR1 (reopen the access log) sent to the master is passed on
+ * to every worker, since each writes the log itself.
+ */
+
+#define RESPAWN_DELAY   1       /* seconds; throttles a crash loop */
+
+#define oops(m,x) {perror(m); exit(x);}
+
+static int     nworkers;
+static int*    socks;           /* listening socket of each worker */
+static pid_t*  pids;            /* pid of each worker, 0 if none   */
+static time_t* started;         /* when each worker was forked     */
+
+
+/*
+ * the master takes its workers down with it
+ */
+static void stop_workers(int signum)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    _exit(0);
+}
+
+
+static void rotate_workers(int signum)
+{
+    int i;
+
+    accesslog_rotate(signum);
+    for (i = 0; i < nworkers; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGUSR1);
+}
+
+
+static void start_worker(int i)
+{
+    int j;
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        pids[i] = 0;
+        return;
+    }
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGUSR1, accesslog_rotate);
+        stats_slot(i + 1);
+        for (j = 0; j < nworkers; j++)
+            if (j != i)
+                close(socks[j]);
+        run_event_loop(socks[i]);
+        exit(0);
+    }
+    pids[i] = pid;
+    started[i] = wheel_now();
+    printf("worker %d started, pid %d\n", i, (int) pid);
+    fflush(stdout);
+}
+
+
+/*
+ * run_prefork -- open the sockets, start n workers and restart
+ * any that exit.  does not return.
+ */
+void run_prefork(int portnum, int n)
+{
+    int i, status;
+    pid_t pid;
+
+    nworkers = n;
+    socks = malloc(n * sizeof(int));
+    pids = calloc(n, sizeof(pid_t));
+    started = calloc(n, sizeof(time_t));
+    if (socks == NULL || pids == NULL || started == NULL)
+        oops("memory error", 1);
+
+    for (i = 0; i < n; i++)
+        if ((socks[i] = listener_open(portnum, 1)) == -1)
+            oops("making socket", 2);
+
+    signal(SIGTERM, stop_workers);
+    signal(SIGINT, stop_workers);
+    signal(SIGUSR1, rotate_workers);
+    fflush(stdout);             /* don't copy pending output to workers */
+    for (i = 0; i < n; i++)
+        start_worker(i);
+
+    while (1) {
+        pid = wait(&status);
+        if (pid == -1) {
+            if (errno != EINTR)
+                sleep(RESPAWN_DELAY);   /* nobody running, fork failed */
+            for (i = 0; i < n; i++)
+                if (pids[i] == 0)
+                    start_worker(i);
+            continue;
+        }
+        for (i = 0; i < n && pids[i] != pid; i++) {}
+        if (i == n)
+            continue;           /* not one of ours */
+
+        printf("worker %d (pid %d) exited with status %d\n",
+               i, (int) pid, status);
+        if (wheel_now() - started[i] < RESPAWN_DELAY)
+            sleep(RESPAWN_DELAY);
+        start_worker(i);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+/*
+ * prefork.h - master/worker server mode
+ *
+ *  run_prefork(port, n)    start n workers, each with its own
+ *                          SO_REUSEPORT socket on port, and keep
+ *                          them running; never returns
+ */
+
+void run_prefork(int portnum, int n);
+
+#endif
@@ -0,0 +1,93 @@
+#include    <string.h>
+#include    "range.h"
+
+/*
+ * range.c - parse "Range: bytes=..." against a file of a given size
+ *
+ * each range is first-last, first- (to the end) or -n (the last n
+ * bytes).  ranges that start past the end of the file are dropped,
+ * and a last past the end is cut back to it.  a header we cannot
+ * parse, or one asking for more than max ranges, is ignored as
+ * RFC 9110 allows, and the whole file goes out with a 200.
+ */
+
+
+static int is_blank(char ch)
+{
+    return ch == ' ' || ch == '\t';
+}
+
+
+/*
+ * a decimal number; -1 if there is none or it is absurdly long
+ */
+static off_t number(char** pp, char* end)
+{
+    char* p = *pp;
+    off_t n = 0;
+
+    if (p == end || *p < '0' || *p > '9')
+        return -1;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (p - *pp >= 18)
+            return -1;
+        n = n * 10 + (*p - '0');
+    }
+    *pp = p;
+    return n;
+}
+
+
+/*
+ * range_parse -- the ranges of a file of size bytes that hdr asks for
+ *    rets: how many went into r, RANGE_NONE or RANGE_UNSAT
+ */
+int range_parse(slice* hdr, off_t size, byterange* r, int max)
+{
+    char* p = hdr->ptr;
+    char* end = hdr->ptr + hdr->len;
+    off_t first, last;
+    int n = 0, seen = 0;
+
+    if (hdr->len < 6 || strncmp(p, "bytes=", 6) != 0)
+        return RANGE_NONE;
+    for (p += 6; p < end; p++) {
+        while (p < end && is_blank(*p))
+            p++;
+        if (p == end)
+            break;
+        if (*p == ',')                      /* empty list element */
+            continue;
+        if (p < end && *p == '-') {         /* suffix: the last n */
+            p++;
+            if ((last = number(&p, end)) == -1)
+                return RANGE_NONE;
+            first = (last >= size) ? 0 : size - last;
+            last = size - 1;
+            if (last < first)               /* -0, or an empty file */
+                first = size;
+        } else {
+            if ((first = number(&p, end)) == -1 || p == end || *p++ != '-')
+                return RANGE_NONE;
+            if (p < end && *p >= '0' && *p <= '9') {
+                if ((last = number(&p, end)) == -1 || last < first)
+                    return RANGE_NONE;
+            } else
+                last = size - 1;
+            if (last > size - 1)
+                last = size - 1;
+        }
+        while (p < end && is_blank(*p))
+            p++;
+        if (p < end && *p != ',')
+            return RANGE_NONE;
+        if (++seen > max)
+            return RANGE_NONE;
+        if (first < size) {
+            r[n].first = first;
+            r[n].last = last;
+            n++;
+        }
+    }
+    return (n > 0) ? n : (seen > 0 ? RANGE_UNSAT : RANGE_NONE);
+}
@@ -0,0 +1,26 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include    <sys/types.h>
+#include    "request.h"
+
+/*
+ * range.h - the Range header of a request for a file
+ *
+ *  range_parse(hdr, size, r, max)  the byte ranges hdr asks for
+ */
+
+#define RANGE_MAX   16          /* more than this and we send it all */
+
+/* range_parse results besides a count of ranges */
+#define RANGE_NONE  0           /* no usable header: send the file   */
+#define RANGE_UNSAT -1          /* none of the ranges is in the file */
+
+typedef struct byterange {
+    off_t   first;              /* both inclusive, as in the header */
+    off_t   last;
+} byterange;
+
+int     range_parse(slice* hdr, off_t size, byterange* r, int max);
+
+#endif
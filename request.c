@@ -0,0 +1,284 @@
+#include    <string.h>
+#include    <strings.h>
+#include    "request.h"
+
+/*
+ * request.c - a single pass, no copy parser for request heads
+ *
+ * the request is taken a line at a time as lines complete in the
+ * connection's input buffer.  the first line is split into method,
+ * target and version, the rest into header names and values, and
+ * each part is recorded as a pointer into the buffer and a length.
+ * a line that is not all in yet is left for the next call, which
+ * scans only the bytes that came in since.
+ *
+ * lines may end in \r\n or a bare \n.  empty lines ahead of the
+ * request line are skipped, as RFC 9112 allows.
+ *
+ * the body of a request is never read, but where it ends must be
+ * known, or it would be taken for the next request on the connection
+ * (request smuggling).  so Content-Length and Transfer-Encoding are
+ * looked at even past RQ_MAXHEADERS, and a request that has both, or
+ * a length that is not a number, or two different lengths, is bad.
+ * a request with a body is answered and its connection closed (see
+ * wants_keepalive in wsng.c).
+ */
+
+
+void rq_init(request* rq)
+{
+    memset(rq, 0, sizeof(request));
+}
+
+
+static int is_blank(char ch)
+{
+    return ch == ' ' || ch == '\t';
+}
+
+
+/*
+ * method SP target [SP version]
+ *    rets: 0, or -1 if the line is not a request line
+ */
+static int request_line(request* rq, char* p, char* end)
+{
+    rq->method.ptr = p;
+    while (p < end && !is_blank(*p))
+        p++;
+    rq->method.len = p - rq->method.ptr;
+    while (p < end && is_blank(*p))
+        p++;
+
+    rq->target.ptr = p;
+    while (p < end && !is_blank(*p))
+        p++;
+    rq->target.len = p - rq->target.ptr;
+    while (p < end && is_blank(*p))
+        p++;
+
+    rq->version.ptr = p;
+    while (end > p && is_blank(end[-1]))
+        end--;
+    rq->version.len = end - p;
+
+    if (rq->method.len == 0 || rq->target.len == 0)
+        return -1;
+    if (rq->version.len > 0) {
+        if (rq->version.len != 8 || strncmp(p, "HTTP/", 5) != 0
+                || p[5] != '1' || p[6] != '.')
+            return -1;
+        rq->minor = (p[7] != '0');
+    }
+
+    rq->path = rq->target;
+    p = memchr(rq->target.ptr, '?', rq->target.len);
+    if (p != NULL) {
+        rq->path.len = p - rq->target.ptr;
+        rq->query.ptr = p + 1;
+        rq->query.len = rq->target.len - rq->path.len - 1;
+    }
+    return 0;
+}
+
+
+/*
+ * body_header -- note what a header says about a body
+ *    rets: 0, or -1 if the request's end can no longer be told
+ */
+static int body_header(request* rq, slice* name, slice* value)
+{
+    long long n = 0;
+    int i;
+
+    if (slice_is_nocase(name, "Transfer-Encoding")) {
+        rq->framing |= RQ_CODED;
+        rq->bodylen = -1;
+    } else if (slice_is_nocase(name, "Content-Length")) {
+        if (value->len == 0 || value->len > 15)
+            return -1;
+        for (i = 0; i < value->len; i++) {
+            if (value->ptr[i] < '0' || value->ptr[i] > '9')
+                return -1;
+            n = n * 10 + value->ptr[i] - '0';
+        }
+        if ((rq->framing & RQ_LENGTH) && n != rq->bodylen)
+            return -1;
+        rq->framing |= RQ_LENGTH;
+        rq->bodylen = n;
+    } else
+        return 0;
+    return rq->framing == (RQ_LENGTH | RQ_CODED) ? -1 : 0;
+}
+
+
+/*
+ * name: value.  lines without a colon, and continuation lines
+ * (obsolete folding), are skipped
+ *    rets: 0, or -1 if the header makes the request bad
+ */
+static int header_line(request* rq, char* p, char* end)
+{
+    slice name, value;
+    char* colon;
+
+    if (is_blank(*p) || (colon = memchr(p, ':', end - p)) == NULL)
+        return 0;
+    name.ptr = p;
+    name.len = colon - p;
+    for (p = colon + 1; p < end && is_blank(*p); p++)
+        ;
+    while (end > p && is_blank(end[-1]))
+        end--;
+    value.ptr = p;
+    value.len = end - p;
+    if (body_header(rq, &name, &value) == -1)
+        return -1;
+    if (rq->nheaders < RQ_MAXHEADERS) {
+        rq->headers[rq->nheaders].name = name;
+        rq->headers[rq->nheaders++].value = value;
+    }
+    return 0;
+}
+
+
+/*
+ * rq_parse -- carry on parsing the request at the start of buf
+ *    args: len bytes have arrived; room is how many more may
+ *    rets: RQ_MORE, RQ_DONE, RQ_BAD or RQ_TOOBIG, also left in
+ *          rq->result
+ *    note: a request whose head does not end before room runs out
+ *          is RQ_TOOBIG
+ */
+int rq_parse(request* rq, char* buf, int len, int room)
+{
+    char *p, *nl, *end;
+
+    if (rq->result != RQ_MORE)
+        return rq->result;
+    while ((nl = memchr(buf + rq->scanned, '\n', len - rq->scanned)) != NULL) {
+        p = buf + rq->line;
+        end = (nl > p && nl[-1] == '\r') ? nl - 1 : nl;
+        rq->line = rq->scanned = nl - buf + 1;
+
+        if (rq->method.ptr == NULL) {
+            if (end == p)
+                continue;
+            if (request_line(rq, p, end) == -1)
+                return rq->result = RQ_BAD;
+        } else if (end == p) {
+            rq->length = rq->line;
+            return rq->result = RQ_DONE;
+        } else if (header_line(rq, p, end) == -1)
+            return rq->result = RQ_BAD;
+    }
+    rq->scanned = len;
+    if (room == 0)
+        rq->result = RQ_TOOBIG;
+    return rq->result;
+}
+
+
+static void move_slice(slice* s, char* from, char* to)
+{
+    if (s->ptr != NULL)
+        s->ptr = to + (s->ptr - from);
+}
+
+
+/*
+ * rq_move -- the buffer the request lies in has been copied from
+ *            from to to; point the slices into the copy
+ *    note: call it while from is still allocated
+ */
+void rq_move(request* rq, char* from, char* to)
+{
+    int i;
+
+    move_slice(&rq->method, from, to);
+    move_slice(&rq->target, from, to);
+    move_slice(&rq->path, from, to);
+    move_slice(&rq->query, from, to);
+    move_slice(&rq->version, from, to);
+    for (i = 0; i < rq->nheaders; i++) {
+        move_slice(&rq->headers[i].name, from, to);
+        move_slice(&rq->headers[i].value, from, to);
+    }
+}
+
+
+int slice_is(slice* s, char* str)
+{
+    return s->len == (int) strlen(str) && strncmp(s->ptr, str, s->len) == 0;
+}
+
+
+int slice_is_nocase(slice* s, char* str)
+{
+    return s->len == (int) strlen(str) && strncasecmp(s->ptr, str, s->len) == 0;
+}
+
+
+/*
+ * rq_header -- the value of header name (any case), or NULL
+ */
+slice* rq_header(request* rq, char* name)
+{
+    int i;
+
+    for (i = 0; i < rq->nheaders; i++)
+        if (slice_is_nocase(&rq->headers[i].name, name))
+            return &rq->headers[i].value;
+    return NULL;
+}
+
+
+/*
+ * rq_path -- the path part of the target, as a file name
+ *    rets: the name, NUL terminated in place in the buffer
+ *    note: drops the leading slash and every empty, "." and ".."
+ *          component, so the name stays under the server root;
+ *          "/" becomes "."
+ */
+char* rq_path(request* rq)
+{
+    char* src = rq->path.ptr;
+    char* stop = src + rq->path.len;
+    char* dst = rq->path.ptr;
+    char* seg;
+    int n;
+
+    if (rq->path.len == 0)              /* "?x": nowhere to write */
+        return ".";
+    while (src < stop) {
+        for (seg = src; src < stop && *src != '/'; src++)
+            ;
+        n = src - seg;
+        if (src < stop)
+            src++;                      /* past the slash */
+        if (n == 0 || (n == 1 && seg[0] == '.')
+                || (n == 2 && seg[0] == '.' && seg[1] == '.'))
+            continue;
+        if (dst != rq->path.ptr)
+            *dst++ = '/';
+        memmove(dst, seg, n);
+        dst += n;
+    }
+    if (dst == rq->path.ptr)
+        *dst++ = '.';
+    *dst = '\0';                        /* over the '?' or the blank */
+    rq->path.len = dst - rq->path.ptr;
+    return rq->path.ptr;
+}
+
+
+/*
+ * rq_query -- the query string, NUL terminated in place, or NULL
+ */
+char* rq_query(request* rq)
+{
+    if (rq->query.ptr == NULL)
+        return NULL;
+    rq->query.ptr[rq->query.len] = '\0';
+    return rq->query.ptr;
+}
@@ -0,0 +1,69 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+/*
+ * request.h - an HTTP request, parsed where it lies in the read buffer
+ *
+ *  rq_init(rq)                 forget the last request
+ *  rq_parse(rq, buf, len, room) look at what has arrived so far
+ *  rq_move(rq, from, to)       the buffer was copied from from to to
+ *  rq_header(rq, name)         a header's value, or NULL
+ *  rq_path(rq)                 the target as a file name
+ *  rq_query(rq)                the query string, or NULL
+ *
+ * the parts of the request are slices of the buffer, not copies, so
+ * the buffer must stay put until the request has been answered, or
+ * the slices be moved with it by rq_move.
+ * rq_parse may be called again each time more bytes come in; it
+ * carries on from the line it had not seen the end of.
+ */
+
+#define RQ_MAXHEADERS   32      /* later ones are ignored */
+
+/* rq_parse results */
+#define RQ_MORE     0           /* no blank line yet */
+#define RQ_DONE     1           /* request complete, rq->length bytes */
+#define RQ_BAD      2           /* cannot be answered; drop the rest */
+#define RQ_TOOBIG   3           /* the head would not fit in room    */
+
+/* framing bits: the headers that say a body follows the head */
+#define RQ_LENGTH   1           /* Content-Length */
+#define RQ_CODED    2           /* Transfer-Encoding */
+
+typedef struct slice {
+    char*   ptr;                /* not NUL terminated */
+    int     len;
+} slice;
+
+typedef struct rq_field {
+    slice   name;
+    slice   value;              /* without surrounding blanks */
+} rq_field;
+
+typedef struct request {
+    int     result;             /* RQ_ value of the last rq_parse   */
+    int     line;               /* offset of the line being read    */
+    int     scanned;            /* bytes of it already looked at    */
+    int     length;             /* whole request, when RQ_DONE      */
+    slice   method;
+    slice   target;             /* path and query as sent           */
+    slice   path;
+    slice   query;              /* ptr NULL if there was no '?'     */
+    slice   version;            /* empty for an HTTP/0.9 line       */
+    int     minor;              /* 1 for HTTP/1.1 and up, else 0    */
+    int     nheaders;
+    rq_field headers[RQ_MAXHEADERS];
+    int     framing;            /* RQ_ bits: body headers seen      */
+    long long bodylen;          /* Content-Length; -1 for chunks    */
+} request;
+
+void    rq_init(request* rq);
+int     rq_parse(request* rq, char* buf, int len, int room);
+void    rq_move(request* rq, char* from, char* to);
+slice*  rq_header(request* rq, char* name);
+char*   rq_path(request* rq);
+char*   rq_query(request* rq);
+int     slice_is(slice* s, char* str);
+int     slice_is_nocase(slice* s, char* str);
+
+#endif
@@ -0,0 +1,116 @@
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+#include    "shed.h"
+#include    "stats.h"
+#include    "wsng.h"
+
+/*
+ * shed.c - admission control
+ *
+ * three things say the server is behind, each with a limit in
+ * wsng.conf (0 turns it off):
+ *
+ *  shed_active     connections open in all processes, idle kept-alive
+ *                  ones included; in fork mode each is a process
+ *  shed_queue      calls in the kernel's accept queue of the
+ *                  listening socket, from TCP_INFO
+ *  shed_target     the delay the event loop or the thread pool puts
+ *                  on work that is ready.  as in CoDel, one slow pass
+ *                  is a burst, not overload: the delay must stay
+ *                  above the target for a whole shed_interval
+ *
+ * the 503 carries Retry-After and closes the connection.  fork mode
+ * refuses a call in the parent, without reading the request, so an
+ * overloaded server stops forking; the loops answer the request,
+ * which lets cgi requests be told from the others and logs them.
+ *
+ * the numbers are read and written without locks; in threads mode a
+ * decision made on a value a moment old is as good as any.
+ */
+
+static char refusal[256];       /* the whole fork mode reply    */
+static int refusal_len;
+static int backlog;             /* accept queue, last looked at */
+static long long above_since;   /* delay over target since, or 0 */
+
+
+void shed_init(void)
+{
+    refusal_len = snprintf(refusal, sizeof(refusal),
+                           "HTTP/1.1 503 Service Unavailable\r\n"
+                           "Retry-After: %d\r\n"
+                           "Connection: close\r\n"
+                           "Content-type: text/plain\r\n"
+                           "Content-Length: %d\r\n\r\n%s", retry_after,
+                           (int) strlen(SHED_TEXT), SHED_TEXT);
+}
+
+
+void shed_delay(long long us)
+{
+    if (shed_target <= 0)
+        return;
+    if (us < shed_target * 1000LL)
+        __atomic_store_n(&above_since, 0, __ATOMIC_RELAXED);
+    else if (__atomic_load_n(&above_since, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&above_since, stats_now(), __ATOMIC_RELAXED);
+}
+
+
+void shed_backlog(int sock)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if (shed_queue > 0
+            && getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+        __atomic_store_n(&backlog, ti.tcpi_unacked, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * is value past limit, or half of it for a cgi request?
+ */
+static int over(long value, int limit, int cgi)
+{
+    return limit > 0 && value > (cgi ? limit / 2 : limit);
+}
+
+
+int shed_check(int cgi)
+{
+    long long since = __atomic_load_n(&above_since, __ATOMIC_RELAXED);
+    int cause = 0;
+
+    if (over(stats_active(), shed_active, cgi))
+        cause = SHED_ACTIVE;
+    else if (over(__atomic_load_n(&backlog, __ATOMIC_RELAXED), shed_queue, cgi))
+        cause = SHED_QUEUE;
+    else if (since != 0
+             && stats_now() - since >= (cgi ? 1 : 2) * shed_interval * 1000LL)
+        cause = SHED_DELAY;
+    if (cause)
+        stats_shed(cause, cgi);
+    return cause;
+}
+
+
+/*
+ * shed_refuse -- the reply fits in any socket buffer, so one send
+ *    note: the request, if it is in yet, is read first; closing a
+ *          socket with unread data resets it, and the reset can
+ *          beat the 503 to the client
+ */
+void shed_refuse(int fd)
+{
+    char buf[4096];
+
+    recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    send(fd, refusal, refusal_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    close(fd);
+}
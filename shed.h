@@ -0,0 +1,37 @@
+#ifndef SHED_H
+#define SHED_H
+
+/*
+ * shed.h - turn requests away with a quick 503 while the server is
+ *          behind, so the ones it does take are still answered fast
+ *
+ *  shed_init()             build the fork mode 503; after the config
+ *  shed_delay(us)          work waited this long for the loop or a
+ *                          thread to pick it up
+ *  shed_backlog(sock)      look at the accept queue of sock
+ *  shed_check(cgi)         should a request, for a cgi program or
+ *                          not, be turned away?  rets 0, or the
+ *                          SHED_ cause; the counters are bumped
+ *  shed_refuse(fd)         fork mode: answer a call just accepted
+ *                          with the 503 and close it, no child made
+ *
+ * a cgi request is turned away at half of each limit, and after one
+ * shed_interval of delay over shed_target rather than two, so cgi
+ * programs go first.
+ */
+
+/* why a request was turned away */
+#define SHED_ACTIVE 1           /* too many connections open    */
+#define SHED_QUEUE  2           /* accept queue too long        */
+#define SHED_DELAY  3           /* work waiting too long        */
+#define SHED_NCAUSES 4
+
+#define SHED_TEXT   "The server is busy; please try again shortly\r\n"
+
+void    shed_init(void);
+void    shed_delay(long long us);
+void    shed_backlog(int sock);
+int     shed_check(int cgi);
+void    shed_refuse(int fd);
+
+#endif
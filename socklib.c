@@ -16,16 +16,71 @@
  *	make_server_socket( portnum )	returns a server socket
  *					or -1 if error
  *
+ *	make_shared_server_socket( portnum )
+ *					same, but with SO_REUSEPORT so
+ *					several processes can each have
+ *					a socket on the port
+ *
+ *	make_listening_socket( portnum, backlog, reuseport )
+ *					either of those, with the length
+ *					of the queue of calls not yet
+ *					accepted chosen by the caller
+ *
+ *	make_bound_socket( portnum, reuseport )
+ *					the same but not yet listening,
+ *					for options that must be set
+ *					before listen
+ *
  *	connect_to_server(char *hostname, int portnum)
  *					returns a connected socket
  *					or -1 if error
  *
+ *	make_server_address(hostname, portnum, &addr)
+ *	connect_to_address(&addr)	the same in two steps, so the
+ *					name is looked up only once
+ *
+ *	history: 2026-10-17 split make_bound_socket out of
+ *			    make_listening_socket
+ *	history: 2026-10-17 backlog was 1; now SOMAXCONN or the caller's
  *	history: 2010-04-16 replaced bcopy/bzero with memcpy/memset
  *	history: 2005-05-09 added SO_REUSEADDR to make_server_socket
  */ 
 
+int make_listening_socket( int, int, int );
+int make_bound_socket( int, int );
+int make_server_address( char *, int, struct sockaddr_in * );
+int connect_to_address( struct sockaddr_in * );
+
 int
 make_server_socket( int portnum )
+{
+	return make_listening_socket( portnum, SOMAXCONN, 0 );
+}
+
+int
+make_shared_server_socket( int portnum )
+{
+	return make_listening_socket( portnum, SOMAXCONN, 1 );
+}
+
+int
+make_listening_socket( int portnum, int backlog, int reuseport )
+{
+	int	sock_id = make_bound_socket( portnum, reuseport );
+
+	if ( sock_id == -1 ) return -1;
+
+	/*
+	 *      step 3: tell kernel we want to listen for calls; calls
+	 *              beyond backlog waiting to be accepted are
+	 *              dropped, and the client retries seconds later
+	 */
+	if ( listen(sock_id, backlog) != 0 ) return -1;
+	return sock_id;
+}
+
+int
+make_bound_socket( int portnum, int reuseport )
 {
         struct  sockaddr_in   saddr;   /* build our address here */
 	int	sock_id;	       /* line id, file desc     */
@@ -51,13 +106,11 @@ make_server_socket( int portnum )
 	if ( sock_id == -1 ) return -1;
 	if ( setsockopt(sock_id,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on)) == -1 )
 		return -1;
+	if ( reuseport &&
+	     setsockopt(sock_id,SOL_SOCKET,SO_REUSEPORT,&on,sizeof(on)) == -1 )
+		return -1;
 	if ( bind(sock_id,(struct sockaddr*)&saddr, sizeof(saddr)) ==  -1 )
 	       return -1;
-
-	/*
-	 *      step 3: tell kernel we want to listen for calls
-	 */
-	if ( listen(sock_id, 1) != 0 ) return -1;
 	return sock_id;
 }
 
@@ -66,20 +119,40 @@ int
 connect_to_server( char *hostname, int portnum )
 {
 	struct sockaddr_in  servadd;        /* the number to call */
+
+	if ( make_server_address(hostname, portnum, &servadd) == -1 )
+		return -1;
+	return connect_to_address( &servadd );
+}
+
+/*
+ *	make_server_address: look hostname up once, for programs that
+ *	call the same server many times (and from several threads,
+ *	which gethostbyname does not allow)
+ */
+int
+make_server_address( char *hostname, int portnum, struct sockaddr_in *addrp )
+{
 	struct hostent      *hp;            /* used to get number */
-	int    sock_id;			    /* returned to caller */
 
         /*
          *  build the network address of where we want to call
          */
 
-       memset( &servadd, 0, sizeof( servadd ) );   /* 0. zero the address   */
-       servadd.sin_family = AF_INET ;              /* 1. fill in addr type  */
+       memset( addrp, 0, sizeof( *addrp ) );       /* 0. zero the address   */
+       addrp->sin_family = AF_INET ;               /* 1. fill in addr type  */
 
        hp = gethostbyname( hostname );		   /* 2. and host addr      */
        if ( hp == NULL ) return -1;
-       memcpy( &servadd.sin_addr, hp->h_addr, hp->h_length);
-       servadd.sin_port = htons(portnum);          /* 3. and port number    */
+       memcpy( &addrp->sin_addr, hp->h_addr, hp->h_length);
+       addrp->sin_port = htons(portnum);           /* 3. and port number    */
+       return 0;
+}
+
+int
+connect_to_address( struct sockaddr_in *addrp )
+{
+	int    sock_id;			    /* returned to caller */
 
        /*
         *        make the connection
@@ -88,7 +161,9 @@ connect_to_server( char *hostname, int portnum )
        sock_id = socket( PF_INET, SOCK_STREAM, 0 );    /* get a line   */
        if ( sock_id == -1 ) return -1;                 /* or fail      */
                                                        /* now dial     */
-       if ( connect(sock_id,(struct sockaddr*)&servadd, sizeof(servadd)) !=0 )  
+       if ( connect(sock_id,(struct sockaddr*)addrp, sizeof(*addrp)) !=0 ) {
+               close(sock_id);
                return -1;
+       }
        return sock_id;
 }
@@ -7,10 +7,34 @@
  *	make_server_socket( portnum )	returns a server socket
  *					or -1 if error
  *
+ *	make_shared_server_socket( portnum )
+ *					same, with SO_REUSEPORT set
+ *
+ *	make_listening_socket( portnum, backlog, reuseport )
+ *					either, with the listen backlog
+ *					given
+ *
+ *	make_bound_socket( portnum, reuseport )
+ *					bound but not listening; the
+ *					caller calls listen
+ *
  *	connect_to_server(char *hostname, int portnum)
  *					returns a connected socket
  *					or -1 if error
+ *
+ *	make_server_address(hostname, portnum, &addr)
+ *					fills in addr, returns 0 or -1
+ *
+ *	connect_to_address(&addr)	returns a connected socket
+ *					or -1 if error
  */ 
 
+struct sockaddr_in;
+
 int make_server_socket( int );
+int make_shared_server_socket( int );
+int make_listening_socket( int, int, int );
+int make_bound_socket( int, int );
 int connect_to_server( char *, int );
+int make_server_address( char *, int, struct sockaddr_in * );
+int connect_to_address( struct sockaddr_in * );
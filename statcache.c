@@ -0,0 +1,321 @@
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <pthread.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/resource.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+#include    "dirwatch.h"
+#include    "statcache.h"
+#include    "web-time.h"
+#include    "wheel.h"
+
+/*
+ * statcache.c - stat, access and open results by path
+ *
+ * process_rq asks whether a path exists, whether it may be read and
+ * whether it is a directory, and do_cat then opens it.  done from
+ * scratch that is three or four walks of the same path per request.
+ * here the answers, and an open descriptor for regular files, are
+ * kept in a hash table keyed by the path process_rq uses.
+ *
+ * an entry is good for ttl seconds.  sooner than that, inotify tells
+ * us about changes: each directory that holds a cached path gets a
+ * watch (see dirwatch.c), and any event naming a file drops that
+ * file's entry.
+ *
+ * for a regular file the entry also holds the ETag and Last-Modified
+ * values, so they are formatted once per load and not per request.
+ *
+ * entries are reference counted because a connection may still be
+ * sending from an entry's descriptor when the entry is dropped; the
+ * descriptor is closed when the last holder lets go.
+ *
+ * since every cached file holds a descriptor, the table is kept to
+ * half of RLIMIT_NOFILE, leaving the rest for connections, cgi pipes
+ * and the log.  a full process limit would make accept fail with
+ * EMFILE, and the edge triggered listener would stop taking clients.
+ *
+ * the table is shared by the threads of the threads mode, so it is
+ * locked; a miss is loaded without the lock, so a slow stat holds
+ * up only the thread that asked.
+ */
+
+#define NBUCKETS    1024            /* power of two */
+#define MAXENTRIES  4096            /* evict the least recently used */
+#define MINENTRIES  16              /* whatever the fd limit */
+
+static int          maxentries = MAXENTRIES;
+static int          enabled;
+static int          ttl;
+static stat_entry*  buckets[NBUCKETS];
+static stat_entry*  oldest;         /* lru list */
+static stat_entry*  newest;
+static int          nentries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void changed(char* dir, char* name);
+
+
+static unsigned hash(char* s)
+{
+    unsigned h = 2166136261u;
+
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ * statcache_init -- start caching in this process
+ *    rets: the inotify descriptor to poll for dirwatch_events,
+ *          or -1 if there is none and only the ttl applies
+ *    note: ttl 0 leaves the cache off
+ */
+int statcache_init(int secs)
+{
+    struct rlimit rl;
+
+    ttl = secs;
+    enabled = (ttl > 0);
+    if (!enabled)
+        return -1;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur / 2 < MAXENTRIES)
+        maxentries = rl.rlim_cur / 2 > MINENTRIES ? rl.rlim_cur / 2
+                                                  : MINENTRIES;
+    dirwatch_subscribe(changed);
+    return dirwatch_init();
+}
+
+
+static stat_entry* load(char* path)
+{
+    stat_entry* e = calloc(1, sizeof(stat_entry));
+
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+        perror("statcache");
+        exit(1);
+    }
+    e->fd = -1;
+    e->refs = 1;
+    e->loaded = wheel_now();
+    if (stat(path, &e->info) == -1) {
+        e->exists = (errno != ENOENT);
+        return e;
+    }
+    e->exists = 1;
+    if (S_ISREG(e->info.st_mode)) {
+        e->fd = open(path, O_RDONLY | O_CLOEXEC);
+        e->readable = (e->fd != -1);
+        snprintf(e->etag, sizeof(e->etag), "\"%lx-%llx-%lx\"",
+                 (unsigned long) e->info.st_ino,
+                 (unsigned long long) e->info.st_size,
+                 (unsigned long) e->info.st_mtime);
+        rfc822_time(e->info.st_mtime, e->lastmod);
+    } else
+        e->readable = (access(path, R_OK) == 0);
+    return e;
+}
+
+
+static void release(stat_entry* e)
+{
+    if (--e->refs > 0)
+        return;
+    if (e->fd != -1)
+        close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+
+/*
+ * take e out of the table; holders keep it until they put it
+ */
+static void unlink_entry(stat_entry* e)
+{
+    stat_entry** pp = &buckets[hash(e->path) & (NBUCKETS - 1)];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+
+    e->cached = 0;
+    nentries--;
+    release(e);
+}
+
+
+static void flush_all()
+{
+    while (oldest != NULL)
+        unlink_entry(oldest);
+}
+
+
+/*
+ * the directory holding path, as dirwatch knows it
+ */
+static char* dir_of(char* path, char* dir, int len)
+{
+    char* slash = strrchr(path, '/');
+
+    if (slash == NULL)
+        snprintf(dir, len, ".");
+    else
+        snprintf(dir, len, "%.*s", (int)(slash - path), path);
+    return dir;
+}
+
+
+static void insert(stat_entry* e)
+{
+    stat_entry** bp = &buckets[hash(e->path) & (NBUCKETS - 1)];
+    char dir[PATH_MAX];
+
+    if (nentries >= maxentries)
+        unlink_entry(oldest);
+    e->hnext = *bp;
+    *bp = e;
+    e->older = newest;
+    e->newer = NULL;
+    if (newest != NULL)
+        newest->newer = e;
+    else
+        oldest = e;
+    newest = e;
+    e->cached = 1;
+    e->refs++;                      /* the table's reference */
+    nentries++;
+    dirwatch_add(dir_of(e->path, dir, sizeof(dir)));
+}
+
+
+/*
+ * the cached entry for path, if it is fresh; moved to the new end
+ * of the lru
+ */
+static stat_entry* find(char* path)
+{
+    stat_entry* e;
+
+    for (e = buckets[hash(path) & (NBUCKETS - 1)]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, path) == 0)
+            break;
+    if (e != NULL && wheel_now() - e->loaded >= ttl) {
+        unlink_entry(e);
+        return NULL;
+    }
+    if (e != NULL && e != newest) {
+        if (e->older != NULL)
+            e->older->newer = e->newer;
+        else
+            oldest = e->newer;
+        e->newer->older = e->older;
+        e->older = newest;
+        e->newer = NULL;
+        newest->newer = e;
+        newest = e;
+    }
+    return e;
+}
+
+
+/*
+ * statcache_get -- the entry for path, loading it on a miss
+ *    rets: an entry the caller must hand back with statcache_put
+ */
+stat_entry* statcache_get(char* path)
+{
+    stat_entry *e, *fresh;
+
+    if (!enabled)
+        return load(path);
+
+    pthread_mutex_lock(&lock);
+    if ((e = find(path)) == NULL) {
+        pthread_mutex_unlock(&lock);
+        fresh = load(path);
+        pthread_mutex_lock(&lock);
+        if ((e = find(path)) == NULL) {
+            insert(fresh);          /* fresh's own reference is ours */
+            pthread_mutex_unlock(&lock);
+            return fresh;
+        }
+        release(fresh);             /* another thread was quicker */
+    }
+    e->refs++;
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+
+/*
+ * statcache_hold -- another reference to e, for a holder that keeps
+ *                   it after the one that looked it up lets go
+ */
+stat_entry* statcache_hold(stat_entry* e)
+{
+    pthread_mutex_lock(&lock);
+    e->refs++;
+    pthread_mutex_unlock(&lock);
+    return e;
+}
+
+
+void statcache_put(stat_entry* e)
+{
+    pthread_mutex_lock(&lock);
+    release(e);
+    pthread_mutex_unlock(&lock);
+}
+
+
+static void invalidate(char* path)
+{
+    stat_entry* e;
+
+    for (e = buckets[hash(path) & (NBUCKETS - 1)]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, path) == 0) {
+            unlink_entry(e);
+            return;
+        }
+}
+
+
+/*
+ * dirwatch says dir/name changed; without a name, or a dir, it is
+ * not saying what, so start over
+ */
+static void changed(char* dir, char* name)
+{
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&lock);
+    if (dir == NULL || name == NULL)
+        flush_all();
+    else {
+        if (strcmp(dir, ".") == 0)
+            snprintf(path, sizeof(path), "%s", name);
+        else
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+        invalidate(path);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,43 @@
+#ifndef STATCACHE_H
+#define STATCACHE_H
+
+#include    <sys/stat.h>
+#include    <time.h>
+
+/*
+ * statcache.h - what the server knows about a path, kept for reuse
+ *
+ *  statcache_init(ttl)     turn the cache on in this process
+ *  statcache_get(path)     look up or load path; holds a reference
+ *  statcache_hold(e)       one more reference to e, for keeping it
+ *  statcache_put(e)        drop a reference from statcache_get or
+ *                          statcache_hold
+ *
+ * invalidations arrive through dirwatch_events().
+ *
+ * without statcache_init (fork mode) statcache_get still works but
+ * loads a fresh entry every time and statcache_put frees it.
+ */
+
+typedef struct stat_entry {
+    char*       path;           /* as process_rq names it           */
+    int         exists;         /* 0 if stat said ENOENT            */
+    int         readable;       /* 1 if we may read it              */
+    struct stat info;           /* valid when exists and readable   */
+    int         fd;             /* open on a regular file, or -1    */
+    char        etag[64];       /* validators for a regular file,   */
+    char        lastmod[36];    /*   made from the stat data        */
+    time_t      loaded;         /* when the entry was filled        */
+    int         refs;           /* holders, the table counts as one */
+    int         cached;         /* still in the table               */
+    struct stat_entry* hnext;   /* hash chain                       */
+    struct stat_entry* newer;   /* lru list, oldest at the head     */
+    struct stat_entry* older;
+} stat_entry;
+
+int         statcache_init(int ttl);
+stat_entry* statcache_get(char* path);
+stat_entry* statcache_hold(stat_entry* e);
+void        statcache_put(stat_entry* e);
+
+#endif
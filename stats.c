@@ -0,0 +1,346 @@
+#include    <pthread.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/mman.h>
+#include    <time.h>
+#include    "filecache.h"
+#include    "listener.h"
+#include    "shed.h"
+#include    "stats.h"
+
+/*
+ * stats.c - what the server has done, for /server-status
+ *
+ * the counters live in one MAP_SHARED region made before the server
+ * forks, so every process sees all of it.  the region is cut into
+ * slots; each prefork worker writes to a slot of its own, and the
+ * report adds the slots up.  in fork mode the connection children
+ * share slot 0, so updates are atomic adds; nothing ever takes a
+ * lock, and a reader may see a reply counted in one histogram and
+ * not yet in the next, which a report can live with.
+ *
+ * latencies go into HDR-style histograms: values below 2^SUB_BITS
+ * microseconds get a bucket each, and above that every power of two
+ * is split into 2^SUB_BITS buckets, so a percentile read back is
+ * within 1/8 of the true value from a microsecond to an hour.  each
+ * handler has one histogram per phase:
+ *
+ *      accept-parse    connection accepted to request parsed
+ *      read-parse      first byte of the request in to request parsed
+ *      parse-first     request parsed to first byte of reply written
+ *      total           first byte in to last byte written
+ *
+ * the clock starts at the request's first byte, not at accept, so an
+ * idle client before its first request does not count against us.
+ * accept-parse covers only the first request on each connection, the
+ * one place that idle time and the trip to the first byte show up.
+ */
+
+#define SUB_BITS    3
+#define SUB         (1 << SUB_BITS)
+#define NBUCKETS    ((33 - SUB_BITS) * SUB)     /* up to 2^32 us */
+
+#define PH_ACCEPT   0
+#define PH_PARSE    1
+#define PH_FIRST    2
+#define PH_TOTAL    3
+#define NPHASES     4
+
+typedef struct slot {
+    unsigned long   requests[ST_NHANDLERS];
+    unsigned long   hist[ST_NHANDLERS][NPHASES][NBUCKETS];
+    unsigned long   accepted;
+    long            active;
+    unsigned long   bytes;
+    unsigned long   log_dropped;
+    unsigned long   shed[SHED_NCAUSES];     /* by cause; 0 unused */
+    unsigned long   shed_cgi;               /* of those, cgi      */
+} slot;
+
+static char* handler_names[ST_NHANDLERS] = {
+    "cat", "ls", "exec", "status", "400", "404", "500", "501", "503"
+};
+static char* shed_names[SHED_NCAUSES] = { "", "active", "queue", "delay" };
+static char* phase_names[NPHASES] = {
+    "accept-parse", "read-parse", "parse-first", "total"
+};
+
+static slot*    slots;
+static int      nslots;
+static slot*    mine;           /* NULL: stats_init was not called */
+static time_t   started;
+
+#define ADD(var, n)     __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+
+
+/*
+ * stats_init -- map room for n slots, zeroed, shared with children
+ */
+void stats_init(int n)
+{
+    nslots = n < 1 ? 1 : n;
+    slots = mmap(NULL, nslots * sizeof(slot), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("stats_init");
+        slots = NULL;
+        return;
+    }
+    mine = &slots[0];
+    started = time(NULL);
+}
+
+
+/*
+ * stats_slot -- a new process (a prefork worker) takes slot n
+ *    note: its active count starts over; a worker that died left
+ *          its connections behind
+ */
+void stats_slot(int n)
+{
+    if (slots == NULL)
+        return;
+    mine = &slots[n % nslots];
+    __atomic_store_n(&mine->active, 0, __ATOMIC_RELAXED);
+}
+
+
+long long stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+void stats_conn(int delta)
+{
+    if (mine == NULL)
+        return;
+    if (delta > 0)
+        ADD(mine->accepted, 1);
+    ADD(mine->active, delta);
+}
+
+
+void stats_sent(long bytes)
+{
+    if (mine != NULL && bytes > 0)
+        ADD(mine->bytes, bytes);
+}
+
+
+void stats_log_dropped(unsigned long n)
+{
+    if (mine != NULL)
+        ADD(mine->log_dropped, n);
+}
+
+
+void stats_shed(int cause, int cgi)
+{
+    if (mine == NULL)
+        return;
+    ADD(mine->shed[cause], 1);
+    if (cgi)
+        ADD(mine->shed_cgi, 1);
+}
+
+
+/*
+ * stats_active -- for shed.c, which asks on every request; the sum
+ *                 is over a slot per worker, a handful
+ */
+long stats_active(void)
+{
+    long n = 0;
+    int i;
+
+    for (i = 0; slots != NULL && i < nslots; i++)
+        n += __atomic_load_n(&slots[i].active, __ATOMIC_RELAXED);
+    return n;
+}
+
+
+static int bucket(long long us)
+{
+    int e, b;
+
+    if (us < SUB)
+        return us < 0 ? 0 : us;
+    e = 63 - __builtin_clzll(us);
+    b = (e - SUB_BITS + 1) * SUB + ((us >> (e - SUB_BITS)) & (SUB - 1));
+    return b < NBUCKETS ? b : NBUCKETS - 1;
+}
+
+
+/*
+ * the largest value that lands in bucket b
+ */
+static long long bucket_top(int b)
+{
+    int e;
+
+    if (b < SUB)
+        return b;
+    e = b / SUB + SUB_BITS - 1;
+    return ((long long) (SUB + b % SUB + 1) << (e - SUB_BITS)) - 1;
+}
+
+
+/*
+ * stats_done -- n replies have left; first is when the first byte of
+ * the first of them was written
+ */
+void stats_done(stats_rec* recs, int n, long long first)
+{
+    long long now;
+    int i;
+
+    if (mine == NULL || n == 0)
+        return;
+    now = stats_now();
+    if (first == 0)
+        first = now;
+    for (i = 0; i < n; i++) {
+        unsigned long (*h)[NBUCKETS] = mine->hist[recs[i].handler];
+
+        ADD(mine->requests[recs[i].handler], 1);
+        if (recs[i].accepted != 0)
+            ADD(h[PH_ACCEPT][bucket(recs[i].parsed - recs[i].accepted)], 1);
+        ADD(h[PH_PARSE][bucket(recs[i].parsed - recs[i].begin)], 1);
+        ADD(h[PH_FIRST][bucket(first - recs[i].parsed)], 1);
+        ADD(h[PH_TOTAL][bucket(now - recs[i].begin)], 1);
+    }
+}
+
+
+/*
+ * percentile -- q (of 1000) of the values in counts
+ */
+static long long percentile(unsigned long* counts, int q)
+{
+    unsigned long n = 0, want, seen = 0;
+    int b;
+
+    for (b = 0; b < NBUCKETS; b++)
+        n += counts[b];
+    want = (n * q + 999) / 1000;
+    for (b = 0; b < NBUCKETS; b++)
+        if ((seen += counts[b]) >= want && seen > 0)
+            return bucket_top(b);
+    return 0;
+}
+
+
+/*
+ * stats_report -- the counters of every slot, added up, as text or
+ *                 as JSON; the file cache is this process's own,
+ *                 the listen queue counts are the whole host's
+ */
+void stats_report(FILE* fp, int json)
+{
+    static slot sum;                /* too big for the stack */
+    static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+    filecache_info fc;
+    listener_info lq;
+    unsigned long n;
+    unsigned long shed;
+    int i, h, p, b;
+
+    pthread_mutex_lock(&sum_lock);
+    memset(&sum, 0, sizeof(sum));
+    for (i = 0; slots != NULL && i < nslots; i++) {
+        sum.accepted += slots[i].accepted;
+        sum.active += slots[i].active;
+        sum.bytes += slots[i].bytes;
+        sum.log_dropped += slots[i].log_dropped;
+        for (b = 0; b < SHED_NCAUSES; b++)
+            sum.shed[b] += slots[i].shed[b];
+        sum.shed_cgi += slots[i].shed_cgi;
+        for (h = 0; h < ST_NHANDLERS; h++) {
+            sum.requests[h] += slots[i].requests[h];
+            for (p = 0; p < NPHASES; p++)
+                for (b = 0; b < NBUCKETS; b++)
+                    sum.hist[h][p][b] += slots[i].hist[h][p][b];
+        }
+    }
+    filecache_report(&fc);
+    listener_report(&lq);
+    for (shed = 0, b = 1; b < SHED_NCAUSES; b++)
+        shed += sum.shed[b];
+
+    if (json) {
+        fprintf(fp, "{\"uptime\": %ld, \"connections\": %lu, "
+                "\"active\": %ld, \"bytes_sent\": %lu, \"log_dropped\": %lu,"
+                "\n \"handlers\": {", (long) (time(NULL) - started),
+                sum.accepted, sum.active, sum.bytes, sum.log_dropped);
+        for (h = 0; h < ST_NHANDLERS; h++) {
+            n = sum.requests[h];
+            fprintf(fp, "%s\n  \"%s\": {\"requests\": %lu", h ? "," : "",
+                    handler_names[h], n);
+            for (p = 0; p < NPHASES; p++)
+                fprintf(fp, ", \"%s\": {\"p50\": %lld, \"p99\": %lld, "
+                        "\"p999\": %lld}", phase_names[p],
+                        percentile(sum.hist[h][p], 500),
+                        percentile(sum.hist[h][p], 990),
+                        percentile(sum.hist[h][p], 999));
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "},\n \"filecache\": {\"hits\": %lu, \"misses\": %lu, "
+                "\"evictions\": %lu, \"entries\": %lu, \"bytes\": %lu, "
+                "\"budget\": %lu}", fc.hits, fc.misses, fc.evictions,
+                fc.entries, (unsigned long) fc.bytes,
+                (unsigned long) fc.budget);
+        if (lq.known)
+            fprintf(fp, ",\n \"listen\": {\"overflows\": %lu, "
+                    "\"drops\": %lu, \"syn_drops\": %lu, "
+                    "\"syncookies\": %lu}", lq.overflows, lq.drops,
+                    lq.syn_drops, lq.cookies);
+        fprintf(fp, ",\n \"shed\": {\"requests\": %lu, \"cgi\": %lu", shed,
+                sum.shed_cgi);
+        for (b = 1; b < SHED_NCAUSES; b++)
+            fprintf(fp, ", \"%s\": %lu", shed_names[b], sum.shed[b]);
+        fprintf(fp, "}}\n");
+        pthread_mutex_unlock(&sum_lock);
+        return;
+    }
+
+    fprintf(fp, "uptime: %ld s\n", (long) (time(NULL) - started));
+    fprintf(fp, "connections: %lu accepted, %ld active\n",
+            sum.accepted, sum.active);
+    fprintf(fp, "bytes sent: %lu\n", sum.bytes);
+    fprintf(fp, "access log lines dropped: %lu\n\n", sum.log_dropped);
+    fprintf(fp, "%-8s %9s  %-12s %9s %9s %9s  (microseconds)\n",
+            "handler", "requests", "phase", "p50", "p99", "p999");
+    for (h = 0; h < ST_NHANDLERS; h++) {
+        if ((n = sum.requests[h]) == 0)
+            continue;
+        for (p = 0; p < NPHASES; p++) {
+            if (p == 0)
+                fprintf(fp, "%-8s %9lu  ", handler_names[h], n);
+            else
+                fprintf(fp, "%-8s %9s  ", "", "");
+            fprintf(fp, "%-12s %9lld %9lld %9lld\n", phase_names[p],
+                    percentile(sum.hist[h][p], 500),
+                    percentile(sum.hist[h][p], 990),
+                    percentile(sum.hist[h][p], 999));
+        }
+    }
+    fprintf(fp, "\nfile cache: %lu hits, %lu misses, %lu evictions, "
+            "%lu entries, %lu of %lu bytes\n", fc.hits, fc.misses,
+            fc.evictions, fc.entries, (unsigned long) fc.bytes,
+            (unsigned long) fc.budget);
+    fprintf(fp, "shed: %lu turned away, %lu of them cgi; by cause:", shed,
+            sum.shed_cgi);
+    for (b = 1; b < SHED_NCAUSES; b++)
+        fprintf(fp, " %s %lu", shed_names[b], sum.shed[b]);
+    fprintf(fp, "\n");
+    if (lq.known)
+        fprintf(fp, "listen queue: %lu overflows, %lu drops, %lu syn "
+                "drops, %lu syncookies\n", lq.overflows, lq.drops,
+                lq.syn_drops, lq.cookies);
+    pthread_mutex_unlock(&sum_lock);
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include    <stdio.h>
+
+/*
+ * stats.h - request counters and latency histograms for /server-status
+ *
+ *  stats_init(nslots)          map the shared counters; before forking
+ *  stats_slot(n)               this process writes to slot n from now on
+ *  stats_now()                 monotonic clock, in microseconds
+ *  stats_conn(delta)           a connection opened (+1) or closed (-1)
+ *  stats_sent(bytes)           bytes written to a client
+ *  stats_done(recs, n, first)  these replies are all out
+ *  stats_log_dropped(n)        access log lines lost to a full ring
+ *  stats_shed(cause, cgi)      a request turned away (see shed.c)
+ *  stats_active()              connections open, in all processes
+ *  stats_report(fp, json)      everything, summed over the slots
+ */
+
+/* what answered a request */
+#define ST_CAT      0           /* do_cat, a file               */
+#define ST_LS       1           /* do_ls, a listing or index    */
+#define ST_EXEC     2           /* a cgi program                */
+#define ST_STATUS   3           /* this report                  */
+#define ST_400      4           /* bad_request                  */
+#define ST_404      5           /* do_404                       */
+#define ST_500      6           /* do_500                       */
+#define ST_501      7           /* cannot_do                    */
+#define ST_503      8           /* do_503, load shed            */
+#define ST_NHANDLERS 9
+
+/* one reply, waiting for its bytes to leave */
+typedef struct stats_rec {
+    int         handler;        /* ST_ value                    */
+    long long   accepted;       /* accept, or 0 after the first */
+    long long   begin;          /* first byte of the request    */
+    long long   parsed;         /* request line and headers in  */
+} stats_rec;
+
+void        stats_init(int nslots);
+void        stats_slot(int n);
+long long   stats_now(void);
+void        stats_conn(int delta);
+void        stats_sent(long bytes);
+void        stats_done(stats_rec* recs, int n, long long first);
+void        stats_log_dropped(unsigned long n);
+void        stats_shed(int cause, int cgi);
+long        stats_active(void);
+void        stats_report(FILE* fp, int json);
+
+#endif
@@ -0,0 +1,383 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <pthread.h>
+#include    <signal.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/epoll.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+#include    "cgiexec.h"
+#include    "dirwatch.h"
+#include    "filecache.h"
+#include    "listener.h"
+#include    "lscache.h"
+#include    "shed.h"
+#include    "statcache.h"
+#include    "threaded.h"
+#include    "wsng.h"
+
+/*
+ * threaded.c - serve connections from a pool of threads
+ *
+ * the main thread accepts calls and keeps each connection that is
+ * waiting for its next request in an epoll set ("parked"), one-shot,
+ * so a wakeup hands the connection to exactly one thread.  a ready
+ * connection goes on the deque of a worker thread, which runs it the
+ * way a fork mode child would: conn_read, serve_pending, cgi_wait for
+ * a cgi program, send_reply, and on to the next request.  when the
+ * client has nothing more to say yet the connection is parked again.
+ *
+ * a worker takes the newest connection on its own deque, most likely
+ * one it served a moment ago.  a worker with an empty deque steals
+ * the oldest connection from another's, so a thread stuck in a big
+ * listing, a slow disk read or a slow client does not leave the
+ * connections queued behind it waiting while other cores are idle.
+ * a connection that wakes up goes back to the thread that ran it
+ * last; new ones are dealt out in turn.
+ *
+ * the caches lock themselves (see statcache.c and the others).  the
+ * main thread reads inotify and the SIGCHLD signalfd, and keeps the
+ * deadlines of parked connections on a timer wheel (see wheel.c), so
+ * a client idle past keepalive_timeout, or sending its request too
+ * slowly, is closed.  a worker waits out its own deadlines with poll.
+ * cgi pools need an event loop, so here, as in fork mode, every cgi
+ * program is exec'd.
+ */
+
+#define MAXEVENTS   64
+#define TICK_MS     1000        /* wake at least this often for the wheel */
+#define DEQUE_MIN   64          /* entries, a power of two; it grows */
+
+#define oops(m,x) {perror(m); exit(x);}
+
+#define INOTIFY_TAG ((void*) &epfd)
+#define SIGNAL_TAG  ((void*) &sigfd)
+
+typedef struct job {
+    connection*     c;
+    long long       queued;     /* when it was pushed, for shed.c   */
+} job;
+
+typedef struct worker {
+    pthread_t       tid;
+    pthread_mutex_t lock;
+    job*            ring;       /* the deque, cap entries           */
+    unsigned        cap;
+    unsigned        head;       /* the oldest; thieves take here    */
+    unsigned        tail;       /* the owner pushes and takes here  */
+} worker;
+
+static int epfd;
+static int sigfd;               /* SIGCHLD, or -1: reap every tick */
+static int accept_again;        /* accept_all stopped short         */
+static worker* workers;
+static int nworkers;
+static int queued;              /* connections on all the deques    */
+static int sleepers;            /* workers waiting for one          */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static wheel parked;            /* deadlines of those in the epoll set */
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * push -- put c on w's deque and wake a worker if all are asleep
+ */
+static void push(worker* w, connection* c)
+{
+    job* bigger;
+    unsigned i;
+    long long now = stats_now();
+
+    pthread_mutex_lock(&w->lock);
+    if (w->tail - w->head == w->cap) {
+        if ((bigger = malloc(2 * w->cap * sizeof(job))) == NULL)
+            oops("malloc", 1);
+        for (i = 0; i < w->cap; i++)
+            bigger[i] = w->ring[(w->head + i) & (w->cap - 1)];
+        free(w->ring);
+        w->ring = bigger;
+        w->head = 0;
+        w->tail = w->cap;
+        w->cap *= 2;
+    }
+    w->ring[w->tail & (w->cap - 1)].c = c;
+    w->ring[w->tail++ & (w->cap - 1)].queued = now;
+    pthread_mutex_unlock(&w->lock);
+
+    /* a worker going to sleep counts itself and then looks at queued;
+       we count the connection and then look at sleepers */
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+
+/*
+ * take -- the newest connection on w's deque, or the oldest
+ *    rets: NULL if it is empty
+ */
+static connection* take(worker* w, int oldest)
+{
+    job j = { NULL, 0 };
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail) {
+        if (oldest)
+            j = w->ring[w->head++ & (w->cap - 1)];
+        else
+            j = w->ring[--w->tail & (w->cap - 1)];
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (j.c != NULL)
+        shed_delay(stats_now() - j.queued);
+    return j.c;
+}
+
+
+static connection* steal(worker* self)
+{
+    connection* c;
+    int i, me = self - workers;
+
+    for (i = 1; i < nworkers; i++)
+        if ((c = take(&workers[(me + i) % nworkers], 1)) != NULL)
+            return c;
+    return NULL;
+}
+
+
+static void wait_for_work(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) <= 0)
+        pthread_cond_wait(&idle_cond, &idle_lock);
+    __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+
+/*
+ * park -- wait in the epoll set until c has more to read
+ *    note: the wheel and the epoll set change together, under
+ *          park_lock, so an expiry never frees a connection that a
+ *          wakeup is handing to a worker
+ */
+static void park(connection* c)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    pthread_mutex_lock(&park_lock);
+    timer_set(&parked, &c->timer, conn_deadline(c));
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1
+            && (errno != ENOENT
+                || epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)) {
+        perror("epoll_ctl");
+        timer_cancel(&c->timer);
+        conn_free(c);
+    }
+    pthread_mutex_unlock(&park_lock);
+}
+
+
+/*
+ * c woke up: hand it to the thread that ran it last
+ */
+static void ready(connection* c)
+{
+    pthread_mutex_lock(&park_lock);
+    timer_cancel(&c->timer);
+    pthread_mutex_unlock(&park_lock);
+    push(c->loop, c);
+}
+
+
+/*
+ * run -- serve c until it is closed or waits for the client
+ */
+static void run(worker* w, connection* c)
+{
+    int rv;
+
+    c->loop = w;
+    while (1) {
+        if (c->state == CS_READ) {
+            rv = conn_read(c);
+            if (rv == CONN_AGAIN) {
+                park(c);
+                return;
+            }
+            if (rv == CONN_ERR)
+                break;
+        }
+        if (c->state == CS_PARSE)
+            serve_pending(c);
+        if (c->state == CS_CGI && cgi_wait(c) != CONN_OK)
+            break;
+        if (send_reply(c) != CONN_OK || !c->keepalive)
+            break;
+        conn_reset(c);
+    }
+    cgi_stop(c);
+    conn_free(c);
+}
+
+
+static void* work(void* arg)
+{
+    worker* w = arg;
+    connection* c;
+
+    while (1) {
+        if ((c = take(w, 0)) != NULL || (c = steal(w)) != NULL)
+            run(w, c);
+        else
+            wait_for_work();
+    }
+    return NULL;
+}
+
+
+/*
+ * accept_all -- take every pending call and park it until the
+ * client sends its request
+ *    note: as in evloop.c, an error with calls still queued is
+ *          retried on the next pass
+ */
+static void accept_all(int sock)
+{
+    static int next;
+    connection* c;
+    int fd;
+
+    shed_backlog(sock);
+    while ((fd = listener_accept(sock)) != -1) {
+        if ((c = conn_new(fd)) == NULL) {
+            close(fd);
+            continue;
+        }
+        c->loop = &workers[next++ % nworkers];
+        park(c);
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+        accept_again = 0;
+    else {
+        if (!accept_again)
+            perror("accept");
+        accept_again = 1;
+    }
+}
+
+
+/*
+ * expired -- a parked connection's deadline came; called with
+ *            park_lock held
+ */
+static void expired(timer* t)
+{
+    connection* c = t->data;
+
+    if (!conn_timed_out(c, parked.now))
+        timer_set(&parked, t, conn_deadline(c));
+    else {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        conn_free(c);
+    }
+}
+
+
+static void close_idle()
+{
+    pthread_mutex_lock(&park_lock);
+    wheel_expire(&parked, wheel_now(), expired);
+    pthread_mutex_unlock(&park_lock);
+}
+
+
+static void start_workers(int n)
+{
+    int i;
+
+    nworkers = n;
+    if ((workers = calloc(n, sizeof(worker))) == NULL)
+        oops("calloc", 1);
+    for (i = 0; i < n; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].cap = DEQUE_MIN;
+        if ((workers[i].ring = malloc(DEQUE_MIN * sizeof(job))) == NULL)
+            oops("malloc", 1);
+        if (pthread_create(&workers[i].tid, NULL, work, &workers[i]) != 0)
+            oops("pthread_create", 2);
+    }
+}
+
+
+void run_threaded(int sock, int n)
+{
+    struct epoll_event ev, events[MAXEVENTS];
+    int i, k, ifd;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+        oops("fcntl", 2);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    wheel_init(&parked, wheel_now());
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        oops("epoll_create1", 2);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1)
+        oops("epoll_ctl", 2);
+
+    filecache_init(cache_size);
+    ifd = statcache_init(stat_cache_ttl);
+    if (lscache_init(ls_cache_ttl) != -1)   /* the same descriptor */
+        ifd = dirwatch_init();
+    if (ifd != -1) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = INOTIFY_TAG;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev) == -1)
+            oops("epoll_ctl", 2);
+    }
+    /* before the threads start, so they inherit SIGCHLD blocked */
+    if ((sigfd = cgiexec_sigfd()) != -1) {
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = SIGNAL_TAG;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) == -1)
+            oops("epoll_ctl", 2);
+    }
+    start_workers(n);
+
+    while (1) {
+        k = epoll_wait(epfd, events, MAXEVENTS, TICK_MS);
+        if (k == -1 && errno != EINTR)
+            oops("epoll_wait", 2);
+        for (i = 0; i < k; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_all(sock);
+            else if (events[i].data.ptr == INOTIFY_TAG)
+                dirwatch_events();
+            else if (events[i].data.ptr == SIGNAL_TAG)
+                cgiexec_reap(sigfd);
+            else
+                ready(events[i].data.ptr);
+        }
+        if (sigfd == -1)
+            cgiexec_reap(-1);
+        close_idle();
+        if (accept_again)
+            accept_all(sock);
+    }
+}
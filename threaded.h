@@ -0,0 +1,14 @@
+#ifndef THREADED_H
+#define THREADED_H
+
+/*
+ * threaded.h - one process, a pool of threads sharing the connections
+ *
+ *  run_threaded(sock, n)   accept calls on sock and serve them from
+ *                          n threads that steal work from each
+ *                          other; never returns
+ */
+
+void run_threaded(int sock, int n);
+
+#endif
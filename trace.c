@@ -0,0 +1,150 @@
+#include    <fcntl.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+#include    "stats.h"
+#include    "trace.h"
+
+/*
+ * trace.c - sampled requests as Chrome trace events
+ *
+ * a sampled request is one span, from when it began to when the last
+ * byte of its reply left, with a span inside it for each phase:
+ *
+ *      read        began to parsed (and "line", to the request line)
+ *      resolve     parsed to the stat cache's answer
+ *      cat, ls ... the handler
+ *      queue       handler done to the first byte of its batch sent
+ *      send        that to the last byte
+ *
+ * the spans of a request are written with one write() to a file
+ * opened O_APPEND, so the threads and processes of every mode can
+ * share it without a lock and without lines crossing.  the file is
+ * the JSON array form of the trace event format, whose closing ]
+ * may be left off, so it is readable at any time by chrome://tracing
+ * or ui.perfetto.dev.  pid is the process, tid the connection's
+ * socket, so each connection is a row.
+ *
+ * a request is sampled by a hash of the microsecond it began, which
+ * needs no shared counter and works the same in fork mode children.
+ */
+
+#define SPAN_LEN    2048
+
+static int tracefd = -1;
+static int sample_every;
+
+static char* handler_names[ST_NHANDLERS] = {
+    "cat", "ls", "exec", "status", "400", "404", "500", "501", "503"
+};
+
+
+/*
+ * trace_open -- sample one request in sample and write it to path;
+ *               a new file is started with the opening [
+ */
+void trace_open(char* path, int sample)
+{
+    struct stat st;
+
+    tracefd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (tracefd == -1) {
+        perror(path);
+        return;
+    }
+    sample_every = sample > 0 ? sample : 1;
+    if (fstat(tracefd, &st) == 0 && st.st_size == 0)
+        if (write(tracefd, "[\n", 2) == -1) {}
+}
+
+
+/*
+ * trace_begin -- a request began at now
+ */
+void trace_begin(trace_rec* tr, long long now)
+{
+    unsigned long long h = (unsigned long long) now * 0x9e3779b97f4a7c15ULL;
+
+    tr->sampled = tracefd != -1 && (h >> 32) % sample_every == 0;
+    if (!tr->sampled)
+        return;
+    tr->begin = now;
+    tr->line = tr->parsed = tr->resolved = tr->start = tr->end = 0;
+}
+
+
+/*
+ * trace_count -- the reply to a sampled request is built
+ *    args: the method and target as sent, not NUL terminated
+ */
+void trace_count(trace_rec* tr, int handler, int status, char* method,
+                 int mlen, char* target, int tlen)
+{
+    tr->handler = handler;
+    tr->status = status;
+    snprintf(tr->name, sizeof(tr->name), "%.*s %.*s", mlen, method,
+             tlen, target);
+}
+
+
+/*
+ * the name with what JSON cannot hold in a string escaped
+ */
+static int put_name(char* out, char* s)
+{
+    int n = 0;
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            out[n++] = '\\';
+        if ((unsigned char) *s < 0x20)
+            n += sprintf(out + n, "\\u%04x", *s);
+        else
+            out[n++] = *s;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+
+/*
+ * one complete ("X") event from from to to, if both were seen
+ */
+static int event(char* p, char* name, long long from, long long to,
+                 int pid, int tid)
+{
+    if (from == 0 || to < from)
+        return 0;
+    return sprintf(p, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,"
+                   "\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+                   name, from, to - from, pid, tid);
+}
+
+
+/*
+ * trace_span -- the last byte of tr's reply left at last; first is
+ *               when the first byte of its batch did
+ */
+void trace_span(trace_rec* tr, int tid, long long first, long long last)
+{
+    char    buf[SPAN_LEN], name[6 * TRACE_NAMELEN + 1], *p = buf;
+    int     pid = getpid();
+    long long done = tr->end ? tr->end : tr->parsed;
+
+    if (tracefd == -1 || !tr->sampled)
+        return;
+    put_name(name, tr->name);
+    p += sprintf(p, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                 "\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"status\":%d}},\n", name,
+                 handler_names[tr->handler], tr->begin, last - tr->begin,
+                 pid, tid, tr->status);
+    p += event(p, "read", tr->begin, tr->parsed, pid, tid);
+    p += event(p, "line", tr->begin, tr->line, pid, tid);
+    p += event(p, "resolve", tr->parsed, tr->resolved, pid, tid);
+    p += event(p, handler_names[tr->handler], tr->start, tr->end, pid, tid);
+    p += event(p, "queue", done, first, pid, tid);
+    p += event(p, "send", first, last, pid, tid);
+    if (write(tracefd, buf, p - buf) == -1) {}
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include    "stats.h"
+
+/*
+ * trace.h - where the time of a request goes
+ *
+ *  trace_open(path, sample)    write one request in sample to path,
+ *                              as Chrome trace events
+ *  trace_begin(tr, now)        a request began at now; sample it?
+ *  TRACE_AT(tr, field)         note the time a sampled one got here
+ *  trace_count(tr, ...)        its reply is built and on its way
+ *  trace_span(tr, ...)         its last byte left: write it out
+ *
+ * and static probes for perf and bpftrace, provider wsng:
+ *
+ *  accept(fd)                          a connection came in
+ *  request__line(fd)                   its request line is in
+ *  headers(fd, length)                 and the rest of the request
+ *  resolved(fd, path)                  the file it names is looked up
+ *  handler__start(fd, path)            process_rq picks a handler
+ *  handler__end(fd, handler, status)   and it is done; an ST_ value
+ *  first__byte(fd)                     replies began to go out
+ *  last__byte(fd, bytes)               and have all gone
+ *
+ * a probe is a nop instruction and a note in the binary, built in
+ * when <sys/sdt.h> (systemtap-sdt-dev) is there and left out when it
+ * is not.  a request that is not sampled costs one test of tr->sampled
+ * at each point; with no trace_file none is.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include    <sys/sdt.h>
+#define TRACE1(p, a)        DTRACE_PROBE1(wsng, p, a)
+#define TRACE2(p, a, b)     DTRACE_PROBE2(wsng, p, a, b)
+#define TRACE3(p, a, b, d)  DTRACE_PROBE3(wsng, p, a, b, d)
+#endif
+#endif
+#ifndef TRACE1
+#define TRACE1(p, a)        do {} while (0)
+#define TRACE2(p, a, b)     do {} while (0)
+#define TRACE3(p, a, b, d)  do {} while (0)
+#endif
+
+#define TRACE_NAMELEN   64
+
+/* the times of one request, stats_now() microseconds, 0 if not seen */
+typedef struct trace_rec {
+    int         sampled;
+    int         handler;        /* ST_ value                    */
+    int         status;
+    long long   begin;          /* as in stats_rec              */
+    long long   line;           /* request line in              */
+    long long   parsed;         /* headers in                   */
+    long long   resolved;       /* stat cache answered          */
+    long long   start;          /* handler called ...           */
+    long long   end;            /* ... and returned             */
+    char        name[TRACE_NAMELEN];    /* method and target    */
+} trace_rec;
+
+#define TRACE_AT(tr, field) \
+    do { if ((tr)->sampled) (tr)->field = stats_now(); } while (0)
+
+void    trace_open(char* path, int sample);
+void    trace_begin(trace_rec* tr, long long now);
+void    trace_count(trace_rec* tr, int handler, int status, char* method,
+                    int mlen, char* target, int tlen);
+void    trace_span(trace_rec* tr, int tid, long long first, long long last);
+
+#endif
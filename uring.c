@@ -0,0 +1,676 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <linux/io_uring.h>
+#include    <poll.h>
+#include    <signal.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <sys/mman.h>
+#include    <sys/socket.h>
+#include    <sys/syscall.h>
+#include    <unistd.h>
+#include    "dirwatch.h"
+#include    "cgiexec.h"
+#include    "filecache.h"
+#include    "lscache.h"
+#include    "shed.h"
+#include    "statcache.h"
+#include    "uring.h"
+#include    "wsng.h"
+
+/*
+ * uring.c - the event loop of evloop.c, on io_uring
+ *
+ * instead of waiting for a socket to be ready and then calling
+ * read and writev, this loop hands the kernel the read or the write
+ * itself and hears back when it is done, so a request costs one
+ * io_uring_enter per loop pass however many connections it moves.
+ *
+ *  - one multishot ACCEPT on the listening socket (registered as
+ *    fixed file 0) yields every new connection
+ *  - each connection has at most one RECV in flight, straight into
+ *    the free end of its own inbuf; the room left there is what
+ *    bounds the read, as with conn_read
+ *  - what conn_out offers (headers, a cached body) goes out as one
+ *    SENDMSG; a body that is sent with sendfile or through a pipe
+ *    is left to conn_send, with a one-shot POLLOUT when it blocks
+ *  - cgi pipes and pool workers (evloop_watch), the inotify
+ *    descriptor and the signalfd get multishot POLL_ADDs
+ *  - a TIMEOUT wakes the loop once a second for the timer wheel,
+ *    which holds each connection's deadline as in evloop.c
+ *
+ * the low bits of each entry's user_data say which of these it is;
+ * the rest points at the connection's uconn.  a dropped connection
+ * has its requests cancelled and is freed once the last of their
+ * completions is in.
+ *
+ * left out: provided buffer rings and registered buffers.  a RECV
+ * lands in the connection's own inbuf, where the parser wants it, so
+ * a shared pool of kernel-picked buffers would only add a copy and a
+ * pool to run dry; and SENDMSG takes no fixed buffers.  the listening
+ * socket is the only registered file, as connections come and go
+ * too fast for a file table to pay off.
+ *
+ * this needs a 5.19 kernel (multishot accept, cancel by fd); on an
+ * older one run_uring_loop unmaps and closes the ring and returns,
+ * and the epoll loop runs instead.
+ */
+
+#define ENTRIES     256
+#define CQ_ENTRIES  4096        /* a burst of completions fits */
+#define TICK_SEC    1
+
+#define OP_ACCEPT   0
+#define OP_RECV     1
+#define OP_SEND     2
+#define OP_POLLOUT  3
+#define OP_WATCH    4
+#define OP_TICK     5
+#define OP_INOTIFY  6
+#define OP_SIGNAL   7
+#define OP_CANCEL   8
+#define OP_MASK     15          /* uconns are at least 16-aligned */
+
+#define BIT(op)     (1 << (op))
+
+#define oops(m,x) {perror(m); exit(x);}
+
+typedef struct uconn {
+    connection*   c;
+    struct msghdr msg;          /* for the SENDMSG in flight; the   */
+    struct iovec  iov[2];       /*   kernel may read them late      */
+    int           armed;        /* BIT(op) of the one-shots in flight */
+    int           inflight;     /* completions still to come        */
+    int           wfd;          /* fd being watched for it, or -1   */
+    struct uconn* next;         /* on the closed list               */
+} uconn;
+
+static int ringfd;
+static char* ring;              /* sq and cq rings, one mapping     */
+static size_t ringlen;
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned  sq_mask, sq_entries;
+static unsigned  sq_next;       /* our tail, published by submit()  */
+static struct io_uring_sqe* sqes;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned  cq_mask;
+static struct io_uring_cqe* cqes;
+
+static int sock;
+static int fixed_sock;          /* sock is registered as file 0     */
+static int multishot = 1;       /* accept: until the kernel says no */
+static int ifd, sigfd;
+static uconn** watched;         /* by fd: who evloop_watch'ed it    */
+static int nwatched;
+static wheel timers;            /* every open connection's deadline */
+static uconn* closed;           /* waiting for their last completion */
+static struct __kernel_timespec tick = { TICK_SEC, 0 };
+
+
+static int sys_setup(unsigned n, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, n, p);
+}
+
+
+static int sys_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ringfd, submit, wait, flags, NULL, 0);
+}
+
+
+static int sys_register(unsigned op, void* arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, ringfd, op, arg, n);
+}
+
+
+/*
+ * ring_init -- set up the ring and map it in
+ *    rets: 0, or -1 if this kernel has no usable io_uring
+ */
+static int ring_init(void)
+{
+    struct io_uring_params p;
+    size_t cqlen;
+    unsigned i, *array;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER
+              | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = CQ_ENTRIES;
+    if ((ringfd = sys_setup(ENTRIES, &p)) == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));   /* flags older than the kernel */
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = CQ_ENTRIES;
+        ringfd = sys_setup(ENTRIES, &p);
+    }
+    if (ringfd == -1)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+            || !(p.features & IORING_FEAT_NODROP))
+        goto fail;
+
+    ringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqlen > ringlen)
+        ringlen = cqlen;
+    ring = mmap(NULL, ringlen, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+        goto fail;
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(ring, ringlen);
+        goto fail;
+    }
+
+    sq_head = (unsigned*) (ring + p.sq_off.head);
+    sq_tail = (unsigned*) (ring + p.sq_off.tail);
+    sq_mask = *(unsigned*) (ring + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_next = *sq_tail;
+    array = (unsigned*) (ring + p.sq_off.array);
+    for (i = 0; i < sq_entries; i++)
+        array[i] = i;               /* entry i is always slot i */
+    cq_head = (unsigned*) (ring + p.cq_off.head);
+    cq_tail = (unsigned*) (ring + p.cq_off.tail);
+    cq_mask = *(unsigned*) (ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ringfd);
+    return -1;
+}
+
+
+/*
+ * ring_free -- undo ring_init, for a kernel that turns out to lack
+ *              an operation we need
+ */
+static void ring_free(void)
+{
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring, ringlen);
+    close(ringfd);
+}
+
+
+/*
+ * supported -- does the kernel have every operation this loop uses?
+ *    note: SOCKET is not used; it came in 5.19 with multishot
+ *          accept and cancel by fd, which have no probe bit
+ */
+static int supported(void)
+{
+    static int need[] = { IORING_OP_ACCEPT, IORING_OP_RECV,
+                          IORING_OP_SENDMSG, IORING_OP_POLL_ADD,
+                          IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT,
+                          IORING_OP_SOCKET };
+    struct io_uring_probe* probe;
+    size_t i;
+    int ok = 1;
+
+    probe = calloc(1, sizeof(*probe)
+                      + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return 0;
+    if (sys_register(IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1)
+        ok = 0;
+    for (i = 0; ok && i < sizeof(need) / sizeof(need[0]); i++)
+        if (need[i] > probe->last_op
+                || !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    free(probe);
+    return ok;
+}
+
+
+/*
+ * submit -- hand the kernel what get_sqe() has filled in, and wait
+ *           for at least wait completions
+ */
+static void submit(unsigned wait)
+{
+    unsigned n;
+
+    __atomic_store_n(sq_tail, sq_next, __ATOMIC_RELEASE);
+    n = sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sys_enter(n, wait, wait ? IORING_ENTER_GETEVENTS : 0) == -1
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        oops("io_uring_enter", 2);
+}
+
+
+/*
+ * get_sqe -- the next free submission entry, cleared
+ */
+static struct io_uring_sqe* get_sqe(void)
+{
+    struct io_uring_sqe* sqe;
+
+    if (sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+        submit(0);
+        if (sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            oops("io_uring: submission queue stuck", 2);
+    }
+    sqe = &sqes[sq_next++ & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+static struct io_uring_sqe* get_sqe_for(uconn* u, int op)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+
+    sqe->user_data = (uintptr_t) u | op;
+    if (u != NULL)
+        u->inflight++;
+    return sqe;
+}
+
+
+static void arm_accept(void)
+{
+    struct io_uring_sqe* sqe = get_sqe_for(NULL, OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fixed_sock ? 0 : sock;
+    if (fixed_sock)
+        sqe->flags = IOSQE_FIXED_FILE;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+
+static void arm_tick(void)
+{
+    struct io_uring_sqe* sqe = get_sqe_for(NULL, OP_TICK);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t) &tick;
+    sqe->len = 1;
+}
+
+
+/*
+ * arm_poll -- a multishot poll of fd; u is NULL for the loop's own
+ */
+static void arm_poll(int fd, uconn* u, int op, unsigned events)
+{
+    struct io_uring_sqe* sqe = get_sqe_for(u, op);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+
+/*
+ * cancel -- everything in flight on fd, or if fd is -1, everything
+ *           whose user_data is data
+ */
+static void cancel(int fd, uint64_t data)
+{
+    struct io_uring_sqe* sqe = get_sqe_for(NULL, OP_CANCEL);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    if (fd != -1) {
+        sqe->fd = fd;
+        sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD;
+    } else
+        sqe->addr = data;
+}
+
+
+static void arm_recv(uconn* u)
+{
+    connection* c = u->c;
+    struct io_uring_sqe* sqe;
+
+    if (u->armed & BIT(OP_RECV))
+        return;
+    u->armed |= BIT(OP_RECV);
+    sqe = get_sqe_for(u, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->len = conn_room(c);        /* first: inbuf may move */
+    sqe->addr = (uintptr_t) (c->inbuf + c->inlen);
+}
+
+
+static void arm_send(uconn* u, int niov)
+{
+    struct io_uring_sqe* sqe;
+
+    memset(&u->msg, 0, sizeof(u->msg));
+    u->msg.msg_iov = u->iov;
+    u->msg.msg_iovlen = niov;
+    u->armed |= BIT(OP_SEND);
+    sqe = get_sqe_for(u, OP_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = u->c->fd;
+    sqe->addr = (uintptr_t) &u->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+
+static void arm_pollout(uconn* u)
+{
+    struct io_uring_sqe* sqe;
+
+    u->armed |= BIT(OP_POLLOUT);
+    sqe = get_sqe_for(u, OP_POLLOUT);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = u->c->fd;
+    sqe->poll32_events = POLLOUT;
+}
+
+
+void uring_watch(int fd, void* c)
+{
+    uconn* u = ((connection*) c)->loop;
+    uconn** bigger;
+    int n;
+
+    if (fd >= nwatched) {
+        n = (fd + 64) & ~63;
+        if ((bigger = realloc(watched, n * sizeof(uconn*))) == NULL) {
+            perror("uring_watch");
+            return;
+        }
+        memset(bigger + nwatched, 0, (n - nwatched) * sizeof(uconn*));
+        watched = bigger;
+        nwatched = n;
+    }
+    watched[fd] = u;
+    u->wfd = fd;
+    arm_poll(fd, u, OP_WATCH, POLLIN | POLLOUT | POLLRDHUP);
+}
+
+
+/*
+ * uring_unwatch -- by user_data, since fd may be closed by now
+ */
+void uring_unwatch(int fd)
+{
+    uconn* u;
+
+    if (fd >= nwatched || (u = watched[fd]) == NULL)
+        return;
+    watched[fd] = NULL;
+    u->wfd = -1;
+    cancel(-1, (uintptr_t) u | OP_WATCH);
+}
+
+
+static void drop_conn(uconn* u)
+{
+    connection* c = u->c;
+
+    timer_cancel(&c->timer);
+    cgi_stop(c);
+    if (u->inflight > 0)
+        cancel(c->fd, 0);
+    c->state = CS_CLOSED;
+    u->next = closed;
+    closed = u;
+}
+
+
+/*
+ * free the closed connections that have nothing left in flight
+ */
+static void free_closed()
+{
+    uconn **up, *u;
+
+    for (up = &closed; (u = *up) != NULL; ) {
+        if (u->inflight > 0) {
+            up = &u->next;
+            continue;
+        }
+        *up = u->next;
+        conn_free(u->c);
+        free(u);
+    }
+}
+
+
+/*
+ * advance -- move one connection as far as it goes without waiting,
+ *            then leave the kernel the recv or send it is waiting on
+ */
+static void advance(uconn* u)
+{
+    connection* c = u->c;
+    int rv, niov;
+
+    if (u->armed & (BIT(OP_SEND) | BIT(OP_POLLOUT)))
+        return;                     /* a completion will bring it back */
+    while (1) {
+        if (c->state == CS_READ) {
+            arm_recv(u);
+            return;
+        }
+        if (c->state == CS_PARSE)
+            serve_pending(c);
+        while (c->state == CS_CGI) {
+            rv = cgi_continue(c);
+            if (rv == CONN_AGAIN) {
+                if (c->outpos < c->outlen)
+                    arm_pollout(u); /* else the cgi side is slow */
+                return;
+            }
+            if (rv == CONN_ERR) {
+                drop_conn(u);
+                return;
+            }
+        }
+        if ((niov = conn_out(c, u->iov)) > 0) {
+            arm_send(u, niov);
+            return;
+        }
+        rv = conn_send(c);          /* a body from a file or pipe */
+        if (rv == CONN_AGAIN) {
+            arm_pollout(u);
+            return;
+        }
+        if (rv == CONN_ERR || !c->keepalive) {
+            drop_conn(u);
+            return;
+        }
+        conn_reset(c);
+    }
+}
+
+
+/*
+ * serve -- advance u, then note when it must next have moved
+ */
+static void serve(uconn* u)
+{
+    connection* c = u->c;
+
+    if (c->state == CS_CLOSED)
+        return;
+    advance(u);
+    if (c->state != CS_CLOSED)
+        timer_set(&timers, &c->timer, conn_deadline(c));
+}
+
+
+static void new_conn(int fd)
+{
+    connection* c;
+    uconn* u;
+
+    if ((u = calloc(1, sizeof(uconn))) == NULL || (c = conn_new(fd)) == NULL) {
+        free(u);
+        close(fd);
+        return;
+    }
+    u->c = c;
+    u->wfd = -1;
+    c->loop = u;
+    serve(u);
+}
+
+
+/*
+ * complete -- act on one completion
+ */
+static void complete(struct io_uring_cqe* cqe)
+{
+    int op = cqe->user_data & OP_MASK;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    uconn* u = (uconn*) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int res = cqe->res;
+
+    switch (op) {
+    case OP_ACCEPT:
+        if (res >= 0)
+            new_conn(res);
+        else if (res == -EINVAL && multishot)
+            multishot = 0;          /* then one accept at a time */
+        else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+        if (!more)
+            arm_accept();
+        return;
+    case OP_TICK:
+        arm_tick();
+        return;
+    case OP_INOTIFY:
+        dirwatch_events();
+        if (!more)
+            arm_poll(ifd, NULL, OP_INOTIFY, POLLIN);
+        return;
+    case OP_SIGNAL:
+        cgiexec_reap(sigfd);
+        if (!more)
+            arm_poll(sigfd, NULL, OP_SIGNAL, POLLIN);
+        return;
+    case OP_CANCEL:
+        return;
+    }
+
+    if (!more) {
+        u->inflight--;
+        u->armed &= ~BIT(op);
+    }
+    if (u->c->state == CS_CLOSED)
+        return;                     /* free_closed takes it from here */
+
+    switch (op) {
+    case OP_RECV:
+        if (res > 0)
+            conn_take(u->c, res);
+        else if (res != -EINTR && res != -EAGAIN) {
+            drop_conn(u);           /* closed by the client, or broken */
+            return;
+        }
+        break;
+    case OP_SEND:
+        if (res >= 0)
+            conn_wrote(u->c, res);
+        else if (res != -EINTR && res != -EAGAIN) {
+            drop_conn(u);
+            return;
+        }
+        break;
+    case OP_WATCH:
+        if (res == -ECANCELED)
+            return;
+        if (!more && u->wfd != -1)  /* the kernel ended it, not us */
+            arm_poll(u->wfd, u, OP_WATCH, POLLIN | POLLOUT | POLLRDHUP);
+        break;
+    }
+    serve(u);
+}
+
+
+/*
+ * reap -- every completion that is in
+ */
+static void reap(void)
+{
+    struct io_uring_cqe cqe;
+    unsigned head = *cq_head;
+
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+        complete(&cqe);
+    }
+}
+
+
+/*
+ * expired -- as in evloop.c
+ */
+static void expired(timer* t)
+{
+    connection* c = t->data;
+
+    if (!conn_timed_out(c, timers.now))
+        timer_set(&timers, t, conn_deadline(c));
+    else if (c->state == CS_CGI && cgi_expire(c) != CONN_ERR)
+        serve(c->loop);
+    else
+        drop_conn(c->loop);
+}
+
+
+void run_uring_loop(int listener)
+{
+    long long start;
+
+    if (ring_init() == -1)
+        return;
+    if (!supported()) {
+        ring_free();
+        return;
+    }
+    sock = listener;
+    fixed_sock = (sys_register(IORING_REGISTER_FILES, &sock, 1) == 0);
+
+    signal(SIGPIPE, SIG_IGN);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    wheel_init(&timers, wheel_now());
+    filecache_init(cache_size);
+    ifd = statcache_init(stat_cache_ttl);
+    if (lscache_init(ls_cache_ttl) != -1)   /* the same descriptor */
+        ifd = dirwatch_init();
+    if (ifd != -1)
+        arm_poll(ifd, NULL, OP_INOTIFY, POLLIN);
+    if ((sigfd = cgiexec_sigfd()) != -1)
+        arm_poll(sigfd, NULL, OP_SIGNAL, POLLIN);
+    arm_accept();
+    arm_tick();
+
+    while (1) {
+        submit(1);
+        start = stats_now();
+        reap();
+        free_closed();
+        shed_delay(stats_now() - start);
+        shed_backlog(sock);
+        if (sigfd == -1)
+            cgiexec_reap(-1);
+        wheel_expire(&timers, wheel_now(), expired);
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * uring.h - the event loop of evloop.c, on io_uring instead of epoll
+ *
+ *  run_uring_loop(sock)    serve every connection on sock; returns
+ *                          only if this kernel cannot, and then
+ *                          nothing has been changed
+ *  uring_watch(fd, c)      evloop_watch and evloop_unwatch, for
+ *  uring_unwatch(fd)       when this loop is the one running
+ */
+
+void    run_uring_loop(int sock);
+void    uring_watch(int fd, void* c);
+void    uring_unwatch(int fd);
+
+#endif
@@ -1,37 +1,82 @@
+#define		_GNU_SOURCE		/* strptime, timegm */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
 #include	<time.h>
+#include	"web-time.h"
 
 /*
  * 	function 	rfc822_time()
  *	purpose		return a string suitable for web servers
  *	details		Sun, 06 Nov 1994 08:49:37 GMT    
- *	method		use gmtime() to get struct
- *			then use asctime to translate to English
+ *	method		use gmtime_r() to get struct
+ *			then use asctime_r to translate to English
  *			Tue Nov	 9 15:37:29 1993\n\0
  *			012345678901234567890123456789
  *			then rearrange using sprintf
- *	arg		a time_t value 
- *	returns		a pointer to a static buffer
+ *	arg		a time_t value, and a buffer of RFC822_LEN
+ *	returns		the buffer
  */
 
 char *
-rfc822_time(time_t thetime)
+rfc822_time(time_t thetime, char *retval)
 {
-	struct tm *t ;
-	char	*str;
+	struct tm t;
+	char	str[26];
 	int	d;
-	static  char retval[36];
 	
-	t = gmtime( &thetime );		/* break into parts	*/
-	str = asctime( t );		/* create string	*/
+	gmtime_r( &thetime, &t );	/* break into parts	*/
+	asctime_r( &t, str );		/* create string	*/
 	d = atoi( str + 8 );
 	sprintf(retval,"%.3s, %02d %.3s %.4s %.8s GMT", 
 			str ,   d, str+4, str+20, str+11 );
 	return retval;
 }
 
+/*
+ * 	function 	rfc822_parse()
+ *	purpose		read a date from a request header
+ *	details		takes the form above, the obsolete RFC 850
+ *			form (Sunday, 06-Nov-94 08:49:37 GMT) and the
+ *			asctime form (Sun Nov  6 08:49:37 1994), as
+ *			HTTP asks servers to
+ *	arg		the text, and its length (need not be
+ *			NUL terminated)
+ *	returns		the time, or -1 if it is not a date
+ */
+
+time_t
+rfc822_parse( char *str, int len )
+{
+	static char *formats[] = {
+		"%a, %d %b %Y %H:%M:%S GMT",
+		"%A, %d-%b-%y %H:%M:%S GMT",
+		"%a %b %e %H:%M:%S %Y",
+	};
+	char	buf[64];
+	char	*end;
+	struct tm t;
+	int	i;
+
+	if ( len >= (int) sizeof(buf) )
+		return -1;
+	memcpy( buf, str, len );
+	buf[len] = '\0';
+	for ( i = 0 ; i < 3 ; i++ ) {
+		memset( &t, 0, sizeof(t) );
+		end = strptime( buf, formats[i], &t );
+		if ( end != NULL && *end == '\0' )
+			return timegm( &t );
+	}
+	return -1;
+}
+
 #ifdef STANDALONE
 main()
 {
-	printf ( "[%s]\n", rfc822_time( time(0L) ) );
+	char	buf[RFC822_LEN];
+
+	printf ( "[%s]\n", rfc822_time( time(0L), buf ) );
 }
 #endif
@@ -0,0 +1,19 @@
+#ifndef WEB_TIME_H
+#define WEB_TIME_H
+
+#include	<time.h>
+
+/*
+ *	web-time.h
+ *
+ *	rfc822_time( t, buf )	puts "Sun, 06 Nov 1994 08:49:37 GMT"
+ *				in buf[RFC822_LEN] and returns buf
+ *	rfc822_parse( s, len )	the time in a header date, or -1
+ */
+
+#define	RFC822_LEN	36
+
+char *rfc822_time( time_t thetime, char *buf );
+time_t rfc822_parse( char *str, int len );
+
+#endif
@@ -0,0 +1,154 @@
+#include    <stddef.h>
+#include    "wheel.h"
+
+/*
+ * wheel.c - a hierarchical timing wheel
+ *
+ * level 0 has a slot for each of the next 64 seconds.  a slot of
+ * level 1 holds the timers of a whole 64 second stretch after that,
+ * one of level 2 a 4096 second stretch, and so on.  each time the
+ * clock passes into a new stretch, the slot of the level above that
+ * holds it is emptied and its timers filed again, now one level
+ * lower.  a timer is never more than WHEEL_LEVELS filings from
+ * firing, and most are moved or cancelled long before that.
+ *
+ * every list is circular with its head in the wheel, so a timer can
+ * be unlinked without knowing which wheel or slot it is in.
+ */
+
+#define MASK        (WHEEL_SLOTS - 1)
+#define SPAN(l)     ((time_t) 1 << (WHEEL_BITS * (l)))  /* seconds a slot of
+                                                           level l covers */
+
+
+static void empty(timer* head)
+{
+    head->next = head->prev = head;
+}
+
+
+static void link_before(timer* head, timer* t)
+{
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+
+static void unlink_timer(timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+
+/*
+ * wheel_now -- seconds on a clock that setting the date does not move
+ */
+time_t wheel_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+
+void wheel_init(wheel* w, time_t now)
+{
+    int l, s;
+
+    w->now = now;
+    for (l = 0; l < WHEEL_LEVELS; l++)
+        for (s = 0; s < WHEEL_SLOTS; s++)
+            empty(&w->slot[l][s]);
+}
+
+
+void timer_init(timer* t, void* data)
+{
+    t->next = t->prev = NULL;
+    t->data = data;
+}
+
+
+/*
+ * file t in the slot for t->when: the finest level whose reach from
+ * the clock covers it.  a time already past goes in the next second.
+ */
+static void file(wheel* w, timer* t)
+{
+    time_t when = t->when, ahead;
+    int l;
+
+    if (when <= w->now)
+        when = w->now + 1;
+    ahead = when - w->now;
+    if (ahead >= SPAN(WHEEL_LEVELS))    /* fires early; fire sets it again */
+        when = w->now + SPAN(WHEEL_LEVELS) - 1;
+    for (l = 0; l < WHEEL_LEVELS - 1 && ahead >= SPAN(l + 1); l++) {}
+    link_before(&w->slot[l][(when >> (WHEEL_BITS * l)) & MASK], t);
+}
+
+
+void timer_set(wheel* w, timer* t, time_t when)
+{
+    if (t->next != NULL)
+        unlink_timer(t);
+    t->when = when;
+    file(w, t);
+}
+
+
+void timer_cancel(timer* t)
+{
+    if (t->next != NULL)
+        unlink_timer(t);
+}
+
+
+/*
+ * move the timers of list head onto list to, leaving head empty
+ */
+static void take_all(timer* head, timer* to)
+{
+    if (head->next == head)
+        return;
+    head->next->prev = to->prev;
+    to->prev->next = head->next;
+    head->prev->next = to;
+    to->prev = head->prev;
+    empty(head);
+}
+
+
+void wheel_expire(wheel* w, time_t now, void (*fire)(timer* t))
+{
+    timer due, *t;
+    int l;
+
+    empty(&due);
+    while (w->now < now) {
+        w->now++;
+        /* entering a new stretch of level l: file its timers lower */
+        for (l = 1; l < WHEEL_LEVELS && (w->now & (SPAN(l) - 1)) == 0; l++) {
+            timer moving;
+
+            empty(&moving);
+            take_all(&w->slot[l][(w->now >> (WHEEL_BITS * l)) & MASK],
+                     &moving);
+            while ((t = moving.next) != &moving) {
+                unlink_timer(t);
+                file(w, t);
+            }
+        }
+        take_all(&w->slot[0][w->now & MASK], &due);
+    }
+    /* one at a time, so fire may cancel or set any timer */
+    while ((t = due.next) != &due) {
+        unlink_timer(t);
+        fire(t);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include    <limits.h>
+#include    <time.h>
+
+/*
+ * wheel.h - deadlines for many connections, on a hierarchical
+ *           timing wheel
+ *
+ *  wheel_now()                 the clock deadlines are kept in:
+ *                              CLOCK_MONOTONIC, in seconds
+ *  wheel_init(w, now)          an empty wheel, its clock at now
+ *  timer_init(t, data)         a timer, not armed, carrying data
+ *  timer_set(w, t, when)       t is due at when (a wheel_now()
+ *                              value); moves it if it was armed
+ *                              already
+ *  timer_cancel(t)             disarm t; harmless if it is not armed
+ *  wheel_expire(w, now, fire)  bring the clock up to now and call
+ *                              fire(t) for each timer that came due,
+ *                              disarmed first so fire may set it again
+ *
+ * setting, moving and cancelling a timer is a few pointer moves,
+ * and the clock costs one list per second plus, now and then, the
+ * re-filing of a list from a coarser level.  timers that are moved
+ * before they come due, as most are, cost nothing more.
+ */
+
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4       /* 64^4 seconds, over 190 days */
+
+#define NEVER   ((time_t) LONG_MAX)     /* a deadline that does not come */
+
+typedef struct timer {
+    struct timer*   next;       /* in a slot's list; NULL when not  */
+    struct timer*   prev;       /*   armed                          */
+    time_t          when;
+    void*           data;
+} timer;
+
+typedef struct wheel {
+    time_t  now;                /* every slot up to here has fired  */
+    timer   slot[WHEEL_LEVELS][WHEEL_SLOTS];    /* list heads       */
+} wheel;
+
+time_t  wheel_now(void);
+void    wheel_init(wheel* w, time_t now);
+void    timer_init(timer* t, void* data);
+void    timer_set(wheel* w, timer* t, time_t when);
+void    timer_cancel(timer* t);
+void    wheel_expire(wheel* w, time_t now, void (*fire)(timer* t));
+
+#endif
@@ -0,0 +1,984 @@
+#define     _GNU_SOURCE
+
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <netinet/in.h>
+#include    <netinet/tcp.h>
+#include    <pthread.h>
+#include    <signal.h>
+#include    <stdint.h>
+#include    <stdio.h>
+#include    <stdlib.h>
+#include    <string.h>
+#include    <strings.h>
+#include    <sys/epoll.h>
+#include    <sys/socket.h>
+#include    <time.h>
+#include    <unistd.h>
+#include    "capture.h"
+#include    "socklib.h"
+#include    "stats.h"
+
+/*
+ * wsbench.c - load generator, for measuring wsng against itself
+ *
+ *    usage: wsbench [options] host port [path]
+ *
+ *      -t n    threads, each with its own epoll loop (1)
+ *      -c n    connections, spread over the threads (10)
+ *      -d n    seconds to run (10)
+ *      -r n    open loop: n requests a second in all, sent on a
+ *              fixed schedule whether or not answers keep up.
+ *              without -r the loop is closed: each connection sends
+ *              its next request when an answer comes back
+ *      -p n    pipeline: requests in flight per connection (1)
+ *      -s      single: a new connection for every request
+ *      -f file paths to request, one per line, used in turn; a path
+ *              listed twice is asked for twice as often
+ *      -R file replay requests captured by wsng (capture_file in
+ *              wsng.conf), byte for byte, each at the time it came
+ *              in, relative to the first.  the run lasts as long as
+ *              the capture unless -d says otherwise
+ *      -x n    replay n times as fast (1; 0.5 is half speed)
+ *
+ * a replay is an open loop, and reports latencies for each handler
+ * that answered the request when it was captured (cat, ls, exec ...),
+ * so the mix of files, listings and cgi programs is the real one.
+ *
+ * latencies are kept in log-linear histograms (1/32 resolution).
+ * "service" is from the moment a request was written to the end of
+ * its answer.  that hides the queueing a stalled server causes
+ * (coordinated omission), since a closed loop stops asking while
+ * the server stalls.  so "corrected" is reported too:
+ *
+ *      open loop     timed from when the schedule said the request
+ *                    was due, not when a connection was free to send it
+ *      closed loop   each slow answer also stands for the answers the
+ *                    connection would have had in the meantime, at
+ *                    the mean service time apart (HdrHistogram's
+ *                    expected-interval correction)
+ *
+ * answers are framed by Content-Length, chunked encoding, or EOF.
+ * when the server closes a kept-alive connection (after a reply
+ * with Connection: close), requests pipelined behind it are sent
+ * again on a new connection, still timed from their first sending.
+ *
+ *  compile: make wsbench
+ */
+
+#define BUFLEN      65536
+#define MAXDEPTH    64
+#define MAXPATHS    4096
+#define REQLEN      1024
+#define DRAIN_SECS  2           /* wait for answers after the run   */
+#define RETRY_US    100000      /* between connects that fail       */
+
+#define SUB_BITS    5
+#define SUB         (1 << SUB_BITS)
+#define NBUCKETS    ((37 - SUB_BITS) * SUB)     /* up to 2^36 us    */
+
+#define oops(m,x) {perror(m); exit(x);}
+
+typedef struct hist {
+    unsigned long   count[NBUCKETS];
+    unsigned long   n;
+    long long       max;
+    double          sum;
+} hist;
+
+/* how an answer's body ends */
+#define BODY_LEN    0
+#define BODY_CHUNKS 1
+#define BODY_EOF    2
+
+/* where we are in a chunked body */
+#define CH_SIZE     0
+#define CH_DATA     1
+#define CH_CRLF     2
+#define CH_TRAILER  3
+
+typedef struct pending {
+    long long   due;            /* when it should have gone    */
+    long long   sent;           /* when it went                */
+    int         path;           /* or record, in a replay      */
+    int         head_only;      /* HEAD: no body comes back    */
+} pending;
+
+/* a captured request */
+typedef struct record {
+    long long   at;             /* us after the first one      */
+    char*       rq;
+    int         len;
+    int         handler;        /* ST_ value                   */
+} record;
+
+typedef struct client {
+    int         fd;             /* -1 between connections       */
+    long long   opened;         /* when the connection began    */
+    int         nsent;          /* requests on this connection  */
+    char        out[REQLEN * MAXDEPTH];
+    size_t      outlen;
+    size_t      outpos;
+    char        in[BUFLEN];
+    size_t      inlen;
+    size_t      inpos;          /* parsed up to here            */
+    pending     fifo[MAXDEPTH]; /* requests awaiting answers    */
+    int         head;
+    int         inflight;
+    int         inbody;         /* past the answer's header     */
+    int         bodytype;
+    int         chunkstate;
+    long long   left;           /* body or chunk bytes to come  */
+    int         status;
+    int         closing;        /* answer said Connection: close */
+} client;
+
+typedef struct worker {
+    pthread_t   tid;
+    int         epfd;
+    client*     clients;
+    int         nclients;
+    int         next;           /* round robin for the open loop */
+    long long   due;            /* next scheduled request       */
+    long long   interval;       /* us between them, 0 if closed */
+    int         pathno;
+    int         recno;          /* replay: next record to send  */
+    int         stride;         /*   and the step to the next   */
+    hist        service;
+    hist        sched;          /* open loop: timed from due    */
+    hist        handlers[ST_NHANDLERS];     /* replay, from due */
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long status[6];    /* by hundreds: 1xx .. 5xx      */
+    unsigned long err_connect;
+    unsigned long err_read;
+    unsigned long err_parse;
+    unsigned long reconnects;
+    unsigned long unfinished;
+} worker;
+
+static struct sockaddr_in server;
+static char*    hostname;
+static char*    paths[MAXPATHS];
+static int      npaths;
+static int      depth = 1;
+static int      single;
+static record*  recs;           /* replay                       */
+static int      nrecs;
+static double   speed = 1;
+static long long started;
+static long long stop_at;       /* stop sending                 */
+static long long drain_at;      /* stop waiting for answers     */
+
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/* ------------------------------------------------------ *
+   histograms: values below SUB get a bucket each; above
+   that each power of two is cut into SUB buckets
+   ------------------------------------------------------ */
+
+static int bucket(long long us)
+{
+    int e, b;
+
+    if (us < SUB)
+        return us < 0 ? 0 : us;
+    e = 63 - __builtin_clzll(us);
+    b = (e - SUB_BITS + 1) * SUB + ((us >> (e - SUB_BITS)) & (SUB - 1));
+    return b < NBUCKETS ? b : NBUCKETS - 1;
+}
+
+
+static long long bucket_top(int b)
+{
+    int e;
+
+    if (b < SUB)
+        return b;
+    e = b / SUB + SUB_BITS - 1;
+    return ((long long) (SUB + b % SUB + 1) << (e - SUB_BITS)) - 1;
+}
+
+
+static void hist_add(hist* h, long long us, unsigned long n)
+{
+    if (us < 0)
+        us = 0;
+    h->count[bucket(us)] += n;
+    h->n += n;
+    h->sum += (double) us * n;
+    if (us > h->max)
+        h->max = us;
+}
+
+
+static void hist_merge(hist* to, hist* from)
+{
+    int b;
+
+    for (b = 0; b < NBUCKETS; b++)
+        to->count[b] += from->count[b];
+    to->n += from->n;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+
+/*
+ * hist_pct -- the value q parts in 1000 of the way up
+ */
+static long long hist_pct(hist* h, int q)
+{
+    unsigned long want = (h->n * q + 999) / 1000, seen = 0;
+    int b;
+
+    for (b = 0; b < NBUCKETS; b++)
+        if ((seen += h->count[b]) >= want && seen > 0)
+            return bucket_top(b) < h->max ? bucket_top(b) : h->max;
+    return 0;
+}
+
+
+/*
+ * hist_correct -- to gets from's values plus, for each value v above
+ * interval, the values v - interval, v - 2 * interval ... that a
+ * connection not held up by the slow answer would have seen
+ */
+static void hist_correct(hist* to, hist* from, long long interval)
+{
+    long long v, x;
+    int b;
+
+    for (b = 0; b < NBUCKETS; b++) {
+        if (from->count[b] == 0)
+            continue;
+        v = bucket_top(b) < from->max ? bucket_top(b) : from->max;
+        hist_add(to, v, from->count[b]);
+        if (interval <= 0)
+            continue;
+        for (x = v - interval; x >= interval; x -= interval)
+            hist_add(to, x, from->count[b]);
+    }
+}
+
+
+/* ------------------------------------------------------ *
+   one connection: requests out, answers in
+   ------------------------------------------------------ */
+
+static void try_write(worker* w, client* c);
+static void broken(worker* w, client* c);
+static void fill(worker* w, client* c);
+
+
+/*
+ * queue a request for path on c, timed from due; in a replay, path
+ * is the record to send
+ */
+static void send_one(worker* w, client* c, long long due, int path)
+{
+    pending* p = &c->fifo[(c->head + c->inflight) % MAXDEPTH];
+    int n;
+
+    if (c->outpos == c->outlen)
+        c->outpos = c->outlen = 0;
+    if (recs != NULL) {
+        n = recs[path].len;
+        if ((size_t) n >= sizeof(c->out) - c->outlen)
+            return;
+        memcpy(c->out + c->outlen, recs[path].rq, n);
+        p->head_only = strncmp(recs[path].rq, "HEAD ", 5) == 0;
+    } else {
+        n = snprintf(c->out + c->outlen, sizeof(c->out) - c->outlen,
+                     "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", paths[path],
+                     hostname, single ? "Connection: close\r\n" : "");
+        if (n < 0 || (size_t) n >= sizeof(c->out) - c->outlen)
+            return;
+        p->head_only = 0;
+    }
+    c->outlen += n;
+    p->due = due;
+    p->sent = now_us();
+    if (c->nsent++ == 0 && c->opened > due)
+        p->sent = c->opened;        /* it waited for the connect */
+    p->path = path;
+    c->inflight++;
+}
+
+
+static int next_path(worker* w)
+{
+    w->pathno = (w->pathno + 1) % npaths;
+    return w->pathno;
+}
+
+
+/*
+ * connect c again, sending anything that was still waiting for an
+ * answer on the old connection
+ */
+static void reconnect(worker* w, client* c)
+{
+    struct epoll_event ev;
+    pending old[MAXDEPTH];
+    int i, n = c->inflight;
+
+    if (c->fd != -1) {
+        close(c->fd);
+        w->reconnects++;
+    }
+    for (i = 0; i < n; i++)
+        old[i] = c->fifo[(c->head + i) % MAXDEPTH];
+    c->head = c->inflight = 0;
+    c->outlen = c->outpos = 0;
+    c->inlen = c->inpos = 0;
+    c->inbody = c->closing = 0;
+    c->nsent = 0;
+    c->opened = now_us();
+
+    if ((c->fd = connect_to_address(&server)) == -1) {
+        w->err_connect++;
+        w->unfinished += n;
+        return;
+    }
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    i = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        oops("epoll_ctl", 1);
+
+    for (i = 0; i < n; i++) {
+        send_one(w, c, old[i].due, old[i].path);
+        c->fifo[(c->head + i) % MAXDEPTH].sent = old[i].sent;
+    }
+    fill(w, c);
+    try_write(w, c);
+}
+
+
+/*
+ * closed loop: keep depth requests in flight while the run lasts
+ */
+static void fill(worker* w, client* c)
+{
+    long long now = now_us();
+
+    if (w->interval > 0 || now >= stop_at || c->fd == -1)
+        return;
+    while (c->inflight < depth && !(single && c->nsent > 0))
+        send_one(w, c, now, next_path(w));
+}
+
+
+/*
+ * c's connection broke.  if it had answered before, the server most
+ * likely closed a kept-alive connection with our pipelined requests
+ * unread, so they are sent again, as a browser would send them.  if
+ * it never answered, that is an error, and the connection is tried
+ * again later from run_worker
+ */
+static void broken(worker* w, client* c)
+{
+    if (c->inflight > 0 && c->nsent == c->inflight) {
+        w->err_read++;
+        w->unfinished += c->inflight;
+        c->inflight = 0;
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    reconnect(w, c);
+}
+
+
+static void try_write(worker* w, client* c)
+{
+    ssize_t n;
+
+    while (c->fd != -1 && c->outpos < c->outlen) {
+        n = write(c->fd, c->out + c->outpos, c->outlen - c->outpos);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == -1) {
+            broken(w, c);
+            return;
+        }
+        c->outpos += n;
+    }
+}
+
+
+/*
+ * the answer at the head of the fifo is complete
+ */
+static void answered(worker* w, client* c)
+{
+    pending* p = &c->fifo[c->head];
+    long long now = now_us();
+
+    hist_add(&w->service, now - p->sent, 1);
+    hist_add(&w->sched, now - p->due, 1);
+    if (recs != NULL)
+        hist_add(&w->handlers[recs[p->path].handler], now - p->due, 1);
+    w->requests++;
+    w->status[(c->status / 100) % 6]++;
+    c->head = (c->head + 1) % MAXDEPTH;
+    c->inflight--;
+    c->inbody = 0;
+}
+
+
+/*
+ * find "\r\n" in c->in from pos
+ *    rets: the offset of the \r, or -1
+ */
+static long find_crlf(client* c, size_t pos)
+{
+    char* p;
+
+    for (; pos + 1 < c->inlen; pos++) {
+        p = memchr(c->in + pos, '\r', c->inlen - pos - 1);
+        if (p == NULL)
+            return -1;
+        pos = p - c->in;
+        if (p[1] == '\n')
+            return pos;
+    }
+    return -1;
+}
+
+
+/*
+ * the status line and headers of an answer
+ *    rets: 1 when read, 0 if not all in yet, -1 if not HTTP
+ */
+static int take_header(client* c)
+{
+    size_t pos = c->inpos;
+    char *line, *val;
+    long end;
+
+    c->bodytype = BODY_EOF;
+    c->left = 0;
+    c->status = 0;
+    c->closing = 0;
+    while ((end = find_crlf(c, pos)) != -1) {
+        line = c->in + pos;
+        c->in[end] = '\0';
+        pos = end + 2;
+        if (c->status == 0) {
+            if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12)
+                return -1;
+            c->status = atoi(line + 9);
+            continue;
+        }
+        if (*line == '\0') {
+            if (c->status / 100 == 1 || c->status == 204 || c->status == 304
+                    || c->fifo[c->head].head_only) {
+                c->bodytype = BODY_LEN;     /* never a body */
+                c->left = 0;
+            }
+            c->inpos = pos;
+            c->inbody = 1;
+            c->chunkstate = CH_SIZE;
+            return 1;
+        }
+        if ((val = strchr(line, ':')) == NULL)
+            continue;
+        *val++ = '\0';
+        while (*val == ' ')
+            val++;
+        if (strcasecmp(line, "Content-Length") == 0) {
+            c->bodytype = BODY_LEN;
+            c->left = atoll(val);
+        } else if (strcasecmp(line, "Transfer-Encoding") == 0
+                   && strcasecmp(val, "chunked") == 0)
+            c->bodytype = BODY_CHUNKS;
+        else if (strcasecmp(line, "Connection") == 0
+                 && strcasecmp(val, "close") == 0)
+            c->closing = 1;
+    }
+    if (c->inlen - c->inpos == BUFLEN)
+        return -1;                  /* a header that fills the buffer */
+    return 0;
+}
+
+
+/*
+ * the body of the answer being read
+ *    rets: 1 when it is all in, 0 if more is to come, -1 if garbled
+ */
+static int take_body(client* c, int eof)
+{
+    size_t avail;
+    long end;
+
+    while (1) {
+        avail = c->inlen - c->inpos;
+        if (c->bodytype == BODY_EOF) {
+            c->inpos = c->inlen;
+            return eof;
+        }
+        if (c->bodytype == BODY_LEN || c->chunkstate == CH_DATA) {
+            if ((long long) avail < c->left) {
+                c->left -= avail;
+                c->inpos = c->inlen;
+                return 0;
+            }
+            c->inpos += c->left;
+            c->left = 0;
+            if (c->bodytype == BODY_LEN)
+                return 1;
+            c->chunkstate = CH_CRLF;
+            continue;
+        }
+        if (c->chunkstate == CH_CRLF) {
+            if (avail < 2)
+                return 0;
+            c->inpos += 2;
+            c->chunkstate = CH_SIZE;
+            continue;
+        }
+        if ((end = find_crlf(c, c->inpos)) == -1)
+            return (avail >= BUFLEN / 2) ? -1 : 0;
+        if (c->chunkstate == CH_SIZE) {
+            c->left = strtoll(c->in + c->inpos, NULL, 16);
+            c->chunkstate = c->left > 0 ? CH_DATA : CH_TRAILER;
+        } else if (end == (long) c->inpos) {
+            c->inpos = end + 2;     /* the empty line after the trailer */
+            return 1;
+        }
+        c->inpos = end + 2;
+    }
+}
+
+
+/*
+ * read what the server has sent and take the answers in it
+ */
+static void on_read(worker* w, client* c)
+{
+    ssize_t n;
+    int eof = 0, rv;
+
+    while (!eof) {
+        if (c->inpos > 0) {         /* keep the unparsed tail */
+            memmove(c->in, c->in + c->inpos, c->inlen - c->inpos);
+            c->inlen -= c->inpos;
+            c->inpos = 0;
+        }
+        n = read(c->fd, c->in + c->inlen, BUFLEN - c->inlen);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n == -1) {
+            broken(w, c);
+            return;
+        }
+        if (n == 0)
+            eof = 1;
+        else {
+            c->inlen += n;
+            w->bytes += n;
+        }
+        while (c->inflight > 0) {
+            rv = c->inbody ? 1 : take_header(c);
+            if (rv == 1)
+                rv = take_body(c, eof);
+            if (rv == -1) {
+                w->err_parse++;
+                w->unfinished += c->inflight;
+                c->inflight = 0;
+                reconnect(w, c);
+                return;
+            }
+            if (rv == 0)
+                break;
+            answered(w, c);
+            if (c->closing) {       /* the rest go on a new connection */
+                reconnect(w, c);
+                return;
+            }
+            fill(w, c);
+            try_write(w, c);
+        }
+    }
+    broken(w, c);
+}
+
+
+/*
+ * replay: on to the worker's next record, due when it came in, as
+ * sped up by -x; after the last one nothing is due again
+ */
+static void next_record(worker* w)
+{
+    w->recno += w->stride;
+    if (w->recno < nrecs)
+        w->due = started + (long long) (recs[w->recno].at / speed);
+    else
+        w->due = LLONG_MAX;
+}
+
+
+/*
+ * open loop: hand every request that is due to a connection with
+ * room for it; those that find none wait, and are timed from when
+ * they were due
+ */
+static void dispatch(worker* w, long long now)
+{
+    client* c;
+    int i;
+
+    while (w->due <= now && w->due < stop_at) {
+        for (i = 0; i < w->nclients; i++) {
+            c = &w->clients[(w->next + i) % w->nclients];
+            if (c->fd != -1 && c->inflight < depth
+                    && !(single && c->nsent > 0))
+                break;
+        }
+        if (i == w->nclients)
+            return;
+        w->next = (w->next + i + 1) % w->nclients;
+        if (recs != NULL) {
+            send_one(w, c, w->due, w->recno);
+            next_record(w);
+        } else {
+            send_one(w, c, w->due, next_path(w));
+            w->due += w->interval;
+        }
+        try_write(w, c);
+    }
+}
+
+
+static void* run_worker(void* arg)
+{
+    worker* w = arg;
+    struct epoll_event events[64];
+    long long now;
+    struct timespec ts;
+    long long timeout;
+    int i, n, busy;
+
+    if ((w->epfd = epoll_create1(0)) == -1)
+        oops("epoll_create1", 1);
+    w->due = now_us();
+    if (recs != NULL) {
+        w->recno -= w->stride;      /* so next_record lands on the first */
+        next_record(w);
+    }
+    for (i = 0; i < w->nclients; i++) {
+        w->clients[i].fd = -1;
+        reconnect(w, &w->clients[i]);
+    }
+
+    while ((now = now_us()) < drain_at) {
+        for (i = 0; now < stop_at && i < w->nclients; i++)
+            if (w->clients[i].fd == -1      /* failed; try again */
+                    && now - w->clients[i].opened >= RETRY_US)
+                reconnect(w, &w->clients[i]);
+        if (w->interval > 0)
+            dispatch(w, now);
+        if (now >= stop_at) {
+            for (busy = i = 0; i < w->nclients; i++)
+                busy += w->clients[i].inflight;
+            if (busy == 0)
+                break;
+        }
+        timeout = 100000;
+        if (w->interval > 0 && now < stop_at && w->due - now < timeout)
+            timeout = (w->due > now) ? w->due - now : 0;
+        ts.tv_sec = timeout / 1000000;
+        ts.tv_nsec = timeout % 1000000 * 1000;
+        n = epoll_pwait2(w->epfd, events, 64, &ts, NULL);
+        for (i = 0; i < n; i++) {
+            client* c = events[i].data.ptr;
+
+            if (events[i].events & EPOLLOUT)
+                try_write(w, c);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                on_read(w, c);
+        }
+    }
+    for (i = 0; i < w->nclients; i++) {
+        w->unfinished += w->clients[i].inflight;
+        if (w->clients[i].fd != -1)
+            close(w->clients[i].fd);
+    }
+    return NULL;
+}
+
+
+/* ------------------------------------------------------ *
+   setup and report
+   ------------------------------------------------------ */
+
+static void read_paths(char* file)
+{
+    FILE* fp = fopen(file, "r");
+    char line[REQLEN / 2];
+    char* p;
+
+    if (fp == NULL)
+        oops(file, 1);
+    while (npaths < MAXPATHS && fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        for (p = line; *p == ' ' || *p == '\t'; p++) {}
+        if (*p == '\0' || *p == '#')
+            continue;
+        if ((paths[npaths++] = strdup(p)) == NULL)
+            oops("strdup", 1);
+    }
+    fclose(fp);
+    if (npaths == 0) {
+        fprintf(stderr, "%s: no paths\n", file);
+        exit(1);
+    }
+}
+
+
+static int by_arrival(const void* a, const void* b)
+{
+    long long x = ((record*) a)->at, y = ((record*) b)->at;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * read_capture -- load the records of a capture file, in the order
+ * they came in (the processes that wrote them may have raced), with
+ * times from the first
+ */
+static void read_capture(char* file)
+{
+    FILE* fp = fopen(file, "r");
+    char *buf, *p, *end;
+    long size;
+    int64_t at;
+    uint16_t len, handler;
+    int i, max = 0;
+
+    if (fp == NULL)
+        oops(file, 1);
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    if ((buf = malloc(size)) == NULL)
+        oops("malloc", 1);
+    if (fread(buf, 1, size, fp) != (size_t) size
+            || size < CAP_MAGICLEN || memcmp(buf, CAP_MAGIC, CAP_MAGICLEN)) {
+        fprintf(stderr, "%s: not a wsng capture\n", file);
+        exit(1);
+    }
+    fclose(fp);
+    end = buf + size;
+    for (p = buf + CAP_MAGICLEN; p + CAP_HDRLEN <= end; p += CAP_HDRLEN + len) {
+        memcpy(&at, p, 8);
+        memcpy(&len, p + 8, 2);
+        memcpy(&handler, p + 10, 2);
+        if (p + CAP_HDRLEN + len > end)
+            break;                  /* cut short while being written */
+        if (nrecs == max) {
+            max = max ? 2 * max : 1024;
+            if ((recs = realloc(recs, max * sizeof(record))) == NULL)
+                oops("realloc", 1);
+        }
+        recs[nrecs].at = at;
+        recs[nrecs].rq = p + CAP_HDRLEN;
+        recs[nrecs].len = len;
+        recs[nrecs++].handler = handler < ST_NHANDLERS ? handler : ST_CAT;
+    }
+    if (nrecs == 0) {
+        fprintf(stderr, "%s: no requests\n", file);
+        exit(1);
+    }
+    qsort(recs, nrecs, sizeof(record), by_arrival);
+    for (i = nrecs - 1; i >= 0; i--)
+        recs[i].at -= recs[0].at;
+}
+
+
+static void print_hist(char* name, hist* h)
+{
+    printf("  %-10s %9lld %9lld %9lld %9lld %9lld %9.0f\n", name,
+           hist_pct(h, 500), hist_pct(h, 900), hist_pct(h, 990),
+           hist_pct(h, 999), h->max, h->n ? h->sum / h->n : 0.0);
+}
+
+
+/*
+ * a replay's latencies for each handler, timed from when the request
+ * was due
+ */
+static void print_handlers(hist* h)
+{
+    static char* names[ST_NHANDLERS] = {
+        "cat", "ls", "exec", "status", "400", "404", "500", "501", "503"
+    };
+    int i;
+
+    printf("by handler (us)  p50       p90       p99      p99.9       "
+           "max      mean   requests\n");
+    for (i = 0; i < ST_NHANDLERS; i++) {
+        if (h[i].n == 0)
+            continue;
+        printf("  %-10s %9lld %9lld %9lld %9lld %9lld %9.0f %10lu\n",
+               names[i], hist_pct(&h[i], 500), hist_pct(&h[i], 900),
+               hist_pct(&h[i], 990), hist_pct(&h[i], 999), h[i].max,
+               h[i].sum / h[i].n, h[i].n);
+    }
+}
+
+
+static void usage(char* prog)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-c conns] [-d secs] "
+            "[-r rate] [-p depth] [-s] [-f pathfile | -R capture [-x speed]] "
+            "host port [path]\n", prog);
+    exit(1);
+}
+
+
+int main(int ac, char* av[])
+{
+    int nthreads = 1, nconns = 10, secs = 0, opt, i, j, per;
+    long rate = 0;
+    worker *w, total;
+    hist corrected;
+    long long start, elapsed;
+    char *pathfile = NULL, *capfile = NULL;
+
+    while ((opt = getopt(ac, av, "t:c:d:r:p:sf:R:x:")) != -1) {
+        switch (opt) {
+        case 't':   nthreads = atoi(optarg);    break;
+        case 'c':   nconns = atoi(optarg);      break;
+        case 'd':   secs = atoi(optarg);        break;
+        case 'r':   rate = atol(optarg);        break;
+        case 'p':   depth = atoi(optarg);       break;
+        case 's':   single = 1;                 break;
+        case 'f':   pathfile = optarg;          break;
+        case 'R':   capfile = optarg;           break;
+        case 'x':   speed = atof(optarg);       break;
+        default:    usage(av[0]);
+        }
+    }
+    if (ac - optind < 2 || nthreads < 1 || nconns < 1 || secs < 0
+            || rate < 0 || depth < 1 || depth > MAXDEPTH || speed <= 0
+            || (capfile != NULL && (pathfile != NULL || rate > 0)))
+        usage(av[0]);
+    if (nthreads > nconns)
+        nthreads = nconns;
+    if (single)
+        depth = 1;
+    hostname = av[optind];
+    if (make_server_address(hostname, atoi(av[optind + 1]), &server) == -1) {
+        fprintf(stderr, "%s: unknown host\n", hostname);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);       /* a closed connection is an error */
+    if (capfile != NULL) {
+        read_capture(capfile);
+        if (secs == 0)              /* the whole capture, and a second */
+            secs = recs[nrecs - 1].at / speed / 1000000 + 1;
+    } else if (pathfile != NULL)
+        read_paths(pathfile);
+    else
+        paths[npaths++] = (ac - optind > 2) ? av[optind + 2] : "/";
+    if (secs == 0)
+        secs = 10;
+
+    w = calloc(nthreads, sizeof(worker));
+    if (w == NULL)
+        oops("calloc", 1);
+    start = started = now_us();
+    stop_at = start + secs * 1000000LL;
+    drain_at = stop_at + DRAIN_SECS * 1000000LL;
+    for (i = j = 0; i < nthreads; i++, j += per) {
+        per = nconns / nthreads + (i < nconns % nthreads);
+        w[i].nclients = per;
+        if ((w[i].clients = calloc(per, sizeof(client))) == NULL)
+            oops("calloc", 1);
+        w[i].pathno = npaths ? j % npaths : 0;
+        w[i].recno = i;             /* replay: every nthreads'th record */
+        w[i].stride = nthreads;
+        if (capfile != NULL)
+            w[i].interval = 1;      /* an open loop; records say when */
+        if (rate > 0)
+            w[i].interval = 1000000LL * nthreads / rate;
+        if (rate > 0 && w[i].interval == 0)
+            w[i].interval = 1;
+        if (pthread_create(&w[i].tid, NULL, run_worker, &w[i]) != 0)
+            oops("pthread_create", 1);
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        hist_merge(&total.service, &w[i].service);
+        hist_merge(&total.sched, &w[i].sched);
+        total.requests += w[i].requests;
+        total.bytes += w[i].bytes;
+        for (j = 0; j < 6; j++)
+            total.status[j] += w[i].status[j];
+        for (j = 0; j < ST_NHANDLERS; j++)
+            hist_merge(&total.handlers[j], &w[i].handlers[j]);
+        total.err_connect += w[i].err_connect;
+        total.err_read += w[i].err_read;
+        total.err_parse += w[i].err_parse;
+        total.reconnects += w[i].reconnects;
+        total.unfinished += w[i].unfinished;
+    }
+    elapsed = now_us() - start;
+    if (elapsed > secs * 1000000LL)
+        elapsed = secs * 1000000LL; /* the drain sends nothing new */
+
+    printf("%d s, %d threads, %d connections, %s loop", secs, nthreads,
+           nconns, rate || capfile ? "open" : "closed");
+    if (rate)
+        printf(" at %ld/s", rate);
+    if (capfile)
+        printf(" replaying %d requests at %gx", nrecs, speed);
+    printf(", pipeline %d, %s\n", depth,
+           single ? "a connection per request" : "keep-alive");
+    printf("requests: %lu, %.1f/s; %.2f MB read, %.2f MB/s\n",
+           total.requests, total.requests * 1e6 / elapsed,
+           total.bytes / 1e6, total.bytes / (elapsed / 1e6) / 1e6);
+    printf("status: 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n",
+           total.status[2], total.status[3], total.status[4],
+           total.status[5], total.status[0] + total.status[1]);
+    printf("errors: connect %lu, read %lu, bad answer %lu, unanswered %lu;"
+           " reconnects %lu\n", total.err_connect, total.err_read,
+           total.err_parse, total.unfinished, total.reconnects);
+    printf("latency (us)     p50       p90       p99      p99.9       "
+           "max      mean\n");
+    print_hist("service", &total.service);
+    if (rate || capfile)
+        print_hist("corrected", &total.sched);
+    else {
+        memset(&corrected, 0, sizeof(corrected));
+        hist_correct(&corrected, &total.service, total.service.n ?
+                     (long long) (total.service.sum / total.service.n) : 0);
+        print_hist("corrected", &corrected);
+    }
+    if (capfile)
+        print_handlers(total.handlers);
+    return 0;
+}
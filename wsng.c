@@ -1,3 +1,4 @@
+#include    <ctype.h>
 #include    <dirent.h>
 #include    <stdio.h>
 #include    <stdlib.h>
@@ -5,24 +6,62 @@
 #include    <string.h>
 #include    <netdb.h>
 #include    <errno.h>
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <poll.h>
+#include    <arpa/inet.h>
 #include    <signal.h>
 #include    <sys/param.h>
+#include    <sys/socket.h>
 #include    <sys/stat.h>
 #include    <sys/time.h>
 #include    <sys/types.h>
 #include    <sys/wait.h>
 #include    <time.h>
 #include    <unistd.h>
-#include    "socklib.h"
+#include    "accesslog.h"
+#include    "capture.h"
+#include    "cgiexec.h"
+#include    "cgipool.h"
+#include    "evloop.h"
+#include    "filecache.h"
+#include    "listener.h"
+#include    "lscache.h"
+#include    "mime.h"
+#include    "prefork.h"
+#include    "range.h"
+#include    "shed.h"
+#include    "statcache.h"
+#include    "stats.h"
+#include    "threaded.h"
+#include    "trace.h"
+#include    "web-time.h"
+#include    "wsng.h"
 #include    "wsng_util.h"
 
 /*
  * ws.c - a web server
  *
  *    usage: ws [ -c configfilenmame ]
- * features: supports the GET command only
+ * features: supports the GET and HEAD commands
+ *           keeps HTTP/1.1 connections open and answers
+ *           pipelined requests in one write
+ *           relays cgi output through a pipe, in chunks for
+ *           HTTP/1.1, and stops programs that run too long
+ *           reports counters, latencies and listen queue
+ *           overflows at /server-status
+ *           answers 503 when it falls behind, cgi requests first
+ *           keeps an access log, written by a background thread
  *           runs in the current directory
- *           forks a new child to handle each request
+ *           forks a new child to handle each request, or with
+ *           "server_mode epoll" serves all of them from one
+ *           process using an epoll event loop (see evloop.c),
+ *           or with "server_mode prefork" runs that loop in a
+ *           pool of worker processes (see prefork.c); with
+ *           "io_uring on" that loop runs on io_uring (see uring.c);
+ *           or with "server_mode threads" serves them from a
+ *           pool of threads that steal work from each other
+ *           (see threaded.c)
  *           needs many additional features
  *
  *  compile: cc ws.c socklib.c -o ws
@@ -37,166 +76,218 @@
 #define SERVER_ROOT "."
 #define CONFIG_FILE "wsng.conf"
 #define VERSION     "1"
-#define MAX_RQ_LEN  4096
 #define LINELEN     1024
 #define PARAM_LEN   128
 #define VALUE_LEN   512
 #define MAXVARS     2
+#define INLINE_MAX  8192        /* smaller files are copied into the
+                                   reply so pipelined replies batch */
+#define CGI_READLEN 16384       /* cgi output relayed per read       */
+#define CGI_HEADMAX 8192        /* longest cgi header we will take   */
 
 char myhost[MAXHOSTNAMELEN];
 int myport;
-char* full_hostname();
-
-
-typedef struct content_type {
-    char* ext;
-    char* content;
-    struct content_type* next;
-} content_type;
-
-content_type* head = NULL;
+int server_mode = MODE_FORK;
+int num_workers = 0;            /* prefork, threads; 0: one per cpu  */
+int keepalive_timeout = 5;      /* seconds an idle connection stays  */
+int keepalive_requests = 100;   /* requests per connection, at most  */
+int max_request_header = CONN_MAXHEAD;  /* bytes of line and headers */
+int header_timeout = 20;        /* seconds to send a request's headers */
+int send_timeout = 30;          /* seconds a reply may stall; and    */
+int min_send_rate = 0;          /*   bytes/second it must average    */
+int stat_cache_ttl = 1;         /* seconds; 0 turns the cache off    */
+int ls_cache_ttl = 10;          /* same for directory listings       */
+long cache_size = 16 << 20;     /* bytes of hot files kept in memory */
+int cgi_timeout = 60;           /* seconds a cgi program may run     */
+int cgi_idle_timeout = 20;      /* seconds it may go without output  */
+char* status_path = "server-status";    /* NULL: no status page      */
+int use_io_uring = 0;           /* epoll and prefork loops; see uring.c */
+int listen_backlog = SOMAXCONN; /* calls waiting to be accepted      */
+int tcp_nodelay = 0;            /* the rest are off at 0; see        */
+int tcp_defer_accept = 0;       /*   listener.c                      */
+int tcp_fastopen = 0;
+int so_rcvbuf = 0;
+int so_sndbuf = 0;
+int busy_poll = 0;
+int shed_active = 0;            /* load shedding limits, 0 is off;   */
+int shed_queue = 0;             /*   see shed.c                      */
+int shed_target = 0;            /* milliseconds                      */
+int shed_interval = 100;        /* milliseconds                      */
+int retry_after = 1;            /* seconds, in the 503               */
+char* full_hostname(char* fullname);
+char* header_prefix(int* lenp);
 
 #define oops(m,x) {perror(m); exit(x);}
 
+/* an event loop runs the connections, and watches cgi pipes and
+   pool workers for them; the other modes wait on each connection */
+#define LOOPED  (server_mode == MODE_EPOLL || server_mode == MODE_PREFORK)
+
 /*
  * prototypes
  */
 
 int     startup(int, char* a[], char[], int*);
-void    read_til_crnl(FILE *);
-void    process_rq(char*, FILE*);
-void    bad_request(FILE*);
-void    cannot_do(FILE* fp);
-void    do_404(char* item, FILE* fp);
-void    do_500(char* item, FILE* fp);
-void    do_cat(char* f, FILE* fpsock);
-void    do_exec(char* prog, FILE* fp);
-void    do_ls(char* dir, FILE* fp);
+void    bad_request(connection* c);
+void    too_big(connection* c);
+void    cannot_do(connection* c);
+void    do_404(char* item, connection* c);
+void    do_500(char* item, connection* c);
+void    do_cat(char* f, stat_entry* e, connection* c);
+void    do_exec(char* prog, connection* c);
+void    do_pooled(char* prog, connection* c);
+void    do_status(connection* c);
+void    do_503(connection* c);
+void    cgi_reply(connection* c, char* out, size_t len);
+int     cgi_relay(connection* c);
+int     cgi_head(connection* c, char* buf, size_t len);
+size_t  head_end(char* s, size_t len);
+void    put_chunk(connection* c, char* buf, size_t len);
+int     cgi_done(connection* c);
+time_t  cgi_deadline(connection* c);
+int     conn_wait(connection* c, int events);
+void    bad_gateway(connection* c);
+void    gateway_timeout(connection* c);
+int     next_request(connection* c);
+void    do_ranges(stat_entry* e, char* content, byterange* r, int n,
+                  connection* c);
+void    do_416(off_t size, connection* c);
+int     etag_match(slice* list, char* tag);
+int     pipelined(connection* c);
+long    parse_size(char* val);
+int     not_modified(stat_entry* e, connection* c);
+int     if_range(stat_entry* e, connection* c);
+void    do_ls(char* dir, connection* c);
+void    list_dir(char* dir, char** textp, size_t* lenp);
 int     ends_in_cgi(char* f);
 int     ends_in_html(char* f);
 
 char*   file_type(char* f);
-void    header(FILE* fp, int code, char* msg, char* content_type);
-int     isadir(char* f);
-char*   modify_argument(char* arg, int len);
-int     not_exist(char* f);
-int     no_access(char* f);
+void    header(connection* c, int code, char* msg, char* content_type);
+void    end_reply(connection* c);
+void    log_reply(connection* c, off_t bytes);
+int     isadir(stat_entry* e);
+int     not_exist(stat_entry* e);
+int     no_access(stat_entry* e);
 void    fatal(char*, char*);
+void    accept_calls(int);
 void    handle_call(int);
-int     read_request(FILE*, char*, int);
-char*   readline(char*, int, FILE*);
-void    free_table(content_type*);
 char*   check_if_index(char* dir);
-char*   query_string(char* f);
 
 
 
 int main(int ac, char* av[])
 {
-    int sock, fd;
+    int sock;
 
     sock = startup(ac, av, myhost, &myport);
 
     printf("wsng%s started.  host=%s port=%d\n", VERSION, myhost, myport);
 
+    if (server_mode == MODE_EPOLL)
+        run_event_loop(sock);
+    if (server_mode == MODE_PREFORK)
+        run_prefork(myport, num_workers);
+    if (server_mode == MODE_THREADS)
+        run_threaded(sock, num_workers);
+
+    accept_calls(sock);
+    return 0;
+}
+
+
+/*
+ * accept_calls(sock) - fork mode: take calls and hand each to a child
+ *    note: the children are reaped as they exit; SIGCHLD arrives on
+ *          a signalfd polled along with the socket.  the socket is
+ *          non-blocking, so each wakeup takes every call queued.
+ *          calls past the shed limits are refused here, not forked
+ */
+void accept_calls(int sock)
+{
+    struct pollfd pfd[2];
+    int fd;
+
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1)
+        oops("fcntl", 2);
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = cgiexec_sigfd();
+    pfd[1].events = POLLIN;
+
     while (1) {
-        fd = accept(sock, NULL, NULL); /* take a call  */
-        if (fd == -1)
+        if (poll(pfd, 2, pfd[1].fd == -1 ? 1000 : -1) == -1) {
+            if (errno != EINTR)
+                perror("poll");
+            continue;
+        }
+        if (pfd[1].fd == -1 || pfd[1].revents)
+            cgiexec_reap(pfd[1].fd);
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        while ((fd = accept(sock, NULL, NULL)) != -1) {
+            shed_backlog(sock);
+            if (shed_check(0))
+                shed_refuse(fd);       /* no child for it */
+            else
+                handle_call(fd);       /* handle call  */
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             perror("accept");
-        else
-            handle_call(fd);           /* handle call  */
     }
-    free_table(head);
-    return 0;
 }
 
 
 /*
- * handle_call(fd) - serve the request arriving on fd
- * summary: fork, then get request, then process request
+ * handle_call(fd) - serve the requests arriving on fd
+ * summary: fork, then get requests, then process them until the
+ *          client is done or misses a deadline (see conn_deadline)
  *    rets: child exits with 1 for error, 0 for ok
- *    note: closes fd in parent
+ *    note: closes fd in parent; the child's own children (cgi
+ *          programs) are reaped by the kernel
  */
 void handle_call(int fd)
 {
     int pid = fork();
-    FILE *fpin, *fpout;
-    char request[MAX_RQ_LEN];
+    connection *c;
+    int rv;
 
     if (pid == -1) {
         perror("fork");
         return;
     }
-    /* child: buffer socket and talk with client */
+    /* child: talk with client */
     if (pid == 0) {
-        fpin = fdopen(fd, "r");
-        fpout = fdopen(fd, "w");
-        if (fpin == NULL || fpout == NULL)
-            exit(1);
-
-        if (read_request(fpin, request, MAX_RQ_LEN) == -1)
+        signal(SIGCHLD, SIG_IGN);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if ((c = conn_new(fd)) == NULL || conn_set_blocking(c, 0) == -1)
             exit(1);
-        printf("got a call: request = %s", request);
 
-        process_rq(request, fpout);
-        fflush(fpout);      /* send data to client   */
+        while (1) {
+            if (c->state == CS_READ) {
+                rv = conn_read(c);
+                if (rv == CONN_AGAIN && conn_wait(c, POLLIN) == CONN_OK)
+                    continue;
+                if (rv != CONN_OK)
+                    break;
+            }
+            if (c->state == CS_PARSE)
+                serve_pending(c);
+            if (c->state == CS_CGI && cgi_wait(c) != CONN_OK)
+                break;
+            if (send_reply(c) != CONN_OK || !c->keepalive)
+                break;      /* send data to client   */
+            conn_reset(c);
+        }
+        conn_free(c);
+        accesslog_close();
         exit(0);            /* child is done         */
     }
     /* parent: close fd and return to take next call */
-    waitpid(pid, NULL, WNOHANG);
     close(fd);
 }
 
 
-/*
- * read the http request into rq not to exceed rqlen
- * return -1 for error, 0 for success
- */
-int read_request(FILE *fp, char rq[], int rqlen)
-{
-    /* null means EOF or error. Either way there is no request */
-    if (readline(rq, rqlen, fp) == NULL)
-        return -1;
-    read_til_crnl(fp);
-    return 0;
-}
-
-
-void read_til_crnl(FILE *fp)
-{
-    char buf[MAX_RQ_LEN];
-
-    while (readline(buf, MAX_RQ_LEN, fp) != NULL && strcmp(buf, "\r\n") != 0) {}
-}
-
-
-/*
- * readline -- read in a line from fp, stop at \n
- *    args: buf - place to store line
- *          len - size of buffer
- *          fp  - input stream
- *    rets: NULL at EOF else the buffer
- *    note: will not overflow buffer, but will read until \n or EOF
- *          thus will lose data if line exceeds len-2 chars
- *    note: like fgets but will always read until \n even if it loses data
- */
-char *readline(char *buf, int len, FILE *fp)
-{
-    int space = len - 2;
-    char *cp = buf;
-    int c;
-
-    while ((c = getc(fp)) != '\n' && c != EOF) {
-        if (space-- > 0)
-            *cp++ = c;
-    }
-    if (c == '\n')
-        *cp++ = c;
-    *cp = '\0';
-    return (c == EOF && cp == buf ? NULL : buf);
-}
-
-
 /*
  * initialization function
  *  1. process command line args
@@ -204,13 +295,13 @@ char *readline(char *buf, int len, FILE *fp)
  *  2. open config file
  *      read rootdir, port
  *  3. chdir to rootdir
- *  4. open a socket on port
+ *  4. open a socket on port (prefork mode: the workers do that)
  *  5. gets the hostname
  *  6. return the socket
  *       later, it might set up logfiles, check config files,
  *         arrange to handle signals
  *
- *  returns: socket as the return value
+ *  returns: socket as the return value, -1 in prefork mode
  *       the host by writing it into host[]
  *       the port by writing it into *portnump
  */
@@ -232,61 +323,58 @@ int startup(int ac, char *av[], char host[], int *portnump)
     }
     process_config_file(configfile, &portnum);
 
-    sock = make_server_socket(portnum);
-    if (sock == -1)
+    if (num_workers <= 0)
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers <= 0)
+        num_workers = 1;
+    if (server_mode == MODE_PREFORK)
+        sock = -1;
+    else if ((sock = listener_open(portnum, 0)) == -1)
         oops("making socket", 2);
-    strcpy(myhost, full_hostname());
+    stats_init(server_mode == MODE_PREFORK ? num_workers + 1 : 1);
+    full_hostname(myhost);
     *portnump = portnum;
     return sock;
 }
 
-/* ------------------------------------------------------ *
-   Data structure to manage different file types defined in
-   wsng.conf.
-   ------------------------------------------------------ */
-
-content_type* init_type(content_type* head, char* ext, char* content) {
-    content_type *newtype = (content_type*)malloc(sizeof(content_type));
-    if (newtype != NULL) {
-        newtype->ext = ext;
-        newtype->content = content;
-        newtype->next = NULL;
-    }
-
-    return newtype;
-}
-
-
-content_type* push_type(content_type* table, char* ext, char* content) {
-    content_type* curr;
-    curr = head;
-    while (curr->next != NULL)
-        curr = curr->next;
-
-    content_type* newtype = init_type(NULL, ext, content);
-    curr->next = newtype;
-    return head;
-}
-
-
-void free_table(content_type* head) {
-    content_type* curr, *tmp;
-    curr = head;
-    while (curr->next != NULL) {
-        tmp = curr;
-        curr = curr->next;
-        free(tmp);
-    }
-}
-
-
 /*
  * opens file or dies
  * reads file for lines with the format
  *   port ###
  *   server_root path
+ *   server_mode fork|epoll|prefork|threads
+ *   workers ###
+ *   keepalive_timeout seconds
+ *   keepalive_requests ###
+ *   max_request_header bytes   (k as for cache_size)
+ *   header_timeout seconds
+ *   send_timeout seconds
+ *   min_send_rate bytes
+ *   type extension content/type
+ *   stat_cache_ttl seconds
+ *   ls_cache_ttl seconds
+ *   cache_size bytes   (a k, m or g after the number scales it)
+ *   cgi_pool script ###
+ *   cgi_max_requests ###
+ *   cgi_timeout seconds
+ *   cgi_idle_timeout seconds
+ *   server_status path|off
+ *   access_log path|off [common|combined]
+ *   trace_file path [###]  (one request in ### is traced; 100)
+ *   capture_file path      (every request, for wsbench -R)
+ *   io_uring on|off
+ *   listen_backlog ###
+ *   tcp_nodelay on|off
+ *   tcp_defer_accept seconds
+ *   tcp_fastopen ###
+ *   so_rcvbuf bytes, so_sndbuf bytes   (k, m or g as for cache_size)
+ *   busy_poll microseconds
+ *   shed_active ###, shed_queue ###
+ *   shed_target ms, shed_interval ms
+ *   retry_after seconds
  * at the end, return the portnum by loading *portnump
- * and chdir to the rootdir
+ * and chdir to the rootdir.  the type lines are compiled into
+ * the lookup table used by do_cat (see mime.c)
  */
 void process_config_file(char *conf_file, int *portnump)
 {
@@ -295,6 +383,11 @@ void process_config_file(char *conf_file, int *portnump)
     char param[PARAM_LEN];
     char val1[VALUE_LEN];
     char val2[VALUE_LEN];
+    char logfile[VALUE_LEN] = "-";
+    int logformat = LOG_COMBINED;
+    char tracefile[VALUE_LEN] = "";
+    int trace_sample = 100;
+    char capfile[VALUE_LEN] = "";
     int port;
     int read_param(FILE *, char *, int, char *, int, char*);
 
@@ -302,10 +395,6 @@ void process_config_file(char *conf_file, int *portnump)
     if ((fp = fopen(conf_file, "r")) == NULL)
         fatal("Cannot open config file %s", conf_file);
 
-    content_type* table;
-    table = init_type(head, "DEFAULT", "text/plain");
-    head = table;
-
     /* extract the settings */
     while (read_param(fp, param, PARAM_LEN, val1, VALUE_LEN, val2) != EOF) {
         if (strcasecmp(param, "server_root") == 0)
@@ -315,16 +404,135 @@ void process_config_file(char *conf_file, int *portnump)
             port = atoi(val1);
 
         if (strcasecmp(param, "type") == 0)
-            table = push_type(table, val1, val2);
-    }
-    content_type* ptr;
-    ptr = head;
-    while (ptr->next != NULL) {
-        ptr = ptr->next;
-    }
+            mime_add(val1, val2);
+
+        if (strcasecmp(param, "server_mode") == 0) {
+            if (strcasecmp(val1, "epoll") == 0)
+                server_mode = MODE_EPOLL;
+            else if (strcasecmp(val1, "prefork") == 0)
+                server_mode = MODE_PREFORK;
+            else if (strcasecmp(val1, "threads") == 0)
+                server_mode = MODE_THREADS;
+            else if (strcasecmp(val1, "fork") == 0)
+                server_mode = MODE_FORK;
+            else
+                fatal("unknown server_mode %s\n", val1);
+        }
+
+        if (strcasecmp(param, "workers") == 0)
+            num_workers = atoi(val1);
+
+        if (strcasecmp(param, "keepalive_timeout") == 0)
+            keepalive_timeout = atoi(val1);
+
+        if (strcasecmp(param, "keepalive_requests") == 0)
+            keepalive_requests = atoi(val1);
+
+        if (strcasecmp(param, "max_request_header") == 0)
+            max_request_header = parse_size(val1);
+
+        if (strcasecmp(param, "header_timeout") == 0)
+            header_timeout = atoi(val1);
+
+        if (strcasecmp(param, "send_timeout") == 0)
+            send_timeout = atoi(val1);
+
+        if (strcasecmp(param, "min_send_rate") == 0)
+            min_send_rate = parse_size(val1);
+
+        if (strcasecmp(param, "stat_cache_ttl") == 0)
+            stat_cache_ttl = atoi(val1);
+
+        if (strcasecmp(param, "ls_cache_ttl") == 0)
+            ls_cache_ttl = atoi(val1);
+
+        if (strcasecmp(param, "cache_size") == 0)
+            cache_size = parse_size(val1);
+
+        if (strcasecmp(param, "cgi_pool") == 0)
+            cgipool_add(val1, atoi(val2));
+
+        if (strcasecmp(param, "cgi_max_requests") == 0)
+            cgi_max_requests = atoi(val1);
+
+        if (strcasecmp(param, "cgi_timeout") == 0)
+            cgi_timeout = atoi(val1);
+
+        if (strcasecmp(param, "cgi_idle_timeout") == 0)
+            cgi_idle_timeout = atoi(val1);
+
+        if (strcasecmp(param, "server_status") == 0) {
+            if (strcasecmp(val1, "off") == 0)
+                status_path = NULL;
+            else
+                status_path = strdup(val1 + (*val1 == '/'));
+        }
+
+        if (strcasecmp(param, "io_uring") == 0)
+            use_io_uring = (strcasecmp(val1, "on") == 0);
+
+        if (strcasecmp(param, "listen_backlog") == 0)
+            listen_backlog = atoi(val1);
+
+        if (strcasecmp(param, "tcp_nodelay") == 0)
+            tcp_nodelay = (strcasecmp(val1, "on") == 0);
+
+        if (strcasecmp(param, "tcp_defer_accept") == 0)
+            tcp_defer_accept = atoi(val1);
+
+        if (strcasecmp(param, "tcp_fastopen") == 0)
+            tcp_fastopen = atoi(val1);
+
+        if (strcasecmp(param, "so_rcvbuf") == 0)
+            so_rcvbuf = parse_size(val1);
+
+        if (strcasecmp(param, "so_sndbuf") == 0)
+            so_sndbuf = parse_size(val1);
+
+        if (strcasecmp(param, "busy_poll") == 0)
+            busy_poll = atoi(val1);
+
+        if (strcasecmp(param, "shed_active") == 0)
+            shed_active = atoi(val1);
+
+        if (strcasecmp(param, "shed_queue") == 0)
+            shed_queue = atoi(val1);
+
+        if (strcasecmp(param, "shed_target") == 0)
+            shed_target = atoi(val1);
+
+        if (strcasecmp(param, "shed_interval") == 0)
+            shed_interval = atoi(val1);
+
+        if (strcasecmp(param, "retry_after") == 0)
+            retry_after = atoi(val1);
+
+        if (strcasecmp(param, "access_log") == 0) {
+            strcpy(logfile, val1);
+            if (strcasecmp(val2, "common") == 0)
+                logformat = LOG_COMMON;
+        }
 
+        if (strcasecmp(param, "trace_file") == 0) {
+            strcpy(tracefile, val1);
+            if (val2[0] != '\0')
+                trace_sample = atoi(val2);
+        }
+
+        if (strcasecmp(param, "capture_file") == 0)
+            strcpy(capfile, val1);
+    }
     fclose(fp);
+    mime_build();
+    shed_init();
+    conn_init(max_request_header);
     /* act on the settings */
+    if (strcasecmp(logfile, "off") != 0)
+        accesslog_open(logfile, logformat, server_mode != MODE_FORK);
+    if (tracefile[0] != '\0' && strcasecmp(tracefile, "off") != 0)
+        trace_open(tracefile, trace_sample);
+    if (capfile[0] != '\0' && strcasecmp(capfile, "off") != 0)
+        capture_open(capfile);
     if (chdir(rootdir) == -1)
         oops("cannot change to rootdir", 2);
     *portnump = port;
@@ -354,6 +562,7 @@ int read_param(FILE *fp, char *name, int nlen, char* val1, int vlen, char* val2)
         if (line[strlen(line)-1] != '\n')
             while ((c = getc(fp)) != '\n' && c != EOF) {}
 
+        *val2 = '\0';              /* it may not be there */
         int nval = sscanf(line, fmt, name, val1, val2);
         if ((nval == 2 || nval == 3) && *name != '#')
             return 1;
@@ -363,237 +572,689 @@ int read_param(FILE *fp, char *name, int nlen, char* val1, int vlen, char* val2)
 
 
 
+/*
+ * parse_size -- a byte count, with an optional k, m or g after it
+ */
+long parse_size(char *val)
+{
+    char    *end;
+    long    n = strtol(val, &end, 10);
+
+    switch (*end) {
+    case 'g': case 'G':     n <<= 10;   /* fall through */
+    case 'm': case 'M':     n <<= 10;   /* fall through */
+    case 'k': case 'K':     n <<= 10;
+    }
+    return n < 0 ? 0 : n;
+}
+
+
 /* ------------------------------------------------------ *
-   process_rq( char *rq, FILE *fpout)
-   do what the request asks for and write reply to fp
-   rq is HTTP command:  GET /foo/bar.html HTTP/1.0
+   serve_pending(c)
+   answer every complete request waiting in c->inbuf.
+   the replies collect on c->out; stop early when one of
+   them needs a file body sent after it, when a cgi
+   program has to answer first, or when the
+   connection is not going to be kept open.
+   a request being captured is copied first, as process_rq
+   rewrites its path in place, and stamped with c->t_begin,
+   the time of its first byte.
    ------------------------------------------------------ */
-void process_rq(char *rq, FILE *fp)
+void serve_pending(connection *c)
 {
-    char    cmd[MAX_RQ_LEN], arg[MAX_RQ_LEN];
-    char    *item, *modify_argument();
+    request *rq = &c->rq;
+    char    *raw = NULL;
+    int     rawlen;
+
+    do {
+        c->targetlen = MIN(rq->target.len, CONN_TARGETLEN);
+        memcpy(c->target, rq->target.ptr, c->targetlen);
+        c->keepalive = (rq->result == RQ_DONE) && wants_keepalive(c);
+
+        rawlen = (capturing() && rq->result == RQ_DONE) ? rq->length : 0;
+        if (rawlen > 0 && (raw = malloc(rawlen)) != NULL)
+            memcpy(raw, c->inbuf, rawlen);
+        process_rq(c);
+        if (raw != NULL) {
+            capture_write(c->t_begin, raw, rawlen, c->handler);
+            free(raw);
+            raw = NULL;
+        }
+        if (c->state == CS_CGI)     /* see cgi_continue */
+            return;
+        end_reply(c);
+    } while (next_request(c));
+}
 
-    if (sscanf(rq, "%s%s", cmd, arg) != 2) {
-        bad_request(fp);
-        return;
-    }
 
-    item = query_string(modify_argument(arg, MAX_RQ_LEN));
-    if (strcmp(cmd, "HEAD") == 0)
-        header(fp, 200, "OK", "text/plain");
-    else if (strcmp(cmd, "GET") != 0)
-        cannot_do(fp);
-    else if (not_exist(item))
-        do_404(item, fp);
-    else if (no_access(item) == -1)
-        do_500(item, fp);
-    else if (isadir(item))
-        do_ls(item, fp);
-    else if (ends_in_cgi(item))
-        do_exec(item, fp);
+/*
+ * next_request -- the reply is on c->out; go on to the next request
+ *    rets: 1 if it is in and may be answered before the reply goes
+ */
+int next_request(connection *c)
+{
+    return conn_next_request(c) && c->keepalive && c->bodyfd == -1
+           && c->bodyfc == NULL;
+}
+
+
+/*
+ * cgi_continue -- move a cgi request along
+ *    rets: CONN_AGAIN while the program is busy, CONN_ERR if the
+ *          client has gone; otherwise its reply, and those to any
+ *          requests that were waiting behind it, are on c->out
+ */
+int cgi_continue(connection *c)
+{
+    int rv;
+
+    if (c->proc != NULL)
+        return cgi_relay(c);
+    if ((rv = cgipool_step(c->cgi)) == CGI_AGAIN)
+        return CONN_AGAIN;
+    if (rv == CGI_DONE)
+        cgi_reply(c, c->cgi->out, c->cgi->outlen);
     else
-        do_cat(item, fp);
+        bad_gateway(c);
+    end_reply(c);                   /* before the job, which holds   */
+    cgipool_release(c->cgi);        /* the text of the status line   */
+    c->cgi = NULL;
+    return cgi_done(c);
 }
 
 
 /*
- * modify_argument
- *  purpose: many roles
- *      security - remove all ".." components in paths
- *      cleaning - if arg is "/" convert to "."
- *  returns: pointer to modified string
- *     args: array containing arg and length of that array
+ * cgi_done -- the cgi reply is complete; go on with the requests
+ *             that came in behind it
  */
-char* modify_argument(char *arg, int len)
+int cgi_done(connection *c)
 {
-    char    *nexttoken;
-    char    *copy = malloc(len);
+    c->state = CS_PARSE;
+    if (next_request(c))
+        serve_pending(c);
+    return CONN_OK;
+}
+
+
+/*
+ * cgi_deadline -- when c's cgi program will have run, or been quiet,
+ *                 too long; NEVER if neither limit is set
+ */
+time_t cgi_deadline(connection *c)
+{
+    time_t  started, active, when = NEVER;
+
+    if (c->proc != NULL) {
+        started = c->proc->started;
+        active = c->proc->active;
+    } else if (c->cgi != NULL) {
+        started = c->cgi->started;
+        active = c->cgi->active;
+    } else
+        return NEVER;
+    if (cgi_timeout > 0)
+        when = started + cgi_timeout;
+    if (cgi_idle_timeout > 0)
+        when = MIN(when, active + cgi_idle_timeout);
+    return when;
+}
+
+
+/*
+ * cgi_expired -- has c's cgi program run, or been quiet, too long?
+ */
+int cgi_expired(connection *c, time_t now)
+{
+    return now >= cgi_deadline(c);
+}
+
 
-    if (copy == NULL)
-        oops("memory error", 1);
-    /* remove all ".." components from path */
-    /* by tokeninzing on "/" and rebuilding */
-    /* the string without the ".." items    */
+/*
+ * conn_deadline -- when c is to be given up on, by its state:
+ *      waiting between requests    keepalive_timeout after the last
+ *      reading a request           header_timeout after it began,
+ *                                  however slowly it trickles in
+ *      running a cgi program       see cgi_deadline
+ *      sending a reply             send_timeout after the reply or
+ *                                  the last rate check began
+ *    note: the loops file this in their timer wheels and ask again
+ *          when it comes, as c has usually moved on by then
+ */
+time_t conn_deadline(connection *c)
+{
+    switch (c->state) {
+    case CS_READ:
+        if (c->inlen == 0 && c->nrequests > 0)
+            return c->last_active + keepalive_timeout;
+        return header_timeout > 0 ? c->mark + header_timeout : NEVER;
+    case CS_CGI:
+        return cgi_deadline(c);
+    default:
+        return send_timeout > 0 ? c->mark + send_timeout : NEVER;
+    }
+}
 
-    *copy = '\0';
 
-    nexttoken = strtok(arg, "/");
-    while (nexttoken != NULL) {
-        if (strcmp(nexttoken, "..") != 0) {
-            if (*copy)
-                strcat(copy, "/");
-            strcat(copy, nexttoken);
+/*
+ * conn_timed_out -- c's deadline has come; is that the end of it?
+ *    rets: 1 if so; 0 if c has moved on, or is sending a reply and
+ *          has kept up min_send_rate since the last check, which
+ *          starts a new one
+ */
+int conn_timed_out(connection *c, time_t now)
+{
+    long long moved = c->sent - c->mark_sent;
+
+    if (now < conn_deadline(c))
+        return 0;
+    if (c->state == CS_READ || c->state == CS_CGI)
+        return 1;
+    if (moved == 0 || moved < (long long) min_send_rate * (now - c->mark))
+        return 1;
+    c->mark = now;
+    c->mark_sent = c->sent;
+    return 0;
+}
+
+
+/*
+ * cgi_expire -- give up on c's cgi program and stop it
+ *    rets: CONN_OK with a 504 reply on c->out if none of its output
+ *          was sent yet; CONN_ERR if it was, as a reply cut short
+ *          can only be ended by closing the connection
+ */
+int cgi_expire(connection *c)
+{
+    if (c->streamed) {
+        log_reply(c, c->proc->sent);
+        cgi_stop(c);
+        return CONN_ERR;
+    }
+    cgi_stop(c);
+    gateway_timeout(c);
+    end_reply(c);
+    return cgi_done(c);
+}
+
+
+/*
+ * cgi_stop -- let go of c's cgi program or pool job, if it has one;
+ *             a program that is still printing is killed
+ */
+void cgi_stop(connection *c)
+{
+    if (c->proc != NULL) {
+        if (LOOPED)
+            evloop_unwatch(c->proc->fd);
+        cgiexec_end(c->proc);
+    }
+    if (c->cgi != NULL)
+        cgipool_release(c->cgi);
+    c->proc = NULL;
+    c->cgi = NULL;
+}
+
+
+/*
+ * cgi_wait -- fork and threads modes: relay c's cgi program until it
+ *             is done, with nothing else to do meanwhile
+ *    rets: CONN_OK, or CONN_ERR if the connection must close
+ *    note: a threads mode socket is non-blocking, so what waits may
+ *          be the client taking the output rather than the program
+ */
+int cgi_wait(connection *c)
+{
+    struct pollfd pfd;
+    int rv;
+
+    while (c->state == CS_CGI) {
+        if ((rv = cgi_continue(c)) == CONN_ERR)
+            return CONN_ERR;
+        if (rv == CONN_OK)
+            continue;
+        if (c->outpos < c->outlen) {
+            pfd.fd = c->fd;
+            pfd.events = POLLOUT;
+        } else {
+            pfd.fd = c->proc->fd;
+            pfd.events = POLLIN;
         }
-        nexttoken = strtok(NULL, "/");
+        poll(&pfd, 1, 1000);
+        if (cgi_expired(c, wheel_now()) && cgi_expire(c) == CONN_ERR)
+            return CONN_ERR;
     }
-    strcpy(arg, copy);
-    free(copy);
+    return CONN_OK;
+}
+
+
+/*
+ * conn_wait -- fork and threads modes: wait for c's socket to be
+ *              ready for events, up to c's deadline
+ *    rets: CONN_OK when it is, CONN_ERR when the deadline passed
+ */
+int conn_wait(connection *c, int events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = c->fd;
+    pfd.events = events;
+    while (!conn_timed_out(c, wheel_now()))
+        if (poll(&pfd, 1, 1000) > 0)
+            return CONN_OK;
+    return CONN_ERR;
+}
+
+
+/*
+ * send_reply -- fork and threads modes: conn_send until it is all
+ *               out, or the client stops taking it
+ */
+int send_reply(connection *c)
+{
+    int rv;
+
+    while ((rv = conn_send(c)) == CONN_AGAIN)
+        if (conn_wait(c, POLLOUT) != CONN_OK)
+            return CONN_ERR;
+    return rv;
+}
 
-    /* the array is now cleaned up */
-    /* handle a special case       */
 
-    if (strcmp(arg, "") == 0)
-        strcpy(arg, ".");
-    return arg;
+/*
+ * wants_keepalive -- may this connection carry another request?
+ *    HTTP/1.1 connections stay open unless the client says close,
+ *    HTTP/1.0 ones close unless the client asks for keep-alive.
+ *    a request with a body closes it: the body is not read, and
+ *    must not be taken for the next request
+ */
+int wants_keepalive(connection *c)
+{
+    slice   *conn = rq_header(&c->rq, "Connection");
+
+    if (c->nrequests + 1 >= keepalive_requests || c->rq.bodylen != 0)
+        return 0;
+    if (c->rq.minor >= 1)
+        return conn == NULL || !slice_is_nocase(conn, "close");
+    return conn != NULL && slice_is_nocase(conn, "keep-alive");
 }
 
+
 /* ------------------------------------------------------ *
-   the reply header thing: all functions need one
-   if content_type is NULL then don't send content type
+   process_rq(connection *c)
+   do what the request in c->rq asks for and build the
+   reply in c.  the request line was split up by the
+   parser:  GET /foo/bar.html HTTP/1.0
+   ------------------------------------------------------ */
+void process_rq(connection *c)
+{
+    request *rq = &c->rq;
+    char    *item;
+    stat_entry *e;
+
+    if (rq->result == RQ_TOOBIG) {
+        too_big(c);
+        return;
+    }
+    if (rq->result != RQ_DONE) {
+        bad_request(c);
+        return;
+    }
+
+    item = rq_path(rq);
+    if (slice_is(&rq->method, "HEAD"))
+        c->head_only = 1;
+    else if (!slice_is(&rq->method, "GET")) {
+        cannot_do(c);
+        return;
+    }
+    if (status_path != NULL && strcmp(item, status_path) == 0) {
+        do_status(c);
+        return;
+    }
+    if (shed_check(ends_in_cgi(item))) {
+        do_503(c);
+        return;
+    }
+
+    e = statcache_get(item);
+    TRACE2(resolved, c->fd, item);
+    TRACE_AT(&c->tr, resolved);
+    TRACE2(handler__start, c->fd, item);
+    TRACE_AT(&c->tr, start);
+    if (not_exist(e))
+        do_404(item, c);
+    else if (no_access(e) == -1)
+        do_500(item, c);
+    else if (isadir(e))
+        do_ls(item, c);
+    else if (ends_in_cgi(item) && c->head_only)
+        header(c, 200, "OK", "text/plain");
+    else if (ends_in_cgi(item))
+        do_exec(item, c);
+    else
+        do_cat(item, e, c);
+    TRACE_AT(&c->tr, end);
+    TRACE3(handler__end, c->fd, c->handler, c->status);
+    statcache_put(e);
+}
+
+
+/* ------------------------------------------------------ *
+   the reply header thing: all functions need one.
+   header() only records the status; end_reply() writes
+   the header once the body length is known, starting
+   with the shared Date and Server lines.
+   a cgi body that is relayed as the program prints it has
+   no length: HTTP/1.1 gets it in chunks, and for HTTP/1.0
+   the connection closes at the end of it
    ------------------------------------------------------ */
 
 /*
- * show_time - displays time in a format fit for human consumption.
- * @rets - null terminated string.
+ * header_prefix - the Date and Server lines every reply carries.
+ * the server name was looked up once by startup(); the date is
+ * formatted again only when the second changes, by each thread
+ * for itself.
+ * @rets - the lines, their length in *lenp
  */
-char* show_time()
+char* header_prefix(int *lenp)
 {
-    struct timeval tv;
+    static __thread char prefix[MAXHOSTNAMELEN + 64];
+    static __thread int len;
+    static __thread time_t made = -1;
+    time_t now = time(NULL);
+    char date[RFC822_LEN];
+
+    if (now != made) {
+        len = snprintf(prefix, sizeof(prefix), "Date: %s\r\nServer: %s\r\n",
+                       rfc822_time(now, date), myhost);
+        made = now;
+    }
+    *lenp = len;
+    return prefix;
+}
 
-    if (gettimeofday(&tv, NULL) == -1)
-        perror("gettimeofday");
 
-    return ctime(&tv.tv_sec);
+void header(connection *c, int code, char *msg, char *content_type)
+{
+    c->status = code;
+    c->msg = msg;
+    c->ctype = content_type;
 }
 
 
-void header(FILE *fp, int code, char *msg, char *content_type)
+/*
+ * end_reply -- put the header and the body text for the current
+ * request on c->out.  a file body follows later from c->bodyfd,
+ * or from memory with the header lines the hot-file cache made.
+ */
+void end_reply(connection *c)
 {
-    fprintf(fp, "HTTP/1.0 %d %s ", code, msg);
-    fprintf(fp, "Date: %s ", show_time());
-    fprintf(fp, "Server: %s ", full_hostname());
-    if (content_type)
-        fprintf(fp, "Content-type: %s\r\n", content_type);
+    FILE    *out = c->out;
+    off_t   len;
+    char    *prefix;
+    int     plen;
+
+    fflush(c->fp);
+    conn_count(c);
+    len = (c->bodyfd != -1 || c->bodyfc != NULL) ? conn_body_length(c)
+                                                 : c->textlen;
+    if (c->streamed && c->rq.minor < 1)
+        c->keepalive = 0;
+    if (!c->streamed)               /* logged when the program ends */
+        log_reply(c, (c->head_only || c->status == 304) ? 0 : len);
+
+    prefix = header_prefix(&plen);
+    fprintf(out, "HTTP/1.1 %d %s\r\n", c->status, c->msg);
+    fwrite(prefix, 1, plen, out);
+    fprintf(out, "Connection: %s\r\n", c->keepalive ? "keep-alive" : "close");
+    fwrite(c->hdrs, 1, c->hdrslen, out);
+    if (c->streamed) {
+        fprintf(out, "Content-type: %s\r\n", c->ctype);
+        if (c->rq.minor >= 1)
+            fprintf(out, "Transfer-Encoding: chunked\r\n");
+        fprintf(out, "\r\n");
+        return;
+    }
+    if (c->status == 304) {         /* no body, so no length for one */
+        fprintf(out, "\r\n");
+        return;
+    }
+    if (c->bodyfc != NULL) {
+        fwrite(c->bodyfc->head, 1, c->bodyfc->headlen, out);
+        if (c->head_only)
+            conn_drop_body(c);
+        return;
+    }
+    fprintf(out, "Content-type: %s\r\n", c->ctype);
+    fprintf(out, "Content-Length: %lld\r\n", (long long) len);
+    fprintf(out, "\r\n");
+
+    if (c->head_only) {
+        conn_drop_body(c);
+    } else
+        fwrite(c->text, 1, c->textlen, out);
+}
+
+
+/*
+ * log_reply -- note the reply to c->rq in the access log
+ *    note: the client's address is looked up once per connection
+ */
+void log_reply(connection *c, off_t bytes)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    void    *ip = NULL;
+    slice   target;
+
+    if (c->peer[0] == '\0') {
+        if (getpeername(c->fd, (struct sockaddr *) &addr, &len) == 0)
+            ip = (addr.ss_family == AF_INET6)
+                 ? (void *) &((struct sockaddr_in6 *) &addr)->sin6_addr
+                 : (void *) &((struct sockaddr_in *) &addr)->sin_addr;
+        if (ip == NULL || inet_ntop(addr.ss_family, ip, c->peer,
+                                    sizeof(c->peer)) == NULL)
+            strcpy(c->peer, "-");
+    }
+    target.ptr = c->target;
+    target.len = c->targetlen;
+    accesslog_write(c->peer, &c->rq, &target, c->status, bytes, c->t_begin,
+                    c->t_parsed);
 }
 
 /* ------------------------------------------------------ *
    simple functions first:
     bad_request(fp)     bad request syntax
+        too_big(fp)         request line and headers over the limit
         cannot_do(fp)       unimplemented HTTP command
     and do_404(item,fp)     no such object
+        do_416(size,fp)     Range outside the file
+        bad_gateway(fp)     a cgi program failed
+    gateway_timeout(fp) a cgi program took too long
    ------------------------------------------------------ */
 
-void bad_request(FILE *fp)
+void bad_request(connection *c)
+{
+    c->handler = ST_400;
+    header(c, 400, "Bad Request", "text/plain");
+    fprintf(c->fp, "I cannot understand your request\r\n");
+}
+
+void too_big(connection *c)
+{
+    c->handler = ST_400;
+    header(c, 431, "Request Header Fields Too Large", "text/plain");
+    fprintf(c->fp, "Your request's headers are too large\r\n");
+}
+
+void cannot_do(connection *c)
+{
+    c->handler = ST_501;
+    header(c, 501, "Not Implemented", "text/plain");
+    fprintf(c->fp, "That command is not yet implemented\r\n");
+}
+
+void do_404(char *item, connection *c)
+{
+    c->handler = ST_404;
+    header(c, 404, "Not Found", "text/plain");
+    fprintf(c->fp, "The item you requested: %s\r\nis not found\r\n", item);
+}
+void do_500(char *item, connection *c)
 {
-    header(fp, 400, "Bad Request", "text/plain");
-    fprintf(fp, "\r\nI cannot understand your request\r\n");
+    c->handler = ST_500;
+    header(c, 500, "Internal Server Error", "text/plain");
+    fprintf(c->fp, "%s\r\n: no permission\r\n", item);
 }
 
-void cannot_do(FILE *fp)
+void bad_gateway(connection *c)
 {
-    header(fp, 501, "Not Implemented", "text/plain");
-    fprintf(fp, "\r\n");
-    fprintf(fp, "That command is not yet implemented\r\n");
+    header(c, 502, "Bad Gateway", "text/plain");
+    fprintf(c->fp, "The cgi program did not answer properly\r\n");
 }
 
-void do_404(char *item, FILE *fp)
+void gateway_timeout(connection *c)
 {
-    header(fp, 404, "Not Found", "text/plain");
-    fprintf(fp, "\r\n");
-    fprintf(fp, "The item you requested: %s\r\nis not found\r\n", item);
+    header(c, 504, "Gateway Timeout", "text/plain");
+    fprintf(c->fp, "The cgi program took too long to answer\r\n");
 }
-void do_500(char *item, FILE *fp)
+
+void do_416(off_t size, connection *c)
 {
-    header(fp, 500, "Internal Server Error", "text/plain");
-    fprintf(fp, "\r\n");
-    fprintf(fp, "%s\r\n: no permission\r\n", item);
+    header(c, 416, "Range Not Satisfiable", "text/plain");
+    conn_add_header(c, "Content-Range: bytes */%lld", (long long) size);
+    fprintf(c->fp, "The requested range is not in the file\r\n");
 }
 
 
 /* ------------------------------------------------------ *
    the directory listing section
-   isadir() uses stat, not_exist() uses stat
+   isadir(), not_exist() and no_access() read the answers
+   statcache_get() found for the path, so the three checks
+   cost one stat at most, and none while the entry is cached
    do_ls runs ls. It should not
    ------------------------------------------------------ */
 
-int isadir(char *f)
+int isadir(stat_entry *e)
 {
-    struct stat info;
-
-    return (stat(f, &info) != -1 && S_ISDIR(info.st_mode));
+    return e->exists && e->readable && S_ISDIR(e->info.st_mode);
 }
 
 
-int not_exist(char *f)
+int not_exist(stat_entry *e)
 {
-    struct stat info;
-
-    return(stat(f, &info) == -1 && errno == ENOENT);
+    return !e->exists;
 }
 
 
-int no_access(char *f)
+int no_access(stat_entry *e)
 {
-    return access(f, R_OK);
+    return e->readable ? 0 : -1;
 }
 
 
+/*
+ * check_if_index -- the index file that stands in for a listing
+ *    rets: "index.html", "index.cgi", or "" if dir has neither
+ */
 char* check_if_index(char* dir)
 {
-    DIR *tmp_dir;
-    struct dirent *file;
-    char buf[1024];
-
-    tmp_dir = opendir(dir);
-    while ((file = readdir(tmp_dir)) != NULL) {
-        strcpy(buf, file->d_name);
-        char* ptr;
-        if ((ptr = strrchr(buf, '.')))
-            *(ptr) = '\0';
-
-        if ((ends_in_html(file->d_name) == 1) && (strcmp(buf, "index") == 0))
-            return file->d_name;
-
-        if ((ends_in_cgi(file->d_name) == 1) && (strcmp(buf, "index") == 0))
-            return file->d_name;
+    static char* names[] = { "index.html", "index.cgi" };
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (access(path, F_OK) == 0)
+            return names[i];
     }
     return "";
 }
 
 
 /*
- * lists the directory named by 'dir'
- * sends the listing to the stream at fp
+ * list_dir -- render the listing of dir
+ *    rets: malloc'd text in *textp, its length in *lenp
  */
-void do_ls(char *dir, FILE *fp)
+void list_dir(char* dir, char** textp, size_t* lenp)
 {
-    header(fp, 200, "OK", "text/plain");
-    fprintf(fp, "\r\n");
-    fflush(fp);
-
+    FILE *fp;
     DIR *tmp_dir;
     struct dirent *file;
     struct stat info_p;
     char  modestr[11];
-    char buf[1024];
-    char* index = check_if_index(dir);
-
-    if (strcmp(index, "") != 0) {
-        snprintf(buf, sizeof(char*)*3, "%s/%s", dir, index);
-        if (strcmp(index, "index.html") == 0)
-            do_cat(buf, fp);
-
-        if (strcmp(index, "index.cgi") == 0)
-            do_exec(buf, fp);
-    } else {
-        tmp_dir = opendir(dir);
-        fprintf(fp, "<html>\n");
+    char  name[IDNAMELEN];
+    char  date[MAXDATELEN];
+    char buf[PATH_MAX];
+
+    if ((fp = open_memstream(textp, lenp)) == NULL)
+        oops("open_memstream", 1);
+    fprintf(fp, "<html>\n");
+    if ((tmp_dir = opendir(dir)) != NULL) {
         while ((file = readdir(tmp_dir)) != NULL) {
-            snprintf(buf, sizeof(char*)*3, "%s/%s", dir, file->d_name);
-            stat(buf, &info_p);
+            snprintf(buf, sizeof(buf), "%s/%s", dir, file->d_name);
+            if (stat(buf, &info_p) == -1)
+                continue;
             mode_to_letters(info_p.st_mode, modestr);
             fprintf(fp, "%s"    , modestr);
             fprintf(fp, "%4d "  , (int) info_p.st_nlink);
-            fprintf(fp, "%-8s " , uid_to_name(info_p.st_uid));
-            fprintf(fp, "%-8s " , gid_to_name(info_p.st_gid));
+            fprintf(fp, "%-8s " , uid_to_name(info_p.st_uid, name));
+            fprintf(fp, "%-8s " , gid_to_name(info_p.st_gid, name));
             fprintf(fp, "%5ld " , (int64_t)info_p.st_size);
-            fprintf(fp, "%s "   , fmt_time(info_p.st_mtime, DATE_FMT));
+            fprintf(fp, "%s "   , fmt_time(info_p.st_mtime, DATE_FMT, date));
             fprintf(fp, "<a href=\"%s\">%s</a><br></br>\n",
                     buf, file->d_name);
         }
-        fprintf(fp, "</html>\n");
         closedir(tmp_dir);
     }
+    fprintf(fp, "</html>\n");
+    fclose(fp);
+}
+
+
+/*
+ * lists the directory named by 'dir', or serves its index file
+ * note: both answers come from the listing cache when it has them.
+ *       the listing is copied into the reply before a new one is
+ *       stored, as another thread may drop it from the cache at once
+ */
+void do_ls(char *dir, connection *c)
+{
+    ls_entry *e;
+    stat_entry *ix;
+    char *index, *text = NULL;
+    size_t len = 0;
+    char buf[PATH_MAX];
+
+    c->handler = ST_LS;
+    if ((e = lscache_get(dir)) != NULL) {
+        index = e->index;           /* a string constant */
+        if (*index == '\0') {
+            header(c, 200, "OK", "text/plain");
+            fwrite(e->text, 1, e->len, c->fp);
+        }
+        lscache_put(e);
+    } else {
+        index = check_if_index(dir);
+        if (*index == '\0') {
+            list_dir(dir, &text, &len);
+            header(c, 200, "OK", "text/plain");
+            fwrite(text, 1, len, c->fp);
+        }
+        if (!lscache_store(dir, index, text, len))
+            free(text);
+    }
+
+    if (*index != '\0') {
+        snprintf(buf, sizeof(buf), "%s/%s", dir, index);
+        if (ends_in_cgi(index))
+            do_exec(buf, c);
+        else {
+            ix = statcache_get(buf);
+            do_cat(buf, ix, c);
+            statcache_put(ix);
+        }
+    }
 }
 
 /* ------------------------------------------------------ *
@@ -609,92 +1270,501 @@ char* file_type(char *f)
     return "";
 }
 
-char* query_string(char *f)
+int ends_in_cgi(char *f)
+{
+    return (strcmp(file_type(f), "cgi") == 0);
+}
+
+int ends_in_html(char *f)
+{
+    return (strcmp(file_type(f), "html") == 0);
+}
+
+/*
+ * do_exec - run prog with its output coming back through a pipe
+ *    note: the connection waits in CS_CGI while cgi_relay passes
+ *          the output on; in the event loop the pipe is watched on
+ *          the connection's behalf, otherwise cgi_wait polls it.
+ *          a query is passed on in QUERY_STRING
+ */
+void do_exec(char *prog, connection *c)
 {
-    char* ptr;
+    char    *query = rq_query(&c->rq);
+    char    *env[3] = { NULL, NULL, NULL };
+    char    *qs = NULL;
 
-    if ((ptr = strrchr(f, '?')) != NULL) {
-        *(ptr) = '\0';
-        setenv("QUERY_STRING", ptr+1, 1);
-        setenv("REQUEST_METHOD", "GET", 1);
+    c->handler = ST_EXEC;
+    if (LOOPED && cgipool_has(prog)) {
+        do_pooled(prog, c);
+        return;
+    }
+    if (query != NULL
+            && (qs = malloc(strlen(query) + sizeof("QUERY_STRING="))) != NULL) {
+        sprintf(qs, "QUERY_STRING=%s", query);
+        env[0] = qs;
+        env[1] = "REQUEST_METHOD=GET";
+    }
+    c->proc = cgiexec_start(prog, env);
+    free(qs);
+    if (c->proc == NULL) {
+        perror(prog);
+        bad_gateway(c);
+        return;
     }
-    return f;
+    if (LOOPED)
+        evloop_watch(c->proc->fd, c);
+    c->state = CS_CGI;
 }
 
-int ends_in_cgi(char *f)
+
+/*
+ * do_503 -- the server is too busy for this request (see shed.c);
+ *           close the connection too, it is one less to serve
+ */
+void do_503(connection *c)
 {
-    return (strcmp(file_type(f), "cgi") == 0);
+    c->handler = ST_503;
+    header(c, 503, "Service Unavailable", "text/plain");
+    conn_add_header(c, "Retry-After: %d", retry_after);
+    fputs(SHED_TEXT, c->fp);
+    c->keepalive = 0;
 }
 
-int ends_in_html(char *f)
+
+/*
+ * do_status -- the counters kept by stats.c, as text, or as JSON
+ *              for /server-status?json
+ */
+void do_status(connection *c)
 {
-    return (strcmp(file_type(f), "html") == 0);
+    char    *query = rq_query(&c->rq);
+    int     json = (query != NULL && strcmp(query, "json") == 0);
+
+    c->handler = ST_STATUS;
+    header(c, 200, "OK", json ? "application/json" : "text/plain");
+    conn_add_header(c, "Cache-Control: no-cache");
+    stats_report(c->fp, json);
 }
 
-void do_exec(char *prog, FILE *fp)
+
+/*
+ * do_pooled -- hand the request to a worker of prog's cgi pool
+ *    note: the connection waits in CS_CGI; cgi_continue takes the
+ *          answer and makes a reply of it
+ */
+void do_pooled(char *prog, connection *c)
+{
+    request *rq = &c->rq;
+    char    *params = NULL;
+    size_t  plen = 0;
+    FILE    *fp = open_memstream(&params, &plen);
+    char    *cp;
+    int     i, n;
+
+    if (fp == NULL)
+        oops("open_memstream", 1);
+    fprintf(fp, "GATEWAY_INTERFACE=CGI/1.1%c", 0);
+    fprintf(fp, "SERVER_SOFTWARE=wsng/%s%c", VERSION, 0);
+    fprintf(fp, "SERVER_NAME=%s%c", myhost, 0);
+    fprintf(fp, "SERVER_PORT=%d%c", myport, 0);
+    fprintf(fp, "SERVER_PROTOCOL=%.*s%c", rq->version.len,
+            rq->version.ptr, 0);
+    fprintf(fp, "REQUEST_METHOD=%.*s%c", rq->method.len, rq->method.ptr, 0);
+    fprintf(fp, "SCRIPT_NAME=/%s%c", prog, 0);
+    fprintf(fp, "QUERY_STRING=%.*s%c", rq->query.len,
+            rq->query.ptr ? rq->query.ptr : "", 0);
+    for (i = 0; i < rq->nheaders; i++) {
+        fprintf(fp, "HTTP_");
+        for (n = 0, cp = rq->headers[i].name.ptr; n < rq->headers[i].name.len;
+             n++, cp++)
+            putc(*cp == '-' ? '_' : toupper((unsigned char) *cp), fp);
+        fprintf(fp, "=%.*s%c", rq->headers[i].value.len,
+                rq->headers[i].value.ptr, 0);
+    }
+    fclose(fp);
+
+    c->cgi = cgipool_submit(prog, params, plen, c);
+    c->state = CS_CGI;
+    free(params);
+}
+
+
+/*
+ * cgi_reply -- make a reply of what a cgi program printed
+ *    note: its header lines are passed on, except that Status sets
+ *          the status line and Content-type the type; a Location
+ *          with no Status is a redirect.  the rest is the body
+ */
+void cgi_reply(connection *c, char *out, size_t len)
+{
+    char    *p = out, *end = out + len, *nl, *colon, *val;
+    char    *ctype = "text/plain";
+    int     code = 200, vlen;
+    char    *msg = "OK";
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        *nl = '\0';
+        if (nl > p && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if (*p == '\0') {              /* the blank line */
+            p = nl + 1;
+            break;
+        }
+        if ((colon = strchr(p, ':')) != NULL) {
+            *colon = '\0';
+            for (val = colon + 1; *val == ' ' || *val == '\t'; val++)
+                ;
+            vlen = strlen(val);
+            if (strcasecmp(p, "Status") == 0 && vlen >= 3) {
+                code = atoi(val);
+                msg = (vlen > 4) ? val + 4 : "";
+            } else if (strcasecmp(p, "Content-type") == 0)
+                ctype = val;
+            else {
+                if (strcasecmp(p, "Location") == 0 && code == 200) {
+                    code = 302;
+                    msg = "Found";
+                }
+                conn_add_header(c, "%s: %s", p, val);
+            }
+        }
+        p = nl + 1;
+    }
+    header(c, code, msg, ctype);
+    fwrite(p, 1, end - p, c->fp);
+}
+
+
+/*
+ * cgi_relay -- pass on what an exec'd cgi program prints
+ *    rets: CONN_AGAIN when the pipe is empty or the client is not
+ *          taking more, CONN_ERR if the client has gone, CONN_OK
+ *          when the program is done and the reply is complete
+ *    note: the header is held until its blank line, then each read
+ *          goes out as one chunk.  what the client has not taken
+ *          yet stays in the pipe, so the program waits for it
+ */
+int cgi_relay(connection *c)
+{
+    cgi_proc *p = c->proc;
+    char    buf[CGI_READLEN];
+    ssize_t n;
+    int     rv;
+
+    while (1) {
+        if ((rv = conn_push(c)) != CONN_OK)
+            return rv;
+        n = cgiexec_read(p, buf, sizeof(buf));
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return CONN_AGAIN;
+        if (n <= 0)
+            break;
+        if (p->streaming)
+            put_chunk(c, buf, n);
+        else if (cgi_head(c, buf, n) == -1)
+            break;
+    }
+
+    if (p->streaming) {
+        if (c->rq.minor >= 1)
+            fprintf(c->out, "0\r\n\r\n");
+        log_reply(c, p->sent);
+    } else {                        /* it never finished a header */
+        if (n <= 0 && p->headlen > 0)
+            cgi_reply(c, p->head, p->headlen);
+        else
+            bad_gateway(c);
+        end_reply(c);
+    }
+    cgi_stop(c);
+    return cgi_done(c);
+}
+
+
+/*
+ * cgi_head -- collect the cgi header; at its blank line start the
+ *             reply and send what followed as the first chunk
+ *    rets: 0, or -1 if the header is too long to be one
+ *    note: a read may hold the header and much of the body, so only
+ *          what fits is kept back; the rest goes out as a chunk
+ */
+int cgi_head(connection *c, char *buf, size_t len)
+{
+    cgi_proc *p = c->proc;
+    size_t  take = CGI_HEADMAX - p->headlen, body;
+
+    if (p->head == NULL && (p->head = malloc(CGI_HEADMAX)) == NULL)
+        oops("malloc", 1);
+    if (take > len)
+        take = len;
+    memcpy(p->head + p->headlen, buf, take);
+    p->headlen += take;
+    if ((body = head_end(p->head, p->headlen)) == 0)
+        return (p->headlen == CGI_HEADMAX) ? -1 : 0;
+
+    cgi_reply(c, p->head, body);
+    c->streamed = 1;
+    end_reply(c);
+    p->streaming = 1;
+    if (body < p->headlen)
+        put_chunk(c, p->head + body, p->headlen - body);
+    if (take < len)
+        put_chunk(c, buf + take, len - take);
+    return 0;
+}
+
+
+/*
+ * head_end -- where the body starts in a cgi program's output
+ *    rets: the offset just past the blank line, or 0 if there is
+ *          none yet
+ */
+size_t head_end(char *s, size_t len)
 {
-    int fd = fileno(fp);
+    size_t  i;
+
+    if (len > 0 && s[0] == '\n')
+        return 1;
+    if (len > 1 && s[0] == '\r' && s[1] == '\n')
+        return 2;
+    for (i = 0; i + 1 < len; i++) {
+        if (s[i] != '\n')
+            continue;
+        if (s[i+1] == '\n')
+            return i + 2;
+        if (i + 2 < len && s[i+1] == '\r' && s[i+2] == '\n')
+            return i + 3;
+    }
+    return 0;
+}
 
-    header(fp, 200, "OK", NULL);
-    fflush(fp);
 
-    dup2(fd, 1);
-    dup2(fd, 2);
-    execl(prog, prog, NULL);
-    perror(prog);
+/*
+ * put_chunk -- a piece of the cgi body, framed for HTTP/1.1
+ */
+void put_chunk(connection *c, char *buf, size_t len)
+{
+    c->proc->sent += len;
+    if (c->rq.minor >= 1)
+        fprintf(c->out, "%zx\r\n", len);
+    fwrite(buf, 1, len, c->out);
+    if (c->rq.minor >= 1)
+        fprintf(c->out, "\r\n");
 }
+
+
 /* ------------------------------------------------------ *
-   do_cat(filename,fp)
-   sends back contents after a header
+   do_cat(filename,e,c)
+   sends back contents after a header; e is the stat
+   cache entry the caller looked up for filename.  the
+   body itself is sent by conn_send from c->bodyfd with
+   sendfile, so it never passes through our buffers.  the
+   descriptor belongs to e, which the connection holds on
+   to until the body is out.  files in the
+   hot-file cache go out from memory with one writev.
+   small files are copied into the reply text when more
+   requests are waiting, so a run of pipelined requests
+   still makes one write
    ------------------------------------------------------ */
 
-void do_cat(char *f, FILE *fpsock)
+void do_cat(char *f, stat_entry *e, connection *c)
 {
-    char *extension = file_type(f);
-    char *content = "text/plain";
-    FILE *fpfile;
-    int c;
+    char *content = mime_lookup(file_type(f));
+    off_t size = e->info.st_size;
+    slice *range = rq_header(&c->rq, "Range");
+    byterange r[RANGE_MAX];
+    int nranges = RANGE_NONE;
+    char buf[INLINE_MAX];
+    int n;
+
+    c->handler = ST_CAT;
+    if (content == NULL)
+        content = "text/plain";
+
+    if (e->fd == -1) {
+        do_500(f, c);
+        return;
+    }
+    if (not_modified(e, c)) {
+        conn_add_header(c, "ETag: %s", e->etag);
+        conn_add_header(c, "Last-Modified: %s", e->lastmod);
+        header(c, 304, "Not Modified", content);
+        return;
+    }
+    if (range != NULL && if_range(e, c))
+        nranges = range_parse(range, size, r, RANGE_MAX);
+    if (nranges == RANGE_UNSAT) {
+        do_416(size, c);
+        return;
+    }
+    header(c, 200, "OK", content);
+    if (nranges == RANGE_NONE && (size > INLINE_MAX || !pipelined(c))
+            && (c->bodyfc = filecache_get(e, content)) != NULL) {
+        c->bodypos = 0;
+        c->bodyend = size;
+        return;
+    }
+    conn_add_header(c, "ETag: %s", e->etag);
+    conn_add_header(c, "Last-Modified: %s", e->lastmod);
+    conn_add_header(c, "Accept-Ranges: bytes");
+    if (nranges > 0) {
+        do_ranges(e, content, r, nranges, c);
+        return;
+    }
+    if (size <= INLINE_MAX && !c->head_only) {
+        if ((n = pread(e->fd, buf, size, 0)) > 0)
+            fwrite(buf, 1, n, c->fp);
+        return;
+    }
+    c->bodyent = statcache_hold(e);
+    c->bodyfd = e->fd;
+    c->bodypos = 0;
+    c->bodyend = size;
+}
+
+
+/*
+ * pipelined -- has the client sent more after this request?
+ */
+int pipelined(connection *c)
+{
+    return c->inlen > c->rq.length;
+}
+
+
+/*
+ * etag_match -- is tag in the If-None-Match list?
+ *    note: the weak comparison, so W/"x" matches "x"; "*" matches
+ *          any file that exists
+ */
+int etag_match(slice *list, char *tag)
+{
+    char    *p = list->ptr, *end = list->ptr + list->len;
+    slice   one;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        one.ptr = p;
+        while (p < end && *p != ',')
+            p++;
+        one.len = p - one.ptr;
+        while (one.len > 0 && (one.ptr[one.len-1] == ' '
+                               || one.ptr[one.len-1] == '\t'))
+            one.len--;
+        if (one.len >= 2 && strncmp(one.ptr, "W/", 2) == 0) {
+            one.ptr += 2;
+            one.len -= 2;
+        }
+        if (one.len > 0 && (slice_is(&one, "*") || slice_is(&one, tag)))
+            return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * not_modified -- may we answer 304 instead of sending e?
+ *    note: If-None-Match wins over If-Modified-Since when a client
+ *          sends both (RFC 9110 13.2.2)
+ */
+int not_modified(stat_entry *e, connection *c)
+{
+    slice   *inm = rq_header(&c->rq, "If-None-Match");
+    slice   *ims = rq_header(&c->rq, "If-Modified-Since");
+    time_t  since;
+
+    if (inm != NULL)
+        return etag_match(inm, e->etag);
+    if (ims != NULL && (since = rfc822_parse(ims->ptr, ims->len)) != -1)
+        return e->info.st_mtime <= since;
+    return 0;
+}
 
-    content_type* typeptr;
-    typeptr = head;
-    while (typeptr->next != NULL) {
-        printf("%s %s\n", typeptr->ext, typeptr->content);
-        if (strcmp(typeptr->ext, extension) == 0)
-            content = typeptr->content;
 
-        typeptr = typeptr->next;
+/*
+ * if_range -- should a Range header be honoured?
+ *    rets: 1 without If-Range, or if it names the file as it is now
+ *          (the strong ETag, or exactly its Last-Modified date)
+ */
+int if_range(stat_entry *e, connection *c)
+{
+    slice   *ir = rq_header(&c->rq, "If-Range");
+
+    if (ir == NULL)
+        return 1;
+    if (ir->len > 0 && (ir->ptr[0] == '"' || ir->ptr[0] == 'W'))
+        return slice_is(ir, e->etag);
+    return rfc822_parse(ir->ptr, ir->len) == e->info.st_mtime;
+}
+
+
+/*
+ * do_ranges -- answer with just the byte ranges asked for
+ *    note: one range is sent as it is with a Content-Range header,
+ *          several as multipart/byteranges, a part per range.  in
+ *          both cases the bytes go out from e->fd by conn_send
+ */
+void do_ranges(stat_entry *e, char *content, byterange *r, int n,
+               connection *c)
+{
+    static __thread char boundary[40];     /* one per thread will do */
+    static __thread char ctype[80];
+    char    head[LINELEN];
+    long long size = e->info.st_size;
+    int     i, len;
+
+    c->bodyent = statcache_hold(e);
+    c->bodyfd = e->fd;
+    if (n == 1) {
+        header(c, 206, "Partial Content", content);
+        conn_add_header(c, "Content-Range: bytes %lld-%lld/%lld",
+                        (long long) r[0].first, (long long) r[0].last, size);
+        c->bodypos = r[0].first;
+        c->bodyend = r[0].last + 1;
+        return;
     }
 
-    fpfile = fopen(f, "r");
-    if (fpfile != NULL) {
-        header(fpsock, 200, "OK", content);
-        fprintf(fpsock, "\r\n");
-        while ((c = getc(fpfile)) != EOF)
-            putc(c, fpsock);
-        fclose(fpfile);
+    if (*boundary == '\0') {
+        snprintf(boundary, sizeof(boundary), "wsng%08x%08lx",
+                 (unsigned) getpid(), (unsigned long) time(NULL));
+        snprintf(ctype, sizeof(ctype), "multipart/byteranges; boundary=%s",
+                 boundary);
+    }
+    header(c, 206, "Partial Content", ctype);
+    for (i = 0; i < n; i++) {
+        len = snprintf(head, sizeof(head), "%s--%s\r\nContent-Type: %s\r\n"
+                       "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                       i > 0 ? "\r\n" : "", boundary, content,
+                       (long long) r[i].first, (long long) r[i].last, size);
+        conn_add_part(c, head, len, r[i].first, r[i].last + 1);
     }
+    len = snprintf(head, sizeof(head), "\r\n--%s--\r\n", boundary);
+    conn_add_part(c, head, len, 0, 0);
 }
 
-char * full_hostname()
+char * full_hostname(char *fullname)
 /*
- * returns full `official' hostname for current machine
- * NOTE: this returns a ptr to a static buffer that is
- *       overwritten with each call. ( you know what to do.)
+ * puts the full `official' hostname for current machine in
+ * fullname[MAXHOSTNAMELEN] and returns it
+ * NOTE: this may wait on DNS, so it is called once, by startup();
+ *       replies use the copy in myhost
  */
 {
-    struct hostent *hp;
-    char hname[MAXHOSTNAMELEN];
-    static char fullname[MAXHOSTNAMELEN];
+    struct addrinfo hints, *ai;
 
-    if (gethostname(hname, MAXHOSTNAMELEN) == -1) {
+    if (gethostname(fullname, MAXHOSTNAMELEN) == -1) {
         perror("gethostname");
         exit(1);
     }
-    hp = gethostbyname(hname);        /* get info about host  */
-    if (hp == NULL)                   /*   or die     */
-        return NULL;
-    strcpy(fullname, hp->h_name);     /* store foo.bar.com    */
-    return fullname;                  /* and return it    */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_CANONNAME;
+    if (getaddrinfo(fullname, NULL, &hints, &ai) != 0)
+        return fullname;                /* keep short name    */
+    if (ai->ai_canonname != NULL)       /* store foo.bar.com  */
+        snprintf(fullname, MAXHOSTNAMELEN, "%s", ai->ai_canonname);
+    freeaddrinfo(ai);
+    return fullname;
 }
 
 
@@ -0,0 +1,52 @@
+#ifndef WSNG_H
+#define WSNG_H
+
+#include    "conn.h"
+
+/*
+ * wsng.h - what the server loops need from wsng.c
+ */
+
+/* server_mode values, set with "server_mode" in wsng.conf */
+#define MODE_FORK   0       /* fork a child for each request     */
+#define MODE_EPOLL  1       /* one process, epoll event loop     */
+#define MODE_PREFORK 2      /* workers each running the loop     */
+#define MODE_THREADS 3      /* threads sharing out connections   */
+
+extern int server_mode;
+extern int keepalive_timeout;
+extern int header_timeout;
+extern int send_timeout;
+extern int min_send_rate;
+extern int stat_cache_ttl;
+extern int ls_cache_ttl;
+extern long cache_size;
+extern int cgi_timeout;
+extern int cgi_idle_timeout;
+extern int use_io_uring;
+extern int listen_backlog;
+extern int tcp_nodelay;
+extern int tcp_defer_accept;
+extern int tcp_fastopen;
+extern int so_rcvbuf;
+extern int so_sndbuf;
+extern int busy_poll;
+extern int shed_active;
+extern int shed_queue;
+extern int shed_target;
+extern int shed_interval;
+extern int retry_after;
+
+void    serve_pending(connection* c);
+int     cgi_continue(connection* c);
+int     cgi_wait(connection* c);
+int     cgi_expired(connection* c, time_t now);
+int     cgi_expire(connection* c);
+void    cgi_stop(connection* c);
+time_t  conn_deadline(connection* c);
+int     conn_timed_out(connection* c, time_t now);
+int     send_reply(connection* c);
+int     wants_keepalive(connection* c);
+void    process_rq(connection* c);
+
+#endif
@@ -12,17 +12,17 @@
 
 
 char *
-fmt_time( time_t timeval , char *fmt )
+fmt_time( time_t timeval , char *fmt, char result[] )
 /*
- * formats time for human consumption.
- * Uses localtime to convert the timeval into a struct of elements
+ * formats time for human consumption into result[MAXDATELEN].
+ * Uses localtime_r to convert the timeval into a struct of elements
  * (see localtime(3)) and uses strftime to format the data
  */
 {
-    static char result[MAXDATELEN];
+    struct tm tm;
 
-    struct tm *tp = localtime(&timeval);        /* convert time */
-    strftime(result, MAXDATELEN, fmt, tp);      /* format it    */
+    localtime_r(&timeval, &tm);                 /* convert time */
+    strftime(result, MAXDATELEN, fmt, &tm);     /* format it    */
     return result;
 }
 
@@ -57,38 +57,85 @@ char *mode_to_letters( int mode, char str[] )
 
 
 #include    <pwd.h>
+#include    <grp.h>
+#include    <pthread.h>
+
+/*
+ * uid_to_name and gid_to_name remember what they found, since a
+ * directory listing asks about the same few ids over and over and
+ * each lookup may read /etc/passwd or ask nss.  the tables are
+ * direct mapped: a slot holds the last id that hashed there.  they
+ * are shared by the threads of the threads mode, so they are locked,
+ * and each caller gets its own copy of the name.
+ */
+
+#define NAMESLOTS   64              /* power of two */
+#define NSSBUFLEN   4096            /* for getpwuid_r and getgrgid_r */
 
-char *uid_to_name( uid_t uid )
+struct id_name {
+    int     used;
+    unsigned id;
+    char    name[IDNAMELEN];
+};
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int recall( struct id_name *slot, unsigned id, char name[] )
+{
+    int     found;
+
+    pthread_mutex_lock(&names_lock);
+    if ( (found = slot->used && slot->id == id) )
+        strcpy(name, slot->name);
+    pthread_mutex_unlock(&names_lock);
+    return found;
+}
+
+static char *remember( struct id_name *slot, unsigned id, char name[] )
+{
+    pthread_mutex_lock(&names_lock);
+    slot->used = 1;
+    slot->id = id;
+    strcpy(slot->name, name);
+    pthread_mutex_unlock(&names_lock);
+    return name;
+}
+
+char *uid_to_name( uid_t uid, char name[] )
 /* 
- *  returns pointer to username associated with uid, uses getpw()
+ *  puts the username associated with uid in name[IDNAMELEN], or
+ *  the number if it has none; uses getpwuid_r()
  */ 
 {
-    struct  passwd *pw_ptr;
-    static  char numstr[10];
-
-    if ( ( pw_ptr = getpwuid( uid ) ) == NULL ){
-        sprintf(numstr,"%d", uid);
-        return numstr;
-    }
+    static  struct id_name seen[NAMESLOTS];
+    struct  id_name *slot = &seen[uid & (NAMESLOTS - 1)];
+    struct  passwd pw, *pw_ptr;
+    char    buf[NSSBUFLEN];
+
+    if ( recall(slot, uid, name) )
+        return name;
+    if ( getpwuid_r(uid, &pw, buf, sizeof(buf), &pw_ptr) != 0 || pw_ptr == NULL )
+        snprintf(name, IDNAMELEN, "%d", uid);
     else
-        return pw_ptr->pw_name ;
+        snprintf(name, IDNAMELEN, "%s", pw.pw_name);
+    return remember(slot, uid, name);
 }
 
-#include    <grp.h>
-
-char *gid_to_name( gid_t gid )
+char *gid_to_name( gid_t gid, char name[] )
 /*
- *  returns pointer to group number gid. used getgrgid(3)
+ *  puts the name of group gid in name[IDNAMELEN]; uses getgrgid_r()
  */
 {
-    struct group *grp_ptr;
-    static  char numstr[10];
-
-    if ( ( grp_ptr = getgrgid(gid) ) == NULL ){
-        sprintf(numstr,"%d", gid);
-        return numstr;
-    }
+    static  struct id_name seen[NAMESLOTS];
+    struct  id_name *slot = &seen[gid & (NAMESLOTS - 1)];
+    struct  group gr, *grp_ptr;
+    char    buf[NSSBUFLEN];
+
+    if ( recall(slot, gid, name) )
+        return name;
+    if ( getgrgid_r(gid, &gr, buf, sizeof(buf), &grp_ptr) != 0 || grp_ptr == NULL )
+        snprintf(name, IDNAMELEN, "%d", gid);
     else
-        return grp_ptr->gr_name;
+        snprintf(name, IDNAMELEN, "%s", gr.gr_name);
+    return remember(slot, gid, name);
 }
-
@@ -5,10 +5,11 @@
 
 #define DATE_FMT    "%b %e %H:%M"
 #define MAXDATELEN  100
+#define IDNAMELEN   33              /* a user or group name, and a NUL */
 
-char *fmt_time( time_t timeval , char *fmt );
+char *fmt_time( time_t timeval , char *fmt, char result[] );
 char *mode_to_letters( int mode, char str[] );
-char *uid_to_name( uid_t uid );
-char *gid_to_name( gid_t gid );
+char *uid_to_name( uid_t uid, char name[] );
+char *gid_to_name( gid_t gid, char name[] );
 
 #endif